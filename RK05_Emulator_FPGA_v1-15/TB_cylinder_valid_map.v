@@ -0,0 +1,207 @@
+//==========================================================================================================
+// RK05 Emulator
+// cylinder valid map
+// File Name: TB_cylinder_valid_map.v
+// Functions:
+//   TB for my module, with seek_to_cylinder behind it so Access Ready is checked as the 1130 sees it
+//   Each check is compared with the expected value and the errors are counted, PASS or FAIL at the end
+//
+//==========================================================================================================
+
+module TB_cylinder_valid_map(
+);
+
+//============================ Internal Connections ==================================
+
+     reg clock;
+     reg reset;
+     reg demand_load;
+     reg cylinder_loaded_spi;
+     reg [7:0] spi_serpar_reg;
+     reg [7:0] Cylinder_Address;  // cylinder set by the TB for the checks of the map alone
+     reg use_arm;                 // the map looks at the cylinder the seek logic moved the arm to
+     wire [7:0] map_cylinder;
+     wire Cylinder_Valid;
+
+     reg BUS_ACC_GO_L;
+     reg BUS_ACC_REV_L;
+     reg BUS_10_20_L;
+     reg clkenbl_sector;
+     wire [7:0] arm_cylinder;
+     wire BUS_ACCESS_RDY_EMUL_H;
+     wire BUS_HOME_DRIVE_EMUL_L;
+     wire oncylinder_indicator;
+     wire strobe_selected_ready;
+
+     wire clock_pulse;
+     wire data_pulse;
+     wire clkenbl_read_bit;
+     wire clkenbl_read_data;
+     wire clkenbl_1usec;
+
+     integer errors;
+
+ assign map_cylinder = use_arm ? arm_cylinder : Cylinder_Address;
+
+ cylinder_valid_map DUT (
+.clock (clock),
+.reset (reset),
+.demand_load (demand_load),
+.cylinder_loaded_spi (cylinder_loaded_spi),
+.spi_serpar_reg (spi_serpar_reg),
+.Cylinder_Address (map_cylinder),
+.Cylinder_Valid (Cylinder_Valid)
+);
+
+ seek_to_cylinder myseek (
+.clock (clock),
+.reset (reset),
+.Selected_Ready (1'b1),
+.BUS_ACC_GO_L (BUS_ACC_GO_L),
+.BUS_ACC_REV_L (BUS_ACC_REV_L),
+.BUS_10_20_L (BUS_10_20_L),
+.clkenbl_sector (clkenbl_sector),
+.clkenbl_1usec (clkenbl_1usec),
+.BUS_HOME_DRIVE_L (1'b1),
+.Cart_Ready (1'b1),
+.real_drive (1'b0),
+.Reset_Cylinder (1'b0),
+.Cylinder_Valid (Cylinder_Valid),
+.Cylinder_Address (arm_cylinder),
+.BUS_ACCESS_RDY_EMUL_H (BUS_ACCESS_RDY_EMUL_H),
+.BUS_HOME_DRIVE_EMUL_L (BUS_HOME_DRIVE_EMUL_L),
+.oncylinder_indicator (oncylinder_indicator),
+.strobe_selected_ready (strobe_selected_ready)
+);
+
+ timing_gen mytiming (
+.clock (clock),
+.reset (reset),
+.clkenbl_read_bit (clkenbl_read_bit),
+.clkenbl_read_data (clkenbl_read_data),
+.clock_pulse (clock_pulse),
+.data_pulse (data_pulse),
+.clkenbl_1usec (clkenbl_1usec)
+);
+
+
+//============================ Start of Code =========================================
+// clock and reset
+  initial begin
+    clock = 1'b0;
+    forever #12.5 clock = ~clock;
+  end
+
+  initial begin
+   reset = 1'b1;
+    #35
+   reset = 1'b0;
+  end
+
+// one clock pulse as the SPI interface produces at the end of a 0x18 message
+task mark_loaded;
+  input [7:0] cylinder;
+  begin
+    @(posedge clock)
+    spi_serpar_reg <= cylinder;
+    cylinder_loaded_spi <= 1'b1;
+    @(posedge clock)
+    cylinder_loaded_spi <= 1'b0;
+    #100;
+  end
+endtask
+
+// put the arm on a cylinder and check whether it may be accessed
+task check_cylinder;
+  input [7:0] cylinder;
+  input expected;
+  begin
+    @(posedge clock)
+    Cylinder_Address <= cylinder;
+    #100
+    if (Cylinder_Valid !== expected) begin
+      $display("ERROR demand load %b cylinder %d valid %b, expected %b", demand_load, cylinder, Cylinder_Valid, expected);
+      errors = errors + 1;
+    end
+  end
+endtask
+
+// check Access Ready from the seek logic
+task check_ready;
+  input expected;
+  begin
+    if (BUS_ACCESS_RDY_EMUL_H !== expected) begin
+      $display("ERROR at %t cylinder %d access ready %b, expected %b", $time, arm_cylinder, BUS_ACCESS_RDY_EMUL_H, expected);
+      errors = errors + 1;
+    end
+  end
+endtask
+
+// test conditions
+  initial begin
+    errors = 0;
+    demand_load <= 1'b0;
+    cylinder_loaded_spi <= 1'b0;
+    spi_serpar_reg <= 8'd0;
+    Cylinder_Address <= 8'd0;
+    use_arm <= 1'b0;
+    BUS_ACC_GO_L <= 1'b1;
+    BUS_ACC_REV_L <= 1'b1;
+    BUS_10_20_L <= 1'b1;
+    clkenbl_sector <= 1'b0;
+    @(negedge reset)
+    #1000
+
+    // every cylinder is valid when the whole image was loaded
+    check_cylinder(8'd150, 1'b1);
+
+    // demand loading with cylinders 0 and 150 loaded
+    demand_load <= 1'b1;
+    mark_loaded(8'd0);
+    check_cylinder(8'd0, 1'b1);
+    check_cylinder(8'd5, 1'b0);
+    mark_loaded(8'd150);
+    check_cylinder(8'd150, 1'b1);
+
+    // loading finished
+    demand_load <= 1'b0;
+    check_cylinder(8'd5, 1'b1);
+
+    // the map is empty when demand loading starts again
+    demand_load <= 1'b1;
+    check_cylinder(8'd150, 1'b0);
+
+    // the arm is on cylinder 0, which is loaded, and is stepped to cylinder 1, which is not
+    use_arm <= 1'b1;
+    mark_loaded(8'd0);
+    #1000
+    check_ready(1'b1);
+    BUS_ACC_REV_L <= 1'b1;
+    BUS_10_20_L <= 1'b0;
+    #250
+    BUS_ACC_GO_L <= 1'b0;
+    @(negedge BUS_ACCESS_RDY_EMUL_H)
+    BUS_ACC_GO_L <= 1'b1;
+
+    // Access Ready stays low past the 15 ms of the seek while the cylinder is not loaded
+    #20000000
+    if (arm_cylinder !== 8'd1) begin
+      $display("ERROR arm on cylinder %d, expected 1", arm_cylinder);
+      errors = errors + 1;
+    end
+    check_ready(1'b0);
+
+    // and comes up once the Pico marks it loaded
+    mark_loaded(8'd1);
+    #100
+    check_ready(1'b1);
+
+    $display("%d errors", errors);
+    if (errors == 0)
+      $display("PASS");
+    else
+      $display("FAIL");
+    $stop;
+  end
+
+endmodule
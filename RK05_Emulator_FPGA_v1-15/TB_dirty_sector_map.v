@@ -0,0 +1,151 @@
+//==========================================================================================================
+// RK05 Emulator
+// dirty sector map
+// File Name: TB_dirty_sector_map.v
+// Functions:
+//   TB for my module
+//   Each map byte read is compared with the expected value and the errors are counted, PASS or FAIL at the end
+//
+//==========================================================================================================
+
+module TB_dirty_sector_map(
+);
+
+//============================ Internal Connections ==================================
+
+     reg clock;
+     reg reset;
+     reg bus_sector_write;
+     reg [7:0] Cylinder_Address;
+     reg Head_Select;
+     reg [1:0] Sector_Address;
+     reg dirty_map_reset_spi;
+     reg dirty_map_read_spi;
+     wire [7:0] dirty_map_data;
+
+     integer i;
+     integer errors;
+     reg [31:0] expected;   // the four map bytes expected, cylinder 0 in the high byte
+
+
+ dirty_sector_map DUT (
+.clock (clock),
+.reset (reset),
+.bus_sector_write (bus_sector_write),
+.Cylinder_Address (Cylinder_Address),
+.Head_Select (Head_Select),
+.Sector_Address (Sector_Address),
+.dirty_map_reset_spi (dirty_map_reset_spi),
+.dirty_map_read_spi (dirty_map_read_spi),
+.dirty_map_data (dirty_map_data)
+);
+
+
+//============================ Start of Code =========================================
+// clock and reset
+  initial begin
+    clock = 1'b0;
+    forever #12.5 clock = ~clock;
+  end
+
+  initial begin
+   reset = 1'b1;
+    #35
+   reset = 1'b0;
+  end
+
+// one clock pulse marking the sector under the heads as written
+task mark_sector;
+  input [7:0] cylinder;
+  input head;
+  input [1:0] sector;
+  begin
+    @(posedge clock)
+    Cylinder_Address <= cylinder;
+    Head_Select <= head;
+    Sector_Address <= sector;
+    bus_sector_write <= 1'b1;
+    @(posedge clock)
+    bus_sector_write <= 1'b0;
+    #500;
+  end
+endtask
+
+// one clock pulse as the SPI interface produces at the end of a 0x99 message
+task read_map_byte;
+  begin
+    @(posedge clock)
+    dirty_map_read_spi <= 1'b1;
+    @(posedge clock)
+    dirty_map_read_spi <= 1'b0;
+    #500;
+  end
+endtask
+
+// return the read pointer to cylinder 0 as a 0x17 message does
+task reset_read_pointer;
+  begin
+    @(posedge clock)
+    dirty_map_reset_spi <= 1'b1;
+    @(posedge clock)
+    dirty_map_reset_spi <= 1'b0;
+    #500;
+  end
+endtask
+
+// read the bytes of the first four cylinders and compare them with expected
+task check_map;
+  begin
+    reset_read_pointer;
+    for (i = 0; i < 4; i = i + 1) begin
+      if (dirty_map_data !== expected[31 - 8 * i -: 8]) begin
+        $display("ERROR cylinder %d dirty map %h, expected %h", i, dirty_map_data, expected[31 - 8 * i -: 8]);
+        errors = errors + 1;
+      end
+      read_map_byte;
+    end
+  end
+endtask
+
+// test conditions
+  initial begin
+    errors = 0;
+    bus_sector_write <= 1'b0;
+    Cylinder_Address <= 8'd0;
+    Head_Select <= 1'b0;
+    Sector_Address <= 2'd0;
+    dirty_map_reset_spi <= 1'b0;
+    dirty_map_read_spi <= 1'b0;
+    @(negedge reset)
+    #1000
+
+    // cylinder 0 head 1 sector 2, cylinder 2 sectors 0 and 3 on head 0, written twice
+    mark_sector(8'd0, 1'b1, 2'd2);
+    mark_sector(8'd2, 1'b0, 2'd0);
+    mark_sector(8'd2, 1'b0, 2'd3);
+    mark_sector(8'd2, 1'b0, 2'd3);
+
+    // bit {head, sector} of each cylinder byte
+    expected = 32'h40000900;
+    check_map;
+
+    // the bytes read are clear now
+    expected = 32'h00000000;
+    check_map;
+
+    // a sector written after the clear is marked again, cylinder 1 head 1 sector 0
+    mark_sector(8'd1, 1'b1, 2'd0);
+    expected = 32'h00100000;
+    check_map;
+    expected = 32'h00000000;
+    check_map;
+
+    $display("%d errors", errors);
+    if (errors == 0)
+      $display("PASS");
+    else
+      $display("FAIL");
+    $stop;
+  end
+
+endmodule
@@ -87,12 +87,12 @@ wire SDRAM_DQML;
 wire SDRAM_DQMH;
 wire SDRAM_DQ_enable;
 
-RK05_emulator_top mytop (
+V2315CF mytop (
 
 // BUS Connector Inputs, 19 signals
 
 //  Drive side 12 signals
-    .BUS_ACCESS_RDY_DRIVE_H (BUS_ACCESS_RDY_DRIVE_H),    // Seek ready and on-cylinder
+//    .BUS_ACCESS_RDY_DRIVE_H (BUS_ACCESS_RDY_DRIVE_H),    // Seek ready and on-cylinder
     .BUS_HOME_DRIVE_L (BUS_HOME_DRIVE_L),          // indicates at track zero
     .BUS_WT_CLOCKB_DRIVE_L (BUS_WT_CLOCKB_DRIVE_L),     // 720 KHz clock to control writes
     .BUS_RD_DATA_DRIVE_L (BUS_RD_DATA_DRIVE_L),       // Read data pulses, 160 ns pulse
@@ -312,6 +312,55 @@ RK05_emulator_top mytop (
     @(negedge CPU_SPI_CLK); \
     CPU_SPI_CS_n = 1'b1;
 
+// SIMULATION OF SPI LINK TASKS FOR BURST MESSAGES
+
+integer spibit;
+integer burstcount;
+integer dram_writes;
+integer dram_reads;
+time phase_start;
+time single_time;
+time burst_time;
+
+// shift one byte out on MOSI, the first byte of a message also asserts CS
+task spi_send_byte;
+    input [7:0] data;
+    begin
+        for (spibit = 7; spibit >= 0; spibit = spibit - 1) begin
+            @(negedge CPU_SPI_CLK);
+            CPU_SPI_MOSI <= data[spibit];
+            CPU_SPI_CS_n = 1'b0;
+        end
+    end
+endtask
+
+// end the message, same timing as the SPIWORD macro
+task spi_end_message;
+    begin
+        @(negedge CPU_SPI_CLK);
+        CPU_SPI_CS_n = 1'b1;
+    end
+endtask
+
+// one register address plus one data byte, the normal two byte message
+task spi_message;
+    input [7:0] regaddr;
+    input [7:0] data;
+    begin
+        spi_send_byte(regaddr);
+        spi_send_byte(data);
+        spi_end_message;
+    end
+endtask
+
+// count the words the SPI interface hands to or requests from the SDRAM controller
+always @ (posedge clock) begin
+    if (mytop.i_spi_interface.dram_write_enbl_spi)
+        dram_writes = dram_writes + 1;
+    if (mytop.i_spi_interface.dram_read_enbl_spi)
+        dram_reads = dram_reads + 1;
+end
+
 // define seek macro
 `define SEEK(dir, step) \
       BUS_ACCESS_RDY_DRIVE_H <= 1'b1; \
@@ -352,6 +401,65 @@ RK05_emulator_top mytop (
     CPU_SPI_MOSI <= 1'b0;
     CPU_SPI_CS_n = 1'b1;
     #3331
+    // time the loading of 64 bytes into the SDRAM, first as 0x06 messages one byte at a time
+    // load address 000000 for SDRAM
+    spi_message(8'h05, 8'h00);
+    spi_message(8'h05, 8'h00);
+    spi_message(8'h05, 8'h00);
+    #1000
+    dram_writes = 0;
+    phase_start = $time;
+    for (burstcount = 0; burstcount < 64; burstcount = burstcount + 1)
+        spi_message(8'h06, burstcount);
+    single_time = $time - phase_start;
+    #1000
+    $display("0x06 single byte writes: 64 bytes in %0t, %0d words written", single_time, dram_writes);
+
+    // then the same 64 bytes as one 0x16 burst message, load address 000200 for SDRAM
+    spi_message(8'h05, 8'h00);
+    spi_message(8'h05, 8'h02);
+    spi_message(8'h05, 8'h00);
+    #1000
+    dram_writes = 0;
+    phase_start = $time;
+    spi_send_byte(8'h16);
+    for (burstcount = 0; burstcount < 64; burstcount = burstcount + 1)
+        spi_send_byte(burstcount);
+    spi_end_message;
+    burst_time = $time - phase_start;
+    #1000
+    $display("0x16 burst write:        64 bytes in %0t, %0d words written", burst_time, dram_writes);
+    $display("burst speedup %0d.%0d", single_time / burst_time, ((single_time * 10) / burst_time) % 10);
+
+    // time reading the 64 bytes back, first as 0x88 messages one byte at a time
+    spi_message(8'h05, 8'h00);
+    spi_message(8'h05, 8'h00);
+    spi_message(8'h05, 8'h00);
+    #1000
+    dram_reads = 0;
+    phase_start = $time;
+    for (burstcount = 0; burstcount < 64; burstcount = burstcount + 1)
+        spi_message(8'h88, 8'h00);
+    single_time = $time - phase_start;
+    #1000
+    $display("0x88 single byte reads:  64 bytes in %0t, %0d words requested", single_time, dram_reads);
+
+    // then as one 0x98 burst message
+    spi_message(8'h05, 8'h00);
+    spi_message(8'h05, 8'h02);
+    spi_message(8'h05, 8'h00);
+    #1000
+    dram_reads = 0;
+    phase_start = $time;
+    spi_send_byte(8'h98);
+    for (burstcount = 0; burstcount < 64; burstcount = burstcount + 1)
+        spi_send_byte(8'h00);
+    spi_end_message;
+    burst_time = $time - phase_start;
+    #1000
+    $display("0x98 burst read:         64 bytes in %0t, %0d words requested", burst_time, dram_reads);
+    $display("burst speedup %0d.%0d", single_time / burst_time, ((single_time * 10) / burst_time) % 10);
+
     // set cart ready and 
     `SPIWORD(0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 1, 0, 0, 0, 0)
 //    #1000
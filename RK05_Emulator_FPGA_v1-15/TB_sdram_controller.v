@@ -1,131 +1,274 @@
 //==========================================================================================================
-// testbench for SDRAM Controller
+// RK05 Emulator
+// SDRAM Controller
+// File Name: TB_sdram_controller.v
+// Functions:
+//   TB for my module
+//   SPI reads and writes at the pace of a 0x98 / 0x16 burst, one word every 26 clocks, against BUS requests
+//   that never let up, to check an SPI word waits for no more than one BUS cycle
+//
 //==========================================================================================================
 
 module TB_sdram_controller(
-    input wire clock,                    // master clock 40 MHz
-    input wire reset,                    // active high synchronous reset input
-    input wire load_address_spi,         // enable from SPI to sdram controller to load the address from sector, head select and cylinder
-    input wire load_address_busread,     // enable from bus read to sdram controller to load the address from sector, head select and cylinder
-    input wire load_address_buswrite,    // enable from bus write to sdram controller to load the address from sector, head select and cylinder
-    input wire dram_read_enbl_spi,       // read enable request to DRAM controller from SPI
-    input wire dram_read_enbl_busread,   // read enable request to DRAM controller from the BUS interface
-    input wire dram_addr_incr_buswrite,  // increment address without write
-    input wire dram_write_enbl_spi,      // write enable request to DRAM controller from SPI
-    input wire dram_write_enbl_buswrite, // write enable request to DRAM controller from the BUS interface
-    input wire [15:0] dram_writedata_spi,       // 16-bit write data to DRAM controller from SPI
-    input wire [15:0] dram_writedata_buswrite,   // 16-bit write data to DRAM controller from bus
-    input wire [7:0] spi_serpar_reg,           // 8-bit SPI serpar register used for writing to the sdram address register
-    input wire [1:0] Sector_Address,           // specifies which sector is present "under the heads"
-    input wire [7:0] Cylinder_Address,         // valid cylinder address
-    input wire Head_Select,              // head selection (upper or lower)
-
-
-    input wire [15:0] SDRAM_DQ_in,     // input from DQ signal receivers
-
-    output reg [15:0] dram_readdata,   // 16-bit read data from DRAM controller
-
-    output wire  dram_readack,
-    output wire  dram_writeack,
-
-    output wire [15:0] SDRAM_DQ_output, // outputs to DQ signal drivers
-    output wire SDRAM_DQ_enable, // DQ output enable, active high
-    output wire [12:0] SDRAM_Address,   // SDRAM Address
-    output wire SDRAM_BS0,	     // SDRAM Bank Select 0
-    output wire SDRAM_BS1,	     // SDRAM Bank Select 1
-    output wire SDRAM_WE_n,	     // SDRAM Write
-    output wire SDRAM_CAS_n,	 // SDRAM Column Address Select
-    output wire SDRAM_RAS_n,	 // SDRAM Row Address Select
-    output wire SDRAM_CS_n,	     // SDRAM Chip Select
-    output wire SDRAM_CLK,	     // SDRAM Clock
-    output wire SDRAM_CKE,	     // SDRAM Clock Enable
-    output wire SDRAM_DQML,	     // SDRAM DQ Mask for Lower Byte
-    output wire SDRAM_DQMH	     // SDRAM DQ Mask for Upper (High) Byte
 );
 
 //============================ Internal Connections ==================================
 
+     reg clock;
+     reg reset;
+     reg load_address_spi;
+     reg load_address_busread;
+     reg load_address_buswrite;
+     reg dram_read_enbl_spi;
+     reg dram_read_enbl_busread;
+     reg dram_write_enbl_spi;
+     reg dram_write_enbl_buswrite;
+     reg dram_addr_incr_buswrite;
+     reg [15:0] dram_writedata_spi;
+     reg [15:0] dram_writedata_buswrite;
+     reg [7:0] spi_serpar_reg;
+     reg [1:0] Sector_Address;
+     reg [7:0] Cylinder_Address;
+     reg Head_Select;
+     reg [15:0] SDRAM_DQ_in;
+
+     wire dram_writeack;
+     wire dram_writeack_spi;
+     wire [15:0] dram_readdata;
+     wire [15:0] dram_readdata_spi;
+     wire [15:0] SDRAM_DQ_output;
+     wire SDRAM_DQ_enable;
+     wire [12:0] SDRAM_Address;
+     wire SDRAM_BS0;
+     wire SDRAM_BS1;
+     wire SDRAM_WE_n;
+     wire SDRAM_CAS_n;
+     wire SDRAM_RAS_n;
+     wire SDRAM_CS_n;
+     wire SDRAM_CLK;
+     wire SDRAM_CKE;
+     wire SDRAM_DQML;
+     wire SDRAM_DQMH;
+
+     reg bus_busy;           // keep a BUS request pending all the time
+     reg bus_writing;        // the BUS requests are writes, otherwise reads
+     reg [12:0] sdram_row;
+     reg [2:0] bus_pace;
+     reg rd_waiting;
+     reg wr_waiting;
+     integer rd_clocks;
+     integer wr_clocks;
+     integer rd_max;
+     integer wr_max;
+     integer errors;
+     integer i;
+     reg [15:0] expected;
+     reg [15:0] spi_write_expected;
+
+
+ sdram_controller DUT (
+.clock (clock),
+.reset (reset),
+.load_address_spi (load_address_spi),
+.load_address_busread (load_address_busread),
+.load_address_buswrite (load_address_buswrite),
+.dram_read_enbl_spi (dram_read_enbl_spi),
+.dram_read_enbl_busread (dram_read_enbl_busread),
+.dram_write_enbl_spi (dram_write_enbl_spi),
+.dram_write_enbl_buswrite (dram_write_enbl_buswrite),
+.dram_addr_incr_buswrite (dram_addr_incr_buswrite),
+.dram_writedata_spi (dram_writedata_spi),
+.dram_writedata_buswrite (dram_writedata_buswrite),
+.spi_serpar_reg (spi_serpar_reg),
+.Sector_Address (Sector_Address),
+.Cylinder_Address (Cylinder_Address),
+.Head_Select (Head_Select),
+.SDRAM_DQ_in (SDRAM_DQ_in),
+.dram_writeack (dram_writeack),
+.dram_writeack_spi (dram_writeack_spi),
+.dram_readdata (dram_readdata),
+.dram_readdata_spi (dram_readdata_spi),
+.SDRAM_DQ_output (SDRAM_DQ_output),
+.SDRAM_DQ_enable (SDRAM_DQ_enable),
+.SDRAM_Address (SDRAM_Address),
+.SDRAM_BS0 (SDRAM_BS0),
+.SDRAM_BS1 (SDRAM_BS1),
+.SDRAM_WE_n (SDRAM_WE_n),
+.SDRAM_CAS_n (SDRAM_CAS_n),
+.SDRAM_RAS_n (SDRAM_RAS_n),
+.SDRAM_CS_n (SDRAM_CS_n),
+.SDRAM_CLK (SDRAM_CLK),
+.SDRAM_CKE (SDRAM_CKE),
+.SDRAM_DQML (SDRAM_DQML),
+.SDRAM_DQMH (SDRAM_DQMH)
+);
 
-wire [15:0] real_dram_readdata;
-wire readrequest;
-wire writerequest;
-wire loadaddrrequest;
-wire [15:0] dramoutput;
-reg [31:0] outfile; 
-reg [31:0] infile; 
 
-//
 //============================ Start of Code =========================================
+// clock and reset
+  initial begin
+    clock = 1'b0;
+    forever #12.5 clock = ~clock;
+  end
+
+  initial begin
+   reset = 1'b1;
+    #35
+   reset = 1'b0;
+  end
 
-assign loadaddrrequest = load_address_spi | load_address_busread | load_address_buswrite;
-assign readrequest = dram_read_enbl_spi | dram_read_enbl_busread | load_address_busread;
-assign writerequest = dram_write_enbl_spi | dram_write_enbl_buswrite;
-assign dramoutput = dram_write_enbl_spi ? dram_writedata_spi : dram_writedata_buswrite;
+// SDRAM model, a read returns the low 16 bits of the word address, row bits above the column
+  always @ (posedge clock) begin
+    if (~SDRAM_CS_n & ~SDRAM_RAS_n & SDRAM_CAS_n & SDRAM_WE_n)
+      sdram_row <= SDRAM_Address;
+    if (~SDRAM_CS_n & SDRAM_RAS_n & ~SDRAM_CAS_n & SDRAM_WE_n)
+      SDRAM_DQ_in <= {sdram_row[6:0], SDRAM_Address[8:0]};
+  end
 
+// BUS requests, a new one every 6 clocks so one is always waiting at the command dispatch
+  always @ (posedge clock) begin
+    bus_pace <= (bus_pace == 3'd5) ? 3'd0 : bus_pace + 1;
+    dram_read_enbl_busread <= bus_busy & ~bus_writing & (bus_pace == 3'd0);
+    dram_write_enbl_buswrite <= bus_busy & bus_writing & (bus_pace == 3'd0);
+  end
 
-initial begin
-  forever begin
-    outfile = $fopen("log.txt", "w");
-    @(posedge loadaddrrequest)
-    infile = $fopen("SDRAM.txt","r");
+// clocks from the edge that registers each SPI request to its read data or to the write command with its data
+  always @ (posedge clock) begin
+    if (rd_waiting)
+      rd_clocks = rd_clocks + 1;
+    if (dram_read_enbl_spi) begin
+      rd_waiting = 1'b1;
+      rd_clocks = 0;
+    end
+    if (rd_waiting && DUT.capture_readdata && DUT.capture_spi) begin
+      rd_waiting = 1'b0;
+      rd_max = (rd_clocks > rd_max) ? rd_clocks : rd_max;
+    end
+    if (wr_waiting)
+      wr_clocks = wr_clocks + 1;
+    if (dram_write_enbl_spi) begin
+      wr_waiting = 1'b1;
+      wr_clocks = 0;
+    end
+    if (~SDRAM_CS_n & SDRAM_RAS_n & ~SDRAM_CAS_n & ~SDRAM_WE_n & DUT.spi_cycle) begin
+      if (SDRAM_DQ_output != spi_write_expected) begin
+        $display("ERROR SPI write data %h, expected %h", SDRAM_DQ_output, spi_write_expected);
+        errors = errors + 1;
+      end
+      wr_waiting = 1'b0;
+      wr_max = (wr_clocks > wr_max) ? wr_clocks : wr_max;
+    end
   end
-end
 
-initial begin
-   forever begin
-    @(posedge writerequest)
-    $fdisplay(outfile, "data %h\n",dramoutput);
+// one clock pulse on a request line as the SPI interface makes it
+task pulse_spi_read;
+  begin
+    @(posedge clock)
+    dram_read_enbl_spi <= 1'b1;
+    @(posedge clock)
+    dram_read_enbl_spi <= 1'b0;
   end
-end
+endtask
 
-initial begin
-  dram_readdata <= 16'b0;
-  forever begin
-    @(posedge readrequest)
-    $fscanf(infile, "%h", dram_readdata);
+task pulse_spi_write;
+  input [15:0] data;
+  begin
+    @(posedge clock)
+    dram_writedata_spi <= data;
+    dram_write_enbl_spi <= 1'b1;
+    spi_write_expected = data;
+    @(posedge clock)
+    dram_write_enbl_spi <= 1'b0;
+  end
+endtask
+
+// three address bytes high first, as three 0x05 messages
+task load_spi_address;
+  input [23:0] address;
+  begin
+    for (i = 2; i >= 0; i = i - 1) begin
+      @(posedge clock)
+      spi_serpar_reg <= address[i * 8 +: 8];
+      load_address_spi <= 1'b1;
+      @(posedge clock)
+      load_address_spi <= 1'b0;
+    end
+  end
+endtask
+
+// test conditions
+  initial begin
+    load_address_spi <= 1'b0;
+    load_address_busread <= 1'b0;
+    load_address_buswrite <= 1'b0;
+    dram_read_enbl_spi <= 1'b0;
+    dram_write_enbl_spi <= 1'b0;
+    dram_addr_incr_buswrite <= 1'b0;
+    dram_writedata_spi <= 16'd0;
+    dram_writedata_buswrite <= 16'hb000;
+    spi_serpar_reg <= 8'd0;
+    Sector_Address <= 2'd1;
+    Cylinder_Address <= 8'd3;
+    Head_Select <= 1'b0;
+    SDRAM_DQ_in <= 16'd0;
+    sdram_row <= 13'd0;
+    bus_pace <= 3'd0;
+    bus_busy <= 1'b0;
+    bus_writing <= 1'b0;
+    rd_waiting = 1'b0;
+    wr_waiting = 1'b0;
+    rd_clocks = 0;
+    wr_clocks = 0;
+    rd_max = 0;
+    wr_max = 0;
+    errors = 0;
+    // the controller waits 200 us after reset before it takes requests
+    @(negedge reset)
+    #250000
+
+    // SPI burst read of 32 words from 0x001234 while the BUS reads without a break
+    @(posedge clock)
+    load_address_busread <= 1'b1;
+    @(posedge clock)
+    load_address_busread <= 1'b0;
+    bus_busy <= 1'b1;
+    load_spi_address(24'h001234);
+    #1000
+    expected = 16'h1234;
+    for (i = 0; i < 32; i = i + 1) begin
+      if (dram_readdata_spi != expected) begin
+        $display("ERROR SPI read data %h, expected %h", dram_readdata_spi, expected);
+        errors = errors + 1;
+      end
+      pulse_spi_read;
+      expected = expected + 1;
+      repeat (24) @(posedge clock);
+    end
+    $display("SPI read against BUS reads, longest wait %d clocks", rd_max);
+
+    // SPI burst write of 32 words while the BUS writes without a break
+    bus_writing <= 1'b1;
+    load_spi_address(24'h002000);
+    #1000
+    for (i = 0; i < 32; i = i + 1) begin
+      pulse_spi_write(16'h5000 + i);
+      repeat (24) @(posedge clock);
+    end
+    $display("SPI write against BUS writes, longest wait %d clocks", wr_max);
+    bus_busy <= 1'b0;
+
+    // the bounds worked out in sdram_controller.v less the clock that registers the request, the write
+    // command is seen the clock after the one that takes the data
+    if (rd_max > 19) begin
+      $display("ERROR SPI read waited more than one BUS cycle");
+      errors = errors + 1;
+    end
+    if (wr_max > 16) begin
+      $display("ERROR SPI write waited more than one BUS cycle");
+      errors = errors + 1;
+    end
+    $display("%d errors", errors);
+    $stop;
   end
-end
-
-// ======== Module ======== sdram_controller =====
-sdram_controller real_sdram_controller (
-    // Inputs
-    .clock (clock),
-    .reset (reset),
-    .load_address_spi (load_address_spi),
-    .load_address_busread (load_address_busread),
-    .load_address_buswrite (load_address_buswrite),
-    .dram_read_enbl_spi (dram_read_enbl_spi),
-    .dram_read_enbl_busread (dram_read_enbl_busread),
-    .dram_write_enbl_spi (dram_write_enbl_spi),
-    .dram_addr_incr_buswrite (dram_addr_incr_buswrite),
-    .dram_write_enbl_buswrite (dram_write_enbl_buswrite),
-    .dram_writedata_spi (dram_writedata_spi),
-    .dram_writedata_buswrite (dram_writedata_buswrite),
-    .spi_serpar_reg (spi_serpar_reg),
-    .Sector_Address (Sector_Address),
-    .Cylinder_Address (Cylinder_Address),
-    .Head_Select (Head_Select),
-
-    .SDRAM_DQ_in (SDRAM_DQ_in),
-
-    // Outputs
-    .dram_readdata (real_dram_readdata),
-    .dram_readack (dram_readack),
-    .dram_writeack (dram_writeack),
-
-    .SDRAM_DQ_output (SDRAM_DQ_output),
-    .SDRAM_DQ_enable (SDRAM_DQ_enable),
-    .SDRAM_Address (SDRAM_Address),
-    .SDRAM_BS0 (SDRAM_BS0),
-    .SDRAM_BS1 (SDRAM_BS1),
-    .SDRAM_WE_n (SDRAM_WE_n),
-    .SDRAM_CAS_n (SDRAM_CAS_n),
-    .SDRAM_RAS_n (SDRAM_RAS_n),
-    .SDRAM_CS_n (SDRAM_CS_n),
-    .SDRAM_CLK (SDRAM_CLK),
-    .SDRAM_CKE (SDRAM_CKE),
-    .SDRAM_DQML (SDRAM_DQML),
-    .SDRAM_DQMH (SDRAM_DQMH)
-);
 
-endmodule // End of Module TB_sdram_controller
+endmodule
@@ -47,6 +47,7 @@ module TB_seek_to_cylinder(
 .BUS_10_20_L  (BUS_10_20_L),     
 .BUS_HOME_DRIVE_L (BUS_HOME_DRIVE_L), 
 .BUS_ACCESS_RDY_DRIVE_H (BUS_ACCESS_RDY_DRIVE_H), 
+.Cylinder_Valid (1'b1), 
 .clkenbl_1usec  (clkenbl_1usec),   
 .clkenbl_sector  (clkenbl_sector),   
 .Cylinder_Address  (Cylinder_Address), 
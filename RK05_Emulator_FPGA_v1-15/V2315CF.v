@@ -24,6 +24,8 @@
 `include "bus_disk_write.v"
 `include "bus_outputs.v"
 `include "clock_and_reset.v"
+`include "cylinder_valid_map.v"
+`include "dirty_sector_map.v"
 `include "drive_select.v"
 `include "sdram_controller.v"
 `include "sector_and_index.v"
@@ -128,7 +130,7 @@ module V2315CF (
 wire [7:0] MAJOR_VERSION;
 assign MAJOR_VERSION = 2;
 wire [7:0] MINOR_VERSION;
-assign MINOR_VERSION = 8;
+assign MINOR_VERSION = 15;
 
 wire reset;
 
@@ -179,10 +181,12 @@ wire dram_write_enbl_buswrite;
 
 wire [7:0] spi_serpar_reg;
 wire [15:0] dram_readdata;
+wire [15:0] dram_readdata_spi;
 wire [15:0] dram_writedata_spi;
 wire [15:0] dram_writedata_buswrite;
 wire dram_addr_incr_buswrite;
 wire dram_writeack;
+wire dram_writeack_spi;
 
 wire [15:0] SDRAM_DQ_in;
 wire [15:0] SDRAM_DQ_output;
@@ -202,6 +206,14 @@ wire write_selected_ready;
 
 wire Servo_Pulse_FPGA;
 
+wire [7:0] dirty_map_data;
+wire dirty_map_reset_spi;
+wire dirty_map_read_spi;
+
+wire demand_load;
+wire cylinder_loaded_spi;
+wire Cylinder_Valid;
+
 
 //============================ MISC TOP LEVEL LOGIC TO DRIVE THE INDICATORS ==================================
 
@@ -582,6 +594,36 @@ bus_outputs i_bus_outputs (
     .Selected_Ready (Selected_Ready)
 );
 
+// ======== Module ======== cylinder_valid_map =====
+cylinder_valid_map i_cylinder_valid_map (
+    // Inputs
+    .clock (clock),
+    .reset (reset),
+    .demand_load (demand_load),
+    .cylinder_loaded_spi (cylinder_loaded_spi),
+    .spi_serpar_reg (spi_serpar_reg),
+    .Cylinder_Address (Cylinder_Address),
+
+    // Outputs
+    .Cylinder_Valid (Cylinder_Valid)
+);
+
+// ======== Module ======== dirty_sector_map =====
+dirty_sector_map i_dirty_sector_map (
+    // Inputs
+    .clock (clock),
+    .reset (reset),
+    .bus_sector_write (load_address_buswrite | dram_write_enbl_buswrite),
+    .Cylinder_Address (Cylinder_Address),
+    .Head_Select (Head_Select),
+    .Sector_Address (Sector_Address),
+    .dirty_map_reset_spi (dirty_map_reset_spi),
+    .dirty_map_read_spi (dirty_map_read_spi),
+
+    // Outputs
+    .dirty_map_data (dirty_map_data)
+);
+
 // ======== Module ======== drive_select =====
 drive_select i_drive_select (
     // Inputs
@@ -622,8 +664,10 @@ drive_select i_drive_select (
 
     // Outputs
     .dram_readdata (dram_readdata),
+    .dram_readdata_spi (dram_readdata_spi),
 
     .dram_writeack (dram_writeack),
+    .dram_writeack_spi (dram_writeack_spi),
 
     .SDRAM_DQ_output (SDRAM_DQ_output),
     .SDRAM_DQ_enable (SDRAM_DQ_enable),
@@ -674,6 +718,7 @@ seek_to_cylinder i_seek_to_cylinder (
     .BUS_HOME_DRIVE_L (BUS_HOME_DRIVE_L),
 //    .BUS_ACCESS_RDY_DRIVE_H (BUS_ACCESS_RDY_DRIVE_H),
     .Reset_Cylinder (Reset_Cylinder),
+    .Cylinder_Valid (Cylinder_Valid),
 
     // Outputs
     .Cylinder_Address (Cylinder_Address),
@@ -691,7 +736,7 @@ spi_interface i_spi_interface (
     .spi_clk (CPU_SPI_CLK),
     .spi_cs_n (CPU_SPI_CS_n),
     .spi_mosi (CPU_SPI_MOSI),
-    .dram_readdata (dram_readdata),
+    .dram_readdata (dram_readdata_spi),
     .Cylinder_Address (Cylinder_Address),
     .Head_Select (Head_Select),
     .Selected_Ready (Selected_Ready),
@@ -706,6 +751,8 @@ spi_interface i_spi_interface (
     .write_selected_ready (write_selected_ready),
     .ECC_error (ECC_error),
     .real_drive (real_drive),
+    .dirty_map_data (dirty_map_data),
+    .dram_writeack_spi (dram_writeack_spi),
 
     // Outputs
     .spi_miso (CPU_SPI_MISO),
@@ -720,7 +767,11 @@ spi_interface i_spi_interface (
     .Reset_Cylinder (Reset_Cylinder),
     .interface_test_mode (interface_test_mode),
     .command_interrupt (CMD_INTERRUPT),
-    .Servo_Pulse_FPGA (Servo_Pulse_FPGA)
+    .Servo_Pulse_FPGA (Servo_Pulse_FPGA),
+    .dirty_map_reset_spi (dirty_map_reset_spi),
+    .dirty_map_read_spi (dirty_map_read_spi),
+    .demand_load (demand_load),
+    .cylinder_loaded_spi (cylinder_loaded_spi)
 );
 
 // ======== Module ======== timing_gen =====
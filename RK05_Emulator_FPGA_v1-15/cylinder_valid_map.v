@@ -0,0 +1,51 @@
+//==========================================================================================================
+// RK05 Emulator
+// Cylinder Valid Map
+// File Name: cylinder_valid_map.v
+// Functions:
+//   Keep one bit per cylinder that is set once the Pico has copied that cylinder into the SDRAM, so the
+//   cartridge can be made ready while the image is still being loaded.
+//   While demand_load is off every cylinder is valid and the map is held empty. The Pico turns demand_load
+//   on with register 0x19 before it starts loading, and marks each cylinder with register 0x18 as it is done.
+//   Cylinder_Valid tells seek_to_cylinder whether the cylinder under the heads can be accessed yet.
+//
+//==========================================================================================================
+
+module cylinder_valid_map(
+    input wire clock,                  // master clock 40 MHz
+    input wire reset,                  // active high synchronous reset input
+    input wire demand_load,            // the Pico is still loading the image, only cylinders marked here are valid
+    input wire cylinder_loaded_spi,    // the cylinder in spi_serpar_reg is now in the SDRAM
+    input wire [7:0] spi_serpar_reg,   // cylinder number written with register 0x18
+    input wire [7:0] Cylinder_Address, // cylinder the arm is on
+    output reg Cylinder_Valid          // the cylinder under the heads is in the SDRAM
+);
+
+//============================ Internal Connections ==================================
+
+reg [255:0] valid_map; // one bit per cylinder
+
+//============================ Start of Code =========================================
+
+always @ (posedge clock)
+begin : VALIDMAP // block name
+
+  if(reset==1'b1) begin
+    valid_map <= 256'd0;
+    Cylinder_Valid <= 1'b1;
+  end
+  else begin
+
+    // the map starts out empty each time demand loading is turned on
+    if(demand_load == 1'b0) begin
+      valid_map <= 256'd0;
+    end
+    else if(cylinder_loaded_spi == 1'b1) begin
+      valid_map[spi_serpar_reg] <= 1'b1;
+    end
+
+    Cylinder_Valid <= ~demand_load | valid_map[Cylinder_Address];
+  end
+end // End of Block VALIDMAP
+
+endmodule // End of Module cylinder_valid_map
@@ -0,0 +1,179 @@
+//==========================================================================================================
+// RK05 Emulator
+// Dirty Sector Map
+// File Name: dirty_sector_map.v
+// Functions:
+//   Keep one bit per sector slot that is set when the BUS writes that sector, so the Pico only has to
+//   write the changed sectors back to the microSD card at unload.
+//   The map is one byte per cylinder, bit {Head_Select, Sector_Address[1:0]} within the byte.
+//   The Pico reads the map one byte at a time with SPI register 0x99 after resetting the read pointer
+//   with register 0x17. Each byte read is cleared, except for bits set by a write after it was fetched.
+//   A sector is marked again with every word the BUS writes, so a sector the Pico copies while it is
+//   being written stays dirty and is copied again.
+//
+//==========================================================================================================
+
+module dirty_sector_map(
+    input wire clock,                  // master clock 40 MHz
+    input wire reset,                  // active high synchronous reset input
+    input wire bus_sector_write,       // the BUS is writing a word of the sector under the heads
+    input wire [7:0] Cylinder_Address, // cylinder of the sector being written
+    input wire Head_Select,            // head of the sector being written
+    input wire [1:0] Sector_Address,   // sector being written
+    input wire dirty_map_reset_spi,    // return the read pointer to cylinder 0
+    input wire dirty_map_read_spi,     // the byte at the read pointer was sent to the Pico, clear it and fetch the next
+    output reg [7:0] dirty_map_data    // map byte at the read pointer, read by the Pico with register 0x99
+);
+
+//============================ Internal Connections ==================================
+
+// state definitions and values for the map access state
+`define DMST0 3'd0 // 0 - idle, start the next pending access
+`define DMST1 3'd1 // 1 - wait for the block RAM read for a mark
+`define DMST2 3'd2 // 2 - set the bit for the sector written
+`define DMST3 3'd3 // 3 - wait for the block RAM read for a clear
+`define DMST4 3'd4 // 4 - clear the bits that were sent to the Pico, advance the read pointer
+`define DMST5 3'd5 // 5 - wait for the block RAM read for a fetch
+`define DMST6 3'd6 // 6 - hold the fetched byte for the Pico
+
+reg [7:0] dirty_map [0:255]; // one byte per cylinder, in block RAM
+reg [7:0] map_raddr;
+reg [7:0] map_rdata;
+reg [7:0] map_waddr;
+reg [7:0] map_wdata;
+reg map_we;
+
+reg [2:0] map_state;   // map access state machine state variable
+reg [7:0] read_ptr;    // cylinder byte the Pico reads next
+reg mark_pending;      // a sector write has to be recorded
+reg [7:0] mark_cylinder;
+reg [2:0] mark_bit;
+reg clear_pending;     // the Pico read the byte at read_ptr
+reg fetch_pending;     // dirty_map_data has to be refreshed from read_ptr
+
+integer i;
+
+//============================ Start of Code =========================================
+
+// the map starts out clean at configuration
+initial begin
+  for (i = 0; i < 256; i = i + 1)
+    dirty_map[i] = 8'd0;
+end
+
+always @ (posedge clock)
+begin : MAPRAM // block name
+  if(map_we == 1'b1) begin
+    dirty_map[map_waddr] <= map_wdata;
+  end
+  map_rdata <= dirty_map[map_raddr];
+end // End of Block MAPRAM
+
+always @ (posedge clock)
+begin : DIRTYMAP // block name
+
+  if(reset==1'b1) begin
+    map_state <= `DMST0;
+    map_raddr <= 8'd0;
+    map_waddr <= 8'd0;
+    map_wdata <= 8'd0;
+    map_we <= 1'b0;
+    read_ptr <= 8'd0;
+    mark_pending <= 1'b0;
+    mark_cylinder <= 8'd0;
+    mark_bit <= 3'd0;
+    clear_pending <= 1'b0;
+    fetch_pending <= 1'b1;
+    dirty_map_data <= 8'd0;
+  end
+  else begin
+
+    // requests are held until the state machine gets to them, a sector write takes far longer than any access
+    if(bus_sector_write == 1'b1) begin
+      mark_pending <= 1'b1;
+      mark_cylinder <= Cylinder_Address;
+      mark_bit <= {Head_Select, Sector_Address[1:0]};
+    end
+    else if(map_state == `DMST2) begin
+      mark_pending <= 1'b0;
+    end
+
+    clear_pending <= dirty_map_read_spi
+                     ? 1'b1
+                     : ((map_state == `DMST4) ? 1'b0 : clear_pending);
+
+    fetch_pending <= (dirty_map_reset_spi || (map_state == `DMST4))
+                     ? 1'b1
+                     : ((map_state == `DMST6) ? 1'b0 : fetch_pending);
+
+    read_ptr <= dirty_map_reset_spi
+                ? 8'd0
+                : ((map_state == `DMST4) ? read_ptr + 1 : read_ptr);
+
+    map_we <= 1'b0;
+
+    case(map_state)
+
+// 0 - start the next access, marks first so a write is never lost behind a clear
+    `DMST0: begin
+      if(mark_pending == 1'b1) begin
+        map_raddr <= mark_cylinder;
+        map_state <= `DMST1;
+      end
+      else if(clear_pending == 1'b1) begin
+        map_raddr <= read_ptr;
+        map_state <= `DMST3;
+      end
+      else if(fetch_pending == 1'b1) begin
+        map_raddr <= read_ptr;
+        map_state <= `DMST5;
+      end
+     end
+
+// 1 - block RAM read in progress
+    `DMST1: begin
+      map_state <= `DMST2;
+     end
+
+// 2 - set the bit for the sector that was written
+    `DMST2: begin
+      map_waddr <= map_raddr;
+      map_wdata <= map_rdata | (8'd1 << mark_bit);
+      map_we <= 1'b1;
+      map_state <= `DMST0;
+     end
+
+// 3 - block RAM read in progress
+    `DMST3: begin
+      map_state <= `DMST4;
+     end
+
+// 4 - only clear the bits the Pico was given, a write since the fetch stays marked
+    `DMST4: begin
+      map_waddr <= map_raddr;
+      map_wdata <= map_rdata & ~dirty_map_data;
+      map_we <= 1'b1;
+      map_state <= `DMST0;
+     end
+
+// 5 - block RAM read in progress
+    `DMST5: begin
+      map_state <= `DMST6;
+     end
+
+// 6 - present the byte at the read pointer to the SPI interface
+    `DMST6: begin
+      dirty_map_data <= map_rdata;
+      map_state <= `DMST0;
+     end
+
+    default: begin
+      map_state <= `DMST0;
+    end
+
+    endcase
+
+  end
+end // End of Block DIRTYMAP
+
+endmodule // End of Module dirty_sector_map
@@ -9,6 +9,15 @@
 //   read from SPI, 
 //   write from bus, 
 //   write from SPI.
+//   the SPI side has its own address and read data registers, so the Pico can copy the SDRAM while the BUS is using it.
+//   BUS requests are served ahead of SPI requests, but an SPI request that waited out one BUS cycle goes next.
+//
+//   SPI has no backpressure, a 0x16 burst write hands over a word and a 0x98 burst read needs the next one every
+//   16 SCK, 640 ns at 25 MHz. Worst case from an SPI request to its word, in 25 ns clocks:
+//     1 to register the request, 6 for the cycle in progress (a refresh is 4), 6 for one BUS cycle, then
+//     7 to dram_readdata_spi for a read (CC0 to CC5 and the capture) or 3 to CC8 where the write data is taken.
+//   That is 20 clocks, 500 ns, for a read and 16 clocks, 400 ns, for a write, plus 3 clocks to bring the request
+//   over from the SPI clock, which leaves a read at least 65 ns before the Pico clocks out the next word.
 //
 //   for simulation - grade 6, CAS 2, BL1
 //==========================================================================================================
@@ -34,8 +43,10 @@ module sdram_controller(
     input wire [15:0] SDRAM_DQ_in,     // input from DQ signal receivers
 
     output reg dram_writeack,           // dram read acknowledge
+    output reg dram_writeack_spi,       // an SPI write to the SDRAM is done, the next one can be requested
 
-    output reg [15:0] dram_readdata,   // 16-bit read data from DRAM controller
+    output reg [15:0] dram_readdata,   // 16-bit read data from DRAM controller for the BUS
+    output reg [15:0] dram_readdata_spi, // 16-bit read data from DRAM controller for SPI
 
     output reg [15:0] SDRAM_DQ_output, // outputs to DQ signal drivers
     output reg SDRAM_DQ_enable, // DQ output enable, active high
@@ -108,14 +119,21 @@ module sdram_controller(
 // 16 - Init NOP before Precharge All
 
 
-reg [23:0] memory_address; // memory address register
+reg [23:0] memory_address; // memory address register for the BUS
+reg [23:0] spi_address;    // memory address register for SPI
 reg [15:0] spi_mem_addr;   // register to save prior bytes of SPI memory address
 reg [4:0] memstate; // memory controller state
-reg readrequest;
+reg readrequest_bus;
+reg readrequest_spi;
 reg writerequest_spi;
 reg writerequest_buswrite;
+reg spi_cycle;         // the memory cycle in progress was requested by SPI
+reg spi_owed;          // a BUS cycle was dispatched while an SPI request waited, SPI goes at the next dispatch
 reg capture_readdata;
+reg capture_spi;
 wire [23:0] loading_address; 
+wire [23:0] cycle_address;
+wire spi_turn;
 
 //============================ Start of Code =========================================
 
@@ -128,19 +146,28 @@ wire [23:0] loading_address;
 assign SDRAM_CLK = ~clock;
 
 assign loading_address = {4'b0000, Cylinder_Address[7:0], Head_Select, Sector_Address[1:0], 9'h0};
+assign cycle_address = spi_cycle ? spi_address : memory_address;
+assign spi_turn = spi_owed & (readrequest_spi | writerequest_spi);
 
 always @ (posedge clock)
 begin : HSCLOCKFUNCTIONS // block name
   if(reset) begin
     dram_readdata <= 16'd0;
+    dram_readdata_spi <= 16'd0;
     dram_writeack <= 1'd0;
+    dram_writeack_spi <= 1'd0;
     memory_address <= 24'd0;
+    spi_address <= 24'd0;
     spi_mem_addr <= 16'd0;
     memstate <= `CC16;
-    readrequest <= 1'd0;
+    readrequest_bus <= 1'd0;
+    readrequest_spi <= 1'd0;
     writerequest_spi <= 1'd0;
     writerequest_buswrite <= 1'd0;
+    spi_cycle <= 1'd0;
+    spi_owed <= 1'd0;
     capture_readdata <= 1'd0;
+    capture_spi <= 1'd0;
 
     SDRAM_CS_n <= 1'b1;
     SDRAM_RAS_n <= 1'b1;
@@ -159,41 +186,63 @@ begin : HSCLOCKFUNCTIONS // block name
     SDRAM_CKE <= 1'b1;
 
     // memory_address affected by:
-    //   load_address_spi;  load_address_busread;  load_address_buswrite;
-    //   dram_writeack;  <if none of these - then no change to memory_address;>
+    //   load_address_busread;  load_address_buswrite;
+    //   dram_read_enbl_busread;  dram_addr_incr_buswrite;  <if none of these - then no change to memory_address;>
+    // spi_address affected by:
+    //   load_address_spi;  dram_read_enbl_spi;  end of an SPI write cycle;  <if none of these - then no change to spi_address;>
     spi_mem_addr <= load_address_spi ? {spi_mem_addr[7:0], spi_serpar_reg[7:0]}: spi_mem_addr;
-    memory_address <=  load_address_spi 
+    memory_address <= (load_address_busread | load_address_buswrite) 
+                    ? loading_address
+                    : ((dram_read_enbl_busread | dram_addr_incr_buswrite) 
+                          ?  memory_address + 1 
+                          : memory_address);
+    spi_address <=  load_address_spi 
                     ? {spi_mem_addr[15:8], spi_mem_addr[7:0], spi_serpar_reg[7:0]} 
-                    : (load_address_busread | load_address_buswrite 
-                            ? loading_address
-                            : ((dram_read_enbl_spi | dram_read_enbl_busread | dram_addr_incr_buswrite | dram_writeack ) 
-                                  ?  memory_address + 1 
-                                  : memory_address));
+                    : ((dram_read_enbl_spi | ((memstate == `CC10) & spi_cycle)) 
+                          ?  spi_address + 1 
+                          : spi_address);
 
     capture_readdata <= (memstate == `CC5); // capture sdram read data the clock cycle after state CC5
-    dram_readdata <= capture_readdata 
+    capture_spi <= spi_cycle;
+    dram_readdata <= (capture_readdata & ~capture_spi) 
                    ? SDRAM_DQ_in 
                    : dram_readdata; // capture sdram read data in state CC5
+    dram_readdata_spi <= (capture_readdata & capture_spi) 
+                   ? SDRAM_DQ_in 
+                   : dram_readdata_spi;
 
-    // readrequest: SET on (dram_read_enbl_spi | dram_read_enbl_busread | dram_read_enbl_buswrite | load_address_spi), CLEAR on (memstate == 'CC5)
-    readrequest <= (dram_read_enbl_spi | dram_read_enbl_busread | load_address_spi | load_address_busread) | (readrequest & ~(memstate == `CC5));
+    // readrequest_bus: SET on (dram_read_enbl_busread | load_address_busread), CLEAR on (memstate == 'CC5) of a BUS cycle
+    readrequest_bus <= (dram_read_enbl_busread | load_address_busread) | (readrequest_bus & ~((memstate == `CC5) & ~spi_cycle));
+
+    // readrequest_spi: SET on (dram_read_enbl_spi | load_address_spi), CLEAR on (memstate == 'CC5) of an SPI cycle
+    readrequest_spi <= (dram_read_enbl_spi | load_address_spi) | (readrequest_spi & ~((memstate == `CC5) & spi_cycle));
     
-    // writerequest_spi: SET on (dram_write_enbl_spi), CLEAR on (memstate == 'CC10)
-    writerequest_spi <=  (dram_write_enbl_spi ) | (writerequest_spi & ~(memstate == `CC10));  
+    // writerequest_spi: SET on (dram_write_enbl_spi), CLEAR on (memstate == 'CC10) of an SPI cycle
+    writerequest_spi <=  (dram_write_enbl_spi ) | (writerequest_spi & ~((memstate == `CC10) & spi_cycle));  
+
+    // writerequest_buswrite: SET on (dram_write_enbl_buswrite ), CLEAR on (memstate == 'CC10) of a BUS cycle
+    writerequest_buswrite <= (dram_write_enbl_buswrite) | (writerequest_buswrite & ~((memstate == `CC10) & ~spi_cycle));
 
-    // writerequest_buswrite: SET on (dram_write_enbl_buswrite ), CLEAR on (memstate == 'CC10);
-    writerequest_buswrite <= (dram_write_enbl_buswrite) | (writerequest_buswrite & ~(memstate == `CC10));
+    // only BUS writes are acknowledged, the bus write state machine advances its address with it
+    dram_writeack <= (memstate == `CC9) & ~spi_cycle;
 
-    dram_writeack <= (memstate == `CC9);
+    // SPI writes are acknowledged for the SDRAM fill, which requests each word once the last one is written
+    dram_writeack_spi <= (memstate == `CC9) & spi_cycle;
 
     case(memstate)  // SDRAM Controller state machine
 
     `CC0: begin     // 0  - command dispatch NOP
-      memstate <= readrequest 
-                ? `CC1 
-                : ((writerequest_spi | writerequest_buswrite) 
-                      ? `CC6 
-                      : `CC11);
+      // BUS reads and writes go first, they have to keep up with the disk rotation
+      // SPI goes first once it has waited out a BUS cycle, so it is never held off by two in a row
+      memstate <= spi_turn 
+                ? (readrequest_spi ? `CC1 : `CC6) 
+                : ((readrequest_bus | (~writerequest_buswrite & readrequest_spi)) 
+                    ? `CC1 
+                    : ((writerequest_spi | writerequest_buswrite) 
+                          ? `CC6 
+                          : `CC11));
+      spi_cycle <= spi_turn | ~(readrequest_bus | writerequest_buswrite);
+      spi_owed <= ~spi_turn & (readrequest_bus | writerequest_buswrite) & (readrequest_spi | writerequest_spi);
       SDRAM_CS_n <= 1'b1;
       SDRAM_RAS_n <= 1'b1;
       SDRAM_CAS_n <= 1'b1;
@@ -213,9 +262,9 @@ begin : HSCLOCKFUNCTIONS // block name
       SDRAM_RAS_n <= 1'b0;
       SDRAM_CAS_n <= 1'b1;
       SDRAM_WE_n <= 1'b1;
-      SDRAM_BS1 <= memory_address[23];
-      SDRAM_BS0 <= memory_address[22];
-      SDRAM_Address <= memory_address[21:9];
+      SDRAM_BS1 <= cycle_address[23];
+      SDRAM_BS0 <= cycle_address[22];
+      SDRAM_Address <= cycle_address[21:9];
       SDRAM_DQ_output <= 16'd0;
       SDRAM_DQ_enable <= 1'b0;
       SDRAM_DQML <= 1'b0;
@@ -243,9 +292,9 @@ begin : HSCLOCKFUNCTIONS // block name
       SDRAM_RAS_n <= 1'b1;
       SDRAM_CAS_n <= 1'b0;
       SDRAM_WE_n <= 1'b1;
-      SDRAM_BS1 <= memory_address[23];
-      SDRAM_BS0 <= memory_address[22];
-      SDRAM_Address <= {4'b0010, memory_address[8:0]}; // 9 lower bits of memory address with A10 <= 1
+      SDRAM_BS1 <= cycle_address[23];
+      SDRAM_BS0 <= cycle_address[22];
+      SDRAM_Address <= {4'b0010, cycle_address[8:0]}; // 9 lower bits of memory address with A10 <= 1
       SDRAM_DQ_output <= 16'd0;
       SDRAM_DQ_enable <= 1'b0;
       SDRAM_DQML <= 1'b0;
@@ -288,9 +337,9 @@ begin : HSCLOCKFUNCTIONS // block name
       SDRAM_RAS_n <= 1'b0;
       SDRAM_CAS_n <= 1'b1;
       SDRAM_WE_n <= 1'b1;
-      SDRAM_BS1 <= memory_address[23];
-      SDRAM_BS0 <= memory_address[22];
-      SDRAM_Address <= memory_address[21:9];
+      SDRAM_BS1 <= cycle_address[23];
+      SDRAM_BS0 <= cycle_address[22];
+      SDRAM_Address <= cycle_address[21:9];
       SDRAM_DQ_output <= 16'd0;
       SDRAM_DQ_enable <= 1'b0;
       SDRAM_DQML <= 1'b0;
@@ -318,14 +367,12 @@ begin : HSCLOCKFUNCTIONS // block name
       SDRAM_RAS_n <= 1'b1;
       SDRAM_CAS_n <= 1'b0;
       SDRAM_WE_n <= 1'b0;
-      SDRAM_BS1 <= memory_address[23];
-      SDRAM_BS0 <= memory_address[22];
-      SDRAM_Address <= {4'b0010, memory_address[8:0]}; // 9 lower bits of memory address with A10 <= 1
-      SDRAM_DQ_output <= writerequest_spi 
+      SDRAM_BS1 <= cycle_address[23];
+      SDRAM_BS0 <= cycle_address[22];
+      SDRAM_Address <= {4'b0010, cycle_address[8:0]}; // 9 lower bits of memory address with A10 <= 1
+      SDRAM_DQ_output <= spi_cycle 
                        ? dram_writedata_spi 
-                       : (writerequest_buswrite 
-                               ? dram_writedata_buswrite 
-                               : 16'd0);
+                       : dram_writedata_buswrite;
       SDRAM_DQ_enable <= 1'b1;
       SDRAM_DQML <= 1'b0;
       SDRAM_DQMH <= 1'b0;
@@ -21,6 +21,8 @@
 //
 //   flickers the oncylinder indicator to indicate a seek (150 millisecond duration)
 //
+//   Access Ready stays low after the seek while the cylinder reached is not loaded into the SDRAM yet
+//
 //   the real Home signal from the disk drive is used to force sync to cylinder zero in real mode
 //
 // Modified for 2310 by Carl Claunch
@@ -42,6 +44,7 @@ module seek_to_cylinder(
     input Cart_Ready,                  // virtual cartridge loaded
     input wire real_drive,             // real or virtual mode
     input wire Reset_Cylinder,         // control flag to force arm to home position
+    input wire Cylinder_Valid,         // the cylinder under the heads has been copied to the SDRAM
 
     output reg [7:0] Cylinder_Address, // internal register to store the valid cylinder address
     output reg BUS_ACCESS_RDY_EMUL_H,  // access ready signal
@@ -116,7 +119,8 @@ begin
                           : seek_timer;
 
         // for virtual, goes low at 5ms after go and returns high after full 15 ms
-        BUS_ACCESS_RDY_EMUL_H <= (seek_timer > 10000) || (seek_timer == 0);
+        // or later, once the Pico has loaded the cylinder
+        BUS_ACCESS_RDY_EMUL_H <= (seek_timer > 10000) || ((seek_timer == 0) && Cylinder_Valid);
 
         // clock domain crossing elimination of metastable states
         meta_bus_go[3:0]     <= {meta_bus_go[2:0], ~BUS_ACC_GO_L};
@@ -6,6 +6,11 @@
 //   read and write FPGA hardware control registers.
 //   read and write SDRAM data.
 //   write SDRAM address register for processor SDRAM accesses.
+//   burst write of SDRAM data, one register address followed by any number of data bytes.
+//   burst read of SDRAM data, one register address followed by any number of data bytes.
+//   read and clear the dirty sector map, one byte per cylinder.
+//   mark cylinders loaded into the SDRAM while the image is loaded on demand.
+//   fill a run of SDRAM sector slots with one repeated byte at SDRAM speed.
 // Modified for 2310 by Carl Claunch
 //
 //==========================================================================================================
@@ -31,6 +36,8 @@ module spi_interface(
     input wire BUS_WRITE_SEL_ERR_DRIVE_L,// got error trying to select/write on drive
     input wire ECC_error,                // got error in four ECC bits during write
     input wire real_drive,               // hybrid or pure virtual mode
+    input wire [7:0] dirty_map_data,     // dirty sector map byte at the map read pointer
+    input wire dram_writeack_spi,        // the SDRAM write requested from SPI is done
     output reg spi_miso,                 // SPI controller data input, peripheral data output
     output reg load_address_spi,         // enable from SPI to command the sdram controller to load address 8 bits at a time
     output reg [7:0] spi_serpar_reg,     // 8-bit serpar register used for writing to the sdram address register
@@ -43,7 +50,11 @@ module spi_interface(
     output reg Reset_Cylinder,           // drive powered down causes arm retract to cylinder 0
     output reg interface_test_mode,
     output reg command_interrupt,
-    output reg Servo_Pulse_FPGA
+    output reg Servo_Pulse_FPGA,
+    output reg dirty_map_reset_spi,      // return the dirty sector map read pointer to cylinder 0
+    output reg dirty_map_read_spi,       // the dirty sector map byte was read, clear it and advance the read pointer
+    output reg demand_load,              // the image is still being loaded, only cylinders marked loaded are valid
+    output reg cylinder_loaded_spi       // the cylinder in spi_serpar_reg has been copied to the SDRAM
 );
 
 //============================ Internal Connections ==================================
@@ -56,17 +67,42 @@ reg dramwrite_lowhigh;
 reg dramread_lowhigh;
 reg [4:0] spicount; // define as 5 bits instead of 4 to prevent the first bit from wrapping around at the end of transmitting the 16-bit data (8 addr + 8 data)
 reg [7:0] serialaddress;
+reg spi_data_phase;       // set once the register address byte has been received, cleared at the start of each transaction
+reg [7:0] burst_wr_byte;  // last data byte received during a 0x16 burst write
+reg burst_wr_toggle;      // toggles in the SPI clock domain each time a burst write byte is received
+reg [2:0] metaburst;      // synchronizer for burst_wr_toggle into the 40 MHz clock domain
+wire burst_wr_strobe;     // one clock pulse per burst write byte in the 40 MHz clock domain
+wire dram_byte_write;     // a data byte arrived from either the 0x06 register or the 0x16 burst
+wire [7:0] dram_byte_data;
+reg [7:0] dram_writedata_low; // holds the low byte until the high byte arrives so the word is written as a unit
+reg [15:0] burst_rd_word; // SDRAM word being shifted out during a 0x98 burst read
+reg burst_rd_high;        // 0 while the low byte of burst_rd_word is shifted out, 1 for the high byte
+reg burst_rd_toggle;      // toggles in the SPI clock domain each time burst_rd_word is loaded, requests the next word
+reg [2:0] metaburstrd;    // synchronizer for burst_rd_toggle into the 40 MHz clock domain
+wire burst_rd_strobe;     // one clock pulse per burst read word in the 40 MHz clock domain
+wire [7:0] burst_rd_byte;
+wire burst_rd_bit;
 wire [7:0] muxed_read_data;
 wire pre_spi_miso;
 reg frdlyd;
 reg toggle_wp;
 reg [1:0] operation_id;
 reg Disk_Fault;
+reg [7:0] fill_pattern;   // byte repeated in both halves of every word a fill writes, register 0x1B
+reg [17:0] fill_words;    // words the fill still has to write, nonzero while the fill runs
+wire fill_start;
+wire fill_next;
 
 wire spi_start;
 
 //============================ Start of Code =========================================
 
+// the burst toggles live in the SPI clock domain and have no reset, start them at zero so the synchronizers see no false byte
+initial begin
+  burst_wr_toggle = 1'b0;
+  burst_rd_toggle = 1'b0;
+end
+
 // SB_DFFS - D Flip-Flop, Set is asynchronous to the clock.
 SB_DFFS SPI_DFFS_inst (
 .Q(spi_start), // Registered Output, "Q" output of the DFF
@@ -82,9 +118,12 @@ SB_DFFS SPI_DFFS_inst (
 assign muxed_read_data = (serialaddress == 8'h81) ? Cylinder_Address[7:0] :
                            ((serialaddress == 8'h82) ? {2'b0, Sector_Address[1:0], operation_id[1:0], 
                                                         Selected_Ready, Head_Select} :
-                            ((serialaddress == 8'h83) ? {8'h00} :
+                            // 83 bit 0 is set while an SDRAM fill is running
+                            ((serialaddress == 8'h83) ? {7'd0, (fill_words != 18'd0)} :
                              ((serialaddress == 8'h90) ? major_version[7:0] :
                               ((serialaddress == 8'h91) ? minor_version[7:0] :
+                               // 99 reads the dirty sector map one cylinder byte at a time
+                               ((serialaddress == 8'h99) ? dirty_map_data[7:0] :
                                // A0 reads back status similar to what is sent by 00
                                    // x80 is Read_Only
                                    // x40 is File Ready set by FPGA and lamp lit by Pico
@@ -104,9 +143,15 @@ assign muxed_read_data = (serialaddress == 8'h81) ? Cylinder_Address[7:0] :
                                     ? dram_readdata[15:8] 
                                     : dram_readdata[7:0])
                                   : 8'b0
-                                ))))));
+                                )))))));
+
+// during a 0x98 burst read every byte after the register address comes from burst_rd_word, low byte first
+// spicount[2:0] is 7 for the first bit of each byte and 6 for the last bit
+assign burst_rd_byte = burst_rd_high ? burst_rd_word[15:8] : burst_rd_word[7:0];
+assign burst_rd_bit = burst_rd_byte[3'd6 - spicount[2:0]];
 
-assign pre_spi_miso = ((spicount == 5'd7) & muxed_read_data[7]) | 
+assign pre_spi_miso = (spi_data_phase && (serialaddress == 8'h98)) ? burst_rd_bit :
+                      ((spicount == 5'd7) & muxed_read_data[7]) | 
                       ((spicount == 5'd8) & muxed_read_data[6]) |
                       ((spicount == 5'd9) & muxed_read_data[5]) |
                       ((spicount == 5'd10) & muxed_read_data[4]) |
@@ -120,7 +165,30 @@ begin : SPICLKPOSFUNCTIONS // block name
   // Reset the SPI bit counter using the DFF that is set when spi_cs_n is inactive
   // The SPI bit counter is used by a mux to serialize the SPI read data.
   spicount <= spi_start ? 5'd0 : spicount + 1;
-  serialaddress <= (spicount == 6) ? {spiserialreg[6:0], spi_mosi} : serialaddress;
+  // the register address is the first byte only. spicount wraps during a burst so the capture is blocked after the first byte
+  serialaddress <= ((spicount == 6) && ~spi_data_phase) ? {spiserialreg[6:0], spi_mosi} : serialaddress;
+  spi_data_phase <= spi_start ? 1'b0 : ((spicount == 6) ? 1'b1 : spi_data_phase);
+
+  // register 0x16 is a burst write, every 8 bits after the register address is another data byte for the SDRAM
+  // the byte is handed to the 40 MHz clock domain by toggling burst_wr_toggle
+  if(spi_data_phase && (spicount[2:0] == 3'd6) && (serialaddress == 8'h16)) begin
+    burst_wr_byte <= {spiserialreg[6:0], spi_mosi};
+    burst_wr_toggle <= ~burst_wr_toggle;
+  end
+
+  // register 0x98 is a burst read. dram_readdata already holds the word at the SDRAM address, so it is captured
+  // when the register address byte completes and again each time a high byte completes. Each capture toggles
+  // burst_rd_toggle so the 40 MHz clock domain fetches the following word while the current one is shifted out.
+  if((spicount == 6) && ~spi_data_phase && ({spiserialreg[6:0], spi_mosi} == 8'h98)) begin
+    burst_rd_word <= dram_readdata;
+    burst_rd_high <= 1'b0;
+    burst_rd_toggle <= ~burst_rd_toggle;
+  end
+  else if(spi_data_phase && (spicount[2:0] == 3'd6) && (serialaddress == 8'h98)) begin
+    burst_rd_word <= burst_rd_high ? dram_readdata : burst_rd_word;
+    burst_rd_high <= ~burst_rd_high;
+    burst_rd_toggle <= burst_rd_high ? ~burst_rd_toggle : burst_rd_toggle;
+  end
 
   if(spi_cs_n == 1'b0) begin
     spiserialreg[7:0] <= {spiserialreg[6:0], spi_mosi};
@@ -140,6 +208,17 @@ begin : SPICSPOSFUNCTIONS // block name
     spi_serpar_reg <=  spiserialreg;
 end
 
+// a byte for the SDRAM comes either from a single 0x06 transaction or from each byte of a 0x16 burst
+assign burst_wr_strobe = metaburst[2] ^ metaburst[1];
+assign burst_rd_strobe = metaburstrd[2] ^ metaburstrd[1];
+assign dram_byte_write = ((serialaddress == 8'h06) & ~metaspi[2] & metaspi[3]) | burst_wr_strobe;
+assign dram_byte_data = burst_wr_strobe ? burst_wr_byte : spi_serpar_reg;
+
+// register 0x1A starts a fill of that many 512 word sector slots from the SDRAM address, 0 fills 256 slots
+// each word is requested when the SDRAM controller acknowledges the one before, the SPI address advances by itself
+assign fill_start = (serialaddress == 8'h1a) & ~metaspi[2] & metaspi[3];
+assign fill_next = dram_writeack_spi & (fill_words > 18'd1);
+
 always @ (posedge clock)
 begin : HSCLOCKFUNCTIONS // block name
   if(reset == 1'b1) begin
@@ -154,12 +233,21 @@ begin : HSCLOCKFUNCTIONS // block name
     dramwrite_lowhigh <= 1'b0;
     dramread_lowhigh <= 1'b0;
     dram_writedata_spi <= 16'd0;
+    dram_writedata_low <= 8'd0;
     metaspi <= 4'b0000;
+    metaburst <= 3'b000;
+    metaburstrd <= 3'b000;
     toggle_wp <= 1'b0;
     interface_test_mode <= 1'b0;
     operation_id <= 2'b00;
     command_interrupt <= 1'b0;
     Servo_Pulse_FPGA <= 1'b0;
+    dirty_map_reset_spi <= 1'b0;
+    dirty_map_read_spi <= 1'b0;
+    demand_load <= 1'b0;
+    cylinder_loaded_spi <= 1'b0;
+    fill_pattern <= 8'd0;
+    fill_words <= 18'd0;
     Disk_Fault = 1'b0;
   end
   else begin
@@ -181,6 +269,8 @@ begin : HSCLOCKFUNCTIONS // block name
     frdlyd <= Cart_Ready;
 
     metaspi[3:0] <= {metaspi[2:0], ~spi_cs_n};
+    metaburst[2:0] <= {metaburst[1:0], burst_wr_toggle};
+    metaburstrd[2:0] <= {metaburstrd[1:0], burst_rd_toggle};
 
     Fault_Latch <= BUS_FILE_READY_CTRL_L == 1'b1
                    ? 1'b0
@@ -216,16 +306,34 @@ begin : HSCLOCKFUNCTIONS // block name
     load_address_spi   <= (serialaddress == 8'h05) & ~metaspi[2] & metaspi[3]; // command to load 8 bits of address from SPI
 
   //
-  // below for register address 0x06 written by Pico
+  // below for register address 0x06 and burst register 0x16 written by Pico
   //
     // register address 0x06 written by Pico sends data word via pair of sequential messages
-    dram_writedata_spi[7:0] <=  ((serialaddress == 8'h06) && ~metaspi[2] && metaspi[3]) 
-                             ? dram_writedata_spi[15:8] 
-                             : dram_writedata_spi[7:0];
-    dram_writedata_spi[15:8] <= ((serialaddress == 8'h06) && ~metaspi[2] && metaspi[3]) 
-                              ? spi_serpar_reg 
-                              : dram_writedata_spi[15:8];
-    dram_write_enbl_spi <=       (serialaddress == 8'h06) & ~metaspi[2] & metaspi[3] & dramwrite_lowhigh;
+    // register address 0x16 sends any number of data bytes in one message, each pair of bytes is written as a word
+    // the low byte is held until the high byte arrives so dram_writedata_spi is stable for a whole word time
+    dram_writedata_low <= (dram_byte_write && ~dramwrite_lowhigh) 
+                        ? dram_byte_data 
+                        : dram_writedata_low;
+    dram_writedata_spi <= (dram_byte_write && dramwrite_lowhigh) 
+                        ? {dram_byte_data, dram_writedata_low} 
+                        : (fill_start 
+                              ? {fill_pattern, fill_pattern} 
+                              : dram_writedata_spi);
+    dram_write_enbl_spi <= (dram_byte_write & dramwrite_lowhigh) | fill_start | fill_next;
+
+  //
+  // below for registers 0x1A and 0x1B used to fill the SDRAM
+  //
+    // register address 0x1B written by Pico sets the fill byte, register address 0x1A starts the fill
+    // the Pico waits for bit 0 of register 0x83 to clear before any other SDRAM access
+    fill_pattern <= ((serialaddress == 8'h1b) && ~metaspi[2] && metaspi[3]) 
+                  ? spi_serpar_reg 
+                  : fill_pattern;
+    fill_words <= fill_start 
+                ? {(spi_serpar_reg == 8'd0), spi_serpar_reg, 9'd0} 
+                : ((dram_writeack_spi && (fill_words != 18'd0)) 
+                      ? fill_words - 1 
+                      : fill_words);
 
   //
   // below for register address 0x10 written by Pico
@@ -244,6 +352,24 @@ begin : HSCLOCKFUNCTIONS // block name
                          ? (spi_serpar_reg[7:0] == 8'h55) 
                          : interface_test_mode;
 
+  //
+  // below for registers 0x17 and 0x99 used to read the dirty sector map
+  //
+    // register address 0x17 written by Pico returns the map read pointer to cylinder 0
+    // register address 0x99 read by Pico returns the byte at the read pointer, which is then cleared and the pointer advanced
+    dirty_map_reset_spi <= (serialaddress == 8'h17) & ~metaspi[2] & metaspi[3];
+    dirty_map_read_spi  <= (serialaddress == 8'h99) & ~metaspi[2] & metaspi[3];
+
+  //
+  // below for registers 0x18 and 0x19 used while the image is loaded on demand
+  //
+    // register address 0x18 written by Pico with a cylinder number marks that cylinder loaded
+    // register address 0x19 written by Pico turns demand loading on (x01) or off (x00), off makes every cylinder valid
+    cylinder_loaded_spi <= (serialaddress == 8'h18) & ~metaspi[2] & metaspi[3];
+    demand_load <= ((serialaddress == 8'h19) && ~metaspi[2] && metaspi[3]) 
+                 ? spi_serpar_reg[0] 
+                 : demand_load;
+
   //
   // below for register 0x88 retrieves words from memory via pair of sequential messages
   //
@@ -252,13 +378,14 @@ begin : HSCLOCKFUNCTIONS // block name
     // The read function is triggered after the odd byte is read.
     // The next word is requested after reading the high byte when the SPI address is 8'h88.
     // toggle respective lowhigh bits on a write or read, clear both bits on address load, otherwise lowhigh bits remain the same
-    dram_read_enbl_spi <= (serialaddress == 8'h88) & ~metaspi[2] & metaspi[3] & dramread_lowhigh;
+    // register address 0x98 requests the next word each time a word has been captured for the burst
+    dram_read_enbl_spi <= ((serialaddress == 8'h88) & ~metaspi[2] & metaspi[3] & dramread_lowhigh) | burst_rd_strobe;
 
     // dram_readdata[15:0] always has the data ready that was read at the dram_address.
     // The read function is triggered after the odd byte is read.
     // The next word is requested after reading the high byte when the SPI address is 8'h88.
     // toggle respective lowhigh bits on a write or read, clear both bits on address load, otherwise lowhigh bits remain the same
-    dramwrite_lowhigh <= ((serialaddress == 8'h06) && ~metaspi[2] && metaspi[3]) 
+    dramwrite_lowhigh <= dram_byte_write 
                        ? ~dramwrite_lowhigh 
                        : (((serialaddress == 8'h05) && ~metaspi[2] && metaspi[3]) 
                                ? 1'b0 
@@ -53,6 +53,7 @@
 #include "display_functions.h"
 #include "display_timers.h"
 #include "emulator_command.h"
+#include "microsd_file_ops.h"
 
 // GLOBAL VARIABLES
 struct Disk_State edisk;
@@ -70,6 +71,9 @@ int char_from_callback;
 
 int debug_mode;
 
+// print each command interrupt on the console, the accesses are counted either way
+bool log_events;
+
 // console input callback code
 void callback(void *ptr){
     int *i = (int*) ptr;  // cast void pointer back to int pointer
@@ -79,9 +83,20 @@ void callback(void *ptr){
 
 // pin interrupt to signal PICO from FPGA of seek, read or write
 void gpio_callback(uint gpio, uint32_t events) {
-    int readval = read_int_inputs();
-    int operation_id = (readval >> 10) & 0x3;
+    int readval;
+    int operation_id;
     if((gpio == 4) && ((events & 0x8) == 0x8)){
+        // the event is dropped if the SPI link is busy
+        if (!try_read_int_inputs(&readval))
+            return;
+        operation_id = (readval >> 10) & 0x3;
+
+        // reads and writes count toward the access heat of the cylinder
+        if ((operation_id == 1) || (operation_id == 2))
+            record_cylinder_access(readval & 0xff);
+        if (!log_events)
+            return;
+
         printf("some kind of event to callback\r\n"); // $$$ CVC $$$
         switch(operation_id){
             case 0:
@@ -98,6 +113,14 @@ void gpio_callback(uint gpio, uint32_t events) {
                 break;
         }
     }
+    // the 1130 supply failing
+    else if (note_power_fail_event(gpio)) {
+        return;
+    }
+    else {
+        // microSD card inserted or removed
+        note_card_detect_event(gpio);
+    }
 }
 
 // not used any more
@@ -121,6 +144,10 @@ void initialize_states(){
 
     edisk.door_is_open = true;
     edisk.door_count = 0;
+    edisk.checkpoint_interval = 60;
+    edisk.verify_load = false;
+    edisk.verify_write_back = false;
+    edisk.overlay_mode = false;
 
     // initialize states to 2310 values
     strcpy(edisk.controller, "IBM 1130");
@@ -194,6 +221,17 @@ void initialize_system() {
     initialize_fpga(&edisk);
     printf(" *fpga registers initialized\n");
 
+    // image data loads and unloads run on core1
+    start_image_transfer_engine();
+    printf(" *image transfer engine started on core1\n");
+
+    // count the 1130 accesses to each cylinder from the command interrupt
+    log_events = false;
+    gpio_set_irq_enabled_with_callback(4, GPIO_IRQ_EDGE_RISE, true, &gpio_callback); // gpio callback
+    // the same handler watches the microSD card detect switch and the power fail input
+    enable_card_detect_interrupt();
+    enable_power_fail_interrupt();
+
     printf(" *Emulator software version %d.%d\r\n", SOFTWARE_VERSION, SOFTWARE_MINOR_VERSION);
     printf(" *FPGA version %d.%d\r\n", edisk.FPGA_version, edisk.FPGA_minorversion);
     printf(" *Board version %d\r\n", edisk.Board_version);
@@ -266,19 +304,76 @@ int main() {
             // if the key was L or l then begin logging events
             if((char_from_callback == 'L') || (char_from_callback == 'l')){
                 printf("  Begin logging events\r\n");
-                gpio_set_irq_enabled_with_callback(4, GPIO_IRQ_EDGE_RISE, true, &gpio_callback); // gpio callback
+                log_events = true;
             }
             // if the key was S or s then stop logging
             else if((char_from_callback == 'S') || (char_from_callback == 's')){
                 printf("  Stop logging events\r\n");
-                gpio_set_irq_enabled_with_callback(4, GPIO_IRQ_EDGE_RISE, false, &gpio_callback); // gpio callback
+                log_events = false;
+            }
+            // if the key was C or c then step the background write back interval through off, 15s, 60s and 300s
+            else if((char_from_callback == 'C') || (char_from_callback == 'c')){
+                edisk.checkpoint_interval = (edisk.checkpoint_interval == 0) ? 15
+                                          : ((edisk.checkpoint_interval == 15) ? 60
+                                          : ((edisk.checkpoint_interval == 60) ? 300 : 0));
+                if (edisk.checkpoint_interval == 0)
+                    printf("  Changed sectors written back only at unload\r\n");
+                else
+                    printf("  Changed sectors written back every %d seconds\r\n", edisk.checkpoint_interval);
+            }
+            // if the key was V or v then turn the SDRAM read back check after each load on or off
+            else if((char_from_callback == 'V') || (char_from_callback == 'v')){
+                edisk.verify_load = !edisk.verify_load;
+                if (edisk.verify_load)
+                    printf("  The SDRAM is read back and checked after each load\r\n");
+                else
+                    printf("  The SDRAM is not read back after a load\r\n");
+            }
+            // if the key was W or w then turn the microSD read back check of each write back on or off
+            else if((char_from_callback == 'W') || (char_from_callback == 'w')){
+                edisk.verify_write_back = !edisk.verify_write_back;
+                if (edisk.verify_write_back)
+                    printf("  Written image data is read back from the microSD card and checked\r\n");
+                else
+                    printf("  Written image data is not read back\r\n");
+            }
+            // if the key was O or o then turn writing back to an overlay next to the image on or off
+            else if((char_from_callback == 'O') || (char_from_callback == 'o')){
+                edisk.overlay_mode = !edisk.overlay_mode;
+                if (edisk.overlay_mode)
+                    printf("  Changed sectors are added to the overlay, the image is left as it was\r\n");
+                else
+                    printf("  Changed sectors are written to the image, an overlay is folded in at the next unload\r\n");
+            }
+            // if the key was R or r then drop the last write back from the overlay, only with no cartridge loaded
+            else if((char_from_callback == 'R') || (char_from_callback == 'r')){
+                if((edisk.run_load_state != RLST0) || !is_card_present()){
+                    printf("  Unload the cartridge and insert the microSD card first\r\n");
+                }
+                else if(rollback_disk_image() != FILE_OPS_OKAY){
+                    display_error((char *) "roll back", (char *) "failed");
+                }
+            }
+            // if the key was D or d then copy a fragmented image into a contiguous file, only with no cartridge loaded
+            else if((char_from_callback == 'D') || (char_from_callback == 'd')){
+                if((edisk.run_load_state != RLST0) || !is_card_present()){
+                    printf("  Unload the cartridge and insert the microSD card first\r\n");
+                }
+                else{
+                    display_status((char *) "image file", (char *) "defragmenting");
+                    if(defragment_disk_image() != FILE_OPS_OKAY)
+                        display_error((char *) "defragment", (char *) "failed");
+                    else
+                        display_status((char *) "image file", (char *) "contiguous");
+                }
             }
             // erase character until the next one is entered
             char_from_callback = 0; //reset the value
         }
 
-        // wait 1/10th second then increment ticker count
-        sleep_ms(100);
+        // wait 1/10th second then increment ticker count, a power fail edge ends the wait early
+        for (int wait = 0; (wait < 20) && !take_power_fail_event(); wait++)
+            sleep_ms(5);
         ticker++;
     }
     return 0;
@@ -31,6 +31,10 @@ struct Disk_State
     bool p_wp_switch, wp_switch;
     bool door_is_open;
     int door_count;
+    int checkpoint_interval;  // seconds between background write backs while running, 0 writes back only at unload
+    bool verify_load;         // read the whole image back from the SDRAM after a load and check its image check
+    bool verify_write_back;   // read each cylinder or sector back from the microSD card after it is written
+    bool overlay_mode;        // write backs go to name.dlt next to the image, which is left as it was
 
     int debug_vsense;
 
@@ -31,13 +31,8 @@
 #define DRIVE_CHAR_XOFFSET 24
 #define DRIVE_CHAR_YOFFSET 2
 
-#define MAX_SECTOR_SIZE 1024
-
 //static Display_State edisplay;
 
-static FIL fil;
-static uint8_t sectordata[MAX_SECTOR_SIZE];  // used hear to read in BMP for display
-
 struct Display_State
 {public:
     int display_message_timer;
@@ -173,9 +168,6 @@ void display_drive_address(int drv_addr, bool fixed, char *image_name)
     int x_coord, y_coord, bit_coord;
     uint8_t imagebyte;
 
-    FRESULT fr;
-    UINT nr;
-
     ssd1306_clear(&disp);
 
     for(y_coord = DRIVE_CHAR_YOFFSET; y_coord < (DRIVE_CHAR_YOFFSET + DRIVE_CHAR_HEIGHT); y_coord++){
@@ -189,8 +181,6 @@ void display_drive_address(int drv_addr, bool fixed, char *image_name)
         }
     }
 
-    ssd1306_bmp_show_image_with_offset(&disp, sectordata, 446, 0, 0);
-
     // image name
     x_coord = DISPLAY_WIDTH / 2 - (strlen(image_name) * ssd1306_get_font_width(2)) / 2;
     ssd1306_draw_string(&disp, x_coord, 52, 2, image_name);
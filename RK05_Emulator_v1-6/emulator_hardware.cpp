@@ -11,6 +11,8 @@
 #include "hardware/uart.h"
 #include "pico/binary_info.h"
 #include "hardware/spi.h"
+#include "hardware/dma.h"
+#include "pico/mutex.h"
 
 #include "disk_state_definitions.h"
 #include "display_functions.h"
@@ -78,6 +80,12 @@
 #define SPI_BITCLKDIV_DP_E 0xe  // unused
 #define SPI_BITPLSWIDTH_F 0xf  // unused
 #define SPI_RESET_CYLINDER_10 0x10
+#define SPI_DRAM_BURST_WRITE_16 0x16  // FPGA 2.9 and later
+#define SPI_DIRTY_MAP_RESET_17 0x17   // FPGA 2.11 and later
+#define SPI_CYLINDER_LOADED_18 0x18   // FPGA 2.13 and later
+#define SPI_DEMAND_LOAD_19 0x19       // FPGA 2.13 and later
+#define SPI_FILL_COUNT_1A 0x1a        // FPGA 2.14 and later
+#define SPI_FILL_PATTERN_1B 0x1b      // FPGA 2.14 and later
 #define SPI_USECPERSECTH_10 0x10   // unused
 #define SPI_USECPERSECTL_11 0x11  // unused
 #define SPI_SERVO_PW_12 0x12
@@ -89,6 +97,8 @@
 #define SPI_DRVSTATUS_82 0x82
 #define SPI_DRVSTATUS_83 0x83
 #define SPI_DRAMREAD_88 0x88
+#define SPI_DRAM_BURST_READ_98 0x98  // FPGA 2.10 and later
+#define SPI_DIRTY_MAP_READ_99 0x99   // FPGA 2.11 and later
 #define SPI_FUNCT_ID_89 0x89     // unused
 #define SPI_FPGACODE_VER_90 0x90
 #define SPI_FPGACODE_MINORVER_91 0x91
@@ -140,6 +150,47 @@ static int servomovedirection;
 static uint servo_slice_num;
 static uint servo_chan;
 
+static bool fpga_burst_write;    // FPGA accepts the 0x16 burst write message
+static bool fpga_burst_read;     // FPGA accepts the 0x98 burst read message
+static bool fpga_dirty_map;      // FPGA keeps the dirty sector map, registers 0x17 and 0x99
+static bool fpga_background_access; // FPGA serves SPI SDRAM reads while the 1130 is using the drive
+static bool fpga_demand_load;    // FPGA holds Access Ready on cylinders not loaded yet, registers 0x18 and 0x19
+static bool fpga_sdram_fill;     // FPGA fills runs of sector slots with one byte, registers 0x1A and 0x1B
+
+// SDRAM burst messages streamed by a TX/RX DMA channel pair with CS held low
+#define SPI_BAUD (25 * 1000 * 1000)
+#define DRAM_BLOCK_MAX_LEN 1024
+static int spi_dma_tx_chan;
+static int spi_dma_rx_chan;
+static const uint8_t spi_zero_tx = 0;
+static uint8_t spi_dummy_rx;
+
+// SDRAM block transfer running in the background on the DMA channels
+#define DRAM_XFER_IDLE 0
+#define DRAM_XFER_BURST 1
+static volatile int dram_xfer_mode = DRAM_XFER_IDLE;   // set back to idle by the DMA interrupt
+
+// the image transfer engine on core1 and the state machine on core0 share the FPGA SPI link, every
+// message holds this lock, a background SDRAM block transfer only while it is started and the DMA interrupt
+// ends it, so the link is free again as soon as the last byte is through
+auto_init_recursive_mutex(fpga_spi_lock);
+static int fpga_spi_depth;      // times the owner of the lock has entered it, only the owner changes it
+
+// take the link, waiting out the DMA of an SDRAM block transfer that is still running, at most a few hundred us
+static void enter_fpga_spi()
+{
+    recursive_mutex_enter_blocking(&fpga_spi_lock);
+    fpga_spi_depth++;
+    while (dram_xfer_mode != DRAM_XFER_IDLE)
+        tight_loop_contents();
+}
+
+static void exit_fpga_spi()
+{
+    fpga_spi_depth--;
+    recursive_mutex_exit(&fpga_spi_lock);
+}
+
 static uint8_t dutyfactortable_fpga[21] = {47, 49, 51, 53, 55, 57, 59, 61, 63, 65, 67, 69, 71, 73, 75, 77, 79, 81, 83, 85, 88};
 
 #ifdef PICO_DEFAULT_SPI_CSN_PIN
@@ -166,9 +217,11 @@ uint8_t read_write_spi_register(uint8_t reg, uint8_t data)
     uint8_t buf[2];
     out_buf[0] = reg;
     out_buf[1] = data;
+    enter_fpga_spi();
     cs_select();
     spi_write_read_blocking (spi_default, out_buf, in_buf, 2);
     cs_deselect();
+    exit_fpga_spi();
     return(in_buf[1]);
 }
 
@@ -178,9 +231,49 @@ void write_spi_register(uint8_t reg, uint8_t data)
     uint8_t buf[2];
     out_buf[0] = reg;
     out_buf[1] = data;
+    enter_fpga_spi();
     cs_select();
     spi_write_read_blocking (spi_default, out_buf, in_buf, 2);
     cs_deselect();
+    exit_fpga_spi();
+}
+
+// start DMA streaming between buffers and the FPGA SPI port, count transfers of the given size
+// The receive channel always runs so the RX FIFO never overflows, if rxincrement is false the
+// received data all lands on one location and is discarded. If txincrement is false the same
+// value is sent count times.
+static void start_spi_dma(enum dma_channel_transfer_size size, const volatile void *tx, bool txincrement,
+                          volatile void *rx, bool rxincrement, int count)
+{
+    dma_channel_config c;
+
+    c = dma_channel_get_default_config(spi_dma_tx_chan);
+    channel_config_set_transfer_data_size(&c, size);
+    channel_config_set_dreq(&c, spi_get_dreq(spi_default, true));
+    channel_config_set_read_increment(&c, txincrement);
+    channel_config_set_write_increment(&c, false);
+    dma_channel_configure(spi_dma_tx_chan, &c, &spi_get_hw(spi_default)->dr, tx, count, false);
+
+    c = dma_channel_get_default_config(spi_dma_rx_chan);
+    channel_config_set_transfer_data_size(&c, size);
+    channel_config_set_dreq(&c, spi_get_dreq(spi_default, false));
+    channel_config_set_read_increment(&c, false);
+    channel_config_set_write_increment(&c, rxincrement);
+    dma_channel_configure(spi_dma_rx_chan, &c, rx, &spi_get_hw(spi_default)->dr, count, false);
+
+    dma_start_channel_mask((1u << spi_dma_tx_chan) | (1u << spi_dma_rx_chan));
+}
+
+// the receive channel of an SDRAM burst is done, every byte has been clocked, so CS goes high and the
+// link is handed back
+static void spi_dma_irq_handler()
+{
+    if (!dma_channel_get_irq1_status(spi_dma_rx_chan))
+        return;
+    dma_channel_acknowledge_irq1(spi_dma_rx_chan);
+    if (dram_xfer_mode == DRAM_XFER_BURST)
+        cs_deselect();
+    dram_xfer_mode = DRAM_XFER_IDLE;
 }
 
 bool get_disk_unlocked()
@@ -337,6 +430,23 @@ int read_int_inputs(){
     return(retval);
 }
 
+// read_int_inputs() for the command interrupt handler, which may have preempted an SPI transaction on this
+// core or find core1 using the link. Either way the inputs are not read and false is returned.
+bool try_read_int_inputs(int *value)
+{
+    if (!recursive_mutex_try_enter(&fpga_spi_lock, NULL))
+        return(false);
+    // the lock is entered again by this core when the handler preempted its owner, which left the depth above 0
+    // the DMA interrupt that ends a block transfer cannot run while this handler does
+    if ((fpga_spi_depth != 0) || (dram_xfer_mode != DRAM_XFER_IDLE)) {
+        recursive_mutex_exit(&fpga_spi_lock);
+        return(false);
+    }
+    *value = read_int_inputs();
+    recursive_mutex_exit(&fpga_spi_lock);
+    return(true);
+}
+
 void load_drive_address(int d_addr)
 {
     return;
@@ -396,6 +506,199 @@ int readbyte()
 
 }
 
+// SDRAM block transfers run in the background on the DMA channels so the caller can overlap them with
+// microSD card accesses. Only one transfer can be in flight, the link is held only while it is started and
+// other FPGA register accesses wait for its DMA to finish. finish_dram_block_transfer() must be called before
+// the buffer is used again. len can be at most DRAM_BLOCK_MAX_LEN.
+// An FPGA without the burst messages takes one blocking message per byte, the transfer is then complete when
+// the start function returns. Streaming those messages as 16-bit frames with the PL022 pulsing CS needs the SPI
+// clock so far down for an old FPGA to see the pulse and fetch the next word that it is no faster.
+//
+// start writing a block of bytes into the SDRAM at ramaddress
+// FPGA 2.9 and later take the whole block in one 0x16 burst message with CS held low,
+// older FPGA versions take one 0x06 message per byte
+void start_dram_block_write(int ramaddress, const uint8_t *buf, int len)
+{
+    uint8_t reg = SPI_DRAM_BURST_WRITE_16;
+
+    enter_fpga_spi();
+    load_ram_address(ramaddress);
+    if (fpga_burst_write) {
+        cs_select();
+        spi_write_blocking(spi_default, &reg, 1);
+        dram_xfer_mode = DRAM_XFER_BURST;
+        start_spi_dma(DMA_SIZE_8, buf, true, &spi_dummy_rx, false, len);
+    }
+    else {
+        for (int i = 0; i < len; i++){
+            storebyte(buf[i]);
+        }
+    }
+    exit_fpga_spi();
+}
+
+// start reading a block of bytes from the SDRAM at ramaddress, buf is valid after finish_dram_block_transfer()
+// FPGA 2.10 and later return the whole block in one 0x98 burst message with CS held low,
+// older FPGA versions take one 0x88 message per byte
+void start_dram_block_read(int ramaddress, uint8_t *buf, int len)
+{
+    uint8_t reg = SPI_DRAM_BURST_READ_98;
+
+    enter_fpga_spi();
+    load_ram_address(ramaddress);
+    if (fpga_burst_read) {
+        cs_select();
+        spi_write_blocking(spi_default, &reg, 1);
+        dram_xfer_mode = DRAM_XFER_BURST;
+        start_spi_dma(DMA_SIZE_8, &spi_zero_tx, false, buf, true, len);
+    }
+    else {
+        for (int i = 0; i < len; i++){
+            buf[i] = readbyte();
+        }
+    }
+    exit_fpga_spi();
+}
+
+// wait for the SDRAM block transfer in flight to complete
+// returns true if the transfer was still running, meaning the caller had to stall for it
+bool finish_dram_block_transfer()
+{
+    bool stalled = (dram_xfer_mode != DRAM_XFER_IDLE);
+
+    while (dram_xfer_mode != DRAM_XFER_IDLE)
+        tight_loop_contents();
+    return(stalled);
+}
+
+// write a block of bytes into the SDRAM starting at ramaddress and wait for it to complete
+void write_dram_block(int ramaddress, const uint8_t *buf, int len)
+{
+    int count;
+
+    while (len > 0) {
+        count = (len > DRAM_BLOCK_MAX_LEN) ? DRAM_BLOCK_MAX_LEN : len;
+        start_dram_block_write(ramaddress, buf, count);
+        finish_dram_block_transfer();
+        ramaddress += count / 2;    // two bytes per SDRAM word
+        buf += count;
+        len -= count;
+    }
+}
+
+// read a block of bytes from the SDRAM starting at ramaddress and wait for it to complete
+void read_dram_block(int ramaddress, uint8_t *buf, int len)
+{
+    int count;
+
+    while (len > 0) {
+        count = (len > DRAM_BLOCK_MAX_LEN) ? DRAM_BLOCK_MAX_LEN : len;
+        start_dram_block_read(ramaddress, buf, count);
+        finish_dram_block_transfer();
+        ramaddress += count / 2;    // two bytes per SDRAM word
+        buf += count;
+        len -= count;
+    }
+}
+
+// *************** FPGA dirty sector map ***************
+// The FPGA sets a bit for each sector slot the 1130 writes, one byte per cylinder with bit (head << 2) | sector.
+// Each byte is cleared as it is read, so reading the whole map also starts a fresh one.
+//
+bool has_dirty_sector_map()
+{
+    return(fpga_dirty_map);
+}
+
+// read len bytes of the map starting at cylinder 0, which clears them in the FPGA
+void read_dirty_sector_map(uint8_t *map, int len)
+{
+    enter_fpga_spi();
+    write_spi_register(SPI_DIRTY_MAP_RESET_17, 0);
+    for (int i = 0; i < len; i++){
+        map[i] = read_write_spi_register(SPI_DIRTY_MAP_READ_99, 0);
+    }
+    exit_fpga_spi();
+}
+
+// the SDRAM can be read back while the cartridge is running without disturbing the 1130
+bool has_background_sdram_access()
+{
+    return(fpga_background_access);
+}
+
+// *************** demand loading ***************
+// The FPGA keeps Access Ready low on a cylinder that is not marked loaded while demand loading is on,
+// so the cartridge can be made ready once cylinder 0 is in and the rest is loaded behind the 1130.
+//
+bool has_demand_loading()
+{
+    return(fpga_demand_load);
+}
+
+// turning demand loading on passes through off, which empties the FPGA map of loaded cylinders
+void set_demand_loading(bool on)
+{
+    write_spi_register(SPI_DEMAND_LOAD_19, 0);
+    if (on)
+        write_spi_register(SPI_DEMAND_LOAD_19, 1);
+}
+
+void mark_cylinder_loaded(int cylinder)
+{
+    write_spi_register(SPI_CYLINDER_LOADED_18, cylinder & 0xff);
+}
+
+bool has_sdram_fill()
+{
+    return(fpga_sdram_fill);
+}
+
+// fill slots 512 word sector slots starting at ramaddress with the byte pattern in every byte
+// the FPGA writes the words itself, bit 0 of register 0x83 stays on until the last one is in the SDRAM
+// a run of 256 slots takes a few ms, one still busy after FILL_TIMEOUT_US returns false and the fill is abandoned
+#define FILL_TIMEOUT_US 100000
+bool fill_dram_slots(int ramaddress, int slots, int pattern)
+{
+    int run;
+    uint32_t starttime;
+
+    enter_fpga_spi();
+    write_spi_register(SPI_FILL_PATTERN_1B, pattern & 0xff);
+    while (slots > 0) {
+        run = (slots > 256) ? 256 : slots;
+        load_ram_address(ramaddress);
+        write_spi_register(SPI_FILL_COUNT_1A, run & 0xff);
+        starttime = time_us_32();
+        while ((read_write_spi_register(SPI_DRVSTATUS_83, 0) & 0x01) != 0) {
+            if ((time_us_32() - starttime) > FILL_TIMEOUT_US) {
+                exit_fpga_spi();
+                return(false);
+            }
+            sleep_us(2);
+        }
+        ramaddress += run * 512;
+        slots -= run;
+    }
+    exit_fpga_spi();
+    return(true);
+}
+
+// the cylinder the arm of the emulated drive is on
+int read_cylinder_address()
+{
+    return(read_write_spi_register(SPI_CYLADDR_81, 0) & 0xff);
+}
+
+// discard whatever was marked before the image was loaded
+void clear_dirty_sector_map()
+{
+    uint8_t map[256];
+
+    if (fpga_dirty_map)
+        read_dirty_sector_map(map, sizeof(map));
+}
+
 // update the FPGA registers from the disk drive parameters read from the header in the RK05 image file
 //
 void update_fpga_disk_state(Disk_State* ddisk){
@@ -530,6 +833,92 @@ bool is_card_present()
     return(card_present);
 }
 
+// *************** microSD card detect ***************
+// Either edge of the card detect switch is noted by the GPIO interrupt handler. The change is reported once the
+// switch has been quiet for CARD_SETTLE_US, so a bouncing insertion is only acted on when the card is seated.
+// A card already in the socket at boot counts as a change.
+//
+#define CARD_SETTLE_US 500000
+static volatile bool card_changed = true;
+static volatile uint32_t card_change_us;
+static volatile uint32_t card_changes;   // every edge of the switch, a mount made before the last one is stale
+
+void enable_card_detect_interrupt()
+{
+    gpio_set_irq_enabled(microSD_CD, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, true);
+}
+
+// called from the GPIO interrupt handler for events other than the FPGA command interrupt
+void note_card_detect_event(uint gpio)
+{
+    if (gpio == microSD_CD) {
+        card_changed = true;
+        card_change_us = time_us_32();
+        card_changes++;
+    }
+}
+
+// true once after the card was inserted or removed and the switch has settled
+bool card_change_settled()
+{
+    if (!card_changed || ((time_us_32() - card_change_us) < CARD_SETTLE_US))
+        return(false);
+    card_changed = false;
+    return(true);
+}
+
+// a card change has been seen that card_change_settled() has not reported yet
+bool card_change_pending()
+{
+    return(card_changed);
+}
+
+// count of card detect edges, unchanged as long as the same card stays in the slot
+uint32_t card_change_count()
+{
+    return(card_changes);
+}
+
+// *************** power fail edge ***************
+// The 1130 supply failing pulls System_Power high. The rising edge is noted by the GPIO interrupt handler so the
+// main loop can cut its tick short and the journal flush starts within a few ms instead of up to a tick later.
+// get_power_fail() is still what decides, an edge from a glitch that is gone again is only a short tick. The flush
+// itself is not run from the interrupt, the card may be in the middle of a FatFs call, so an edge during a long card
+// operation is only acted on once it returns to the main loop.
+//
+static volatile bool power_fail_edge;
+static volatile uint32_t power_fail_us;
+
+void enable_power_fail_interrupt()
+{
+    gpio_set_irq_enabled(System_Power, GPIO_IRQ_EDGE_RISE, true);
+}
+
+// called from the GPIO interrupt handler, returns false for other pins
+bool note_power_fail_event(uint gpio)
+{
+    if (gpio != System_Power)
+        return(false);
+    power_fail_edge = true;
+    power_fail_us = time_us_32();
+    return(true);
+}
+
+// true once after each power fail edge
+bool take_power_fail_event()
+{
+    if (!power_fail_edge)
+        return(false);
+    power_fail_edge = false;
+    return(true);
+}
+
+// time of the last power fail edge
+uint32_t last_power_fail_us()
+{
+    return(power_fail_us);
+}
+
 void close_drive_door()
 {
     servodutyfactor = MOTORMIN;
@@ -643,7 +1032,7 @@ void initialize_spi()
 {
     // initialize SPI to run at 25 MHz
     // This is the CPU to FPGA SPI link.
-    spi_init(spi_default, 25 * 1000 * 1000);
+    spi_init(spi_default, SPI_BAUD);
     gpio_set_function(PICO_DEFAULT_SPI_SCK_PIN, GPIO_FUNC_SPI);
     gpio_set_function(PICO_DEFAULT_SPI_TX_PIN, GPIO_FUNC_SPI);
     gpio_set_function(PICO_DEFAULT_SPI_RX_PIN, GPIO_FUNC_SPI);
@@ -662,6 +1051,13 @@ void initialize_spi()
 
     // Make the CS pin available to picotool
     bi_decl(bi_1pin_with_name(PICO_DEFAULT_SPI_CSN_PIN, "SPI CS"));
+
+    // DMA channels for the SDRAM block transfers, the end of each is taken by the interrupt on this core
+    spi_dma_tx_chan = dma_claim_unused_channel(true);
+    spi_dma_rx_chan = dma_claim_unused_channel(true);
+    dma_channel_set_irq1_enabled(spi_dma_rx_chan, true);
+    irq_add_shared_handler(DMA_IRQ_1, spi_dma_irq_handler, PICO_SHARED_IRQ_HANDLER_DEFAULT_ORDER_PRIORITY);
+    irq_set_enabled(DMA_IRQ_1, true);
 }
 
 void initialize_uart()
@@ -697,4 +1093,16 @@ void initialize_fpga(struct Disk_State* ddisk)
     // read the FPGA version and later confirm whether it's compatible with the software version
     ddisk->FPGA_version = read_fpga_version();
     ddisk->FPGA_minorversion = read_fpga_minorversion();
+
+    // burst SDRAM writes were added in FPGA version 2.9 and burst reads in 2.10
+    fpga_burst_write = (ddisk->FPGA_version > 2) || ((ddisk->FPGA_version == 2) && (ddisk->FPGA_minorversion >= 9));
+    fpga_burst_read = (ddisk->FPGA_version > 2) || ((ddisk->FPGA_version == 2) && (ddisk->FPGA_minorversion >= 10));
+    // the dirty sector map was added in FPGA version 2.11
+    fpga_dirty_map = (ddisk->FPGA_version > 2) || ((ddisk->FPGA_version == 2) && (ddisk->FPGA_minorversion >= 11));
+    // SPI got its own SDRAM address and read data registers in FPGA version 2.12, the map of loaded cylinders for
+    // demand loading came in 2.13, and from 2.15 an SPI word waits for no more than one BUS cycle, which the SDRAM
+    // bursts need to keep up while the 1130 is using the drive
+    fpga_background_access = (ddisk->FPGA_version > 2) || ((ddisk->FPGA_version == 2) && (ddisk->FPGA_minorversion >= 15));
+    fpga_demand_load = (ddisk->FPGA_version > 2) || ((ddisk->FPGA_version == 2) && (ddisk->FPGA_minorversion >= 15));
+    fpga_sdram_fill = (ddisk->FPGA_version > 2) || ((ddisk->FPGA_version == 2) && (ddisk->FPGA_minorversion >= 14));
 }
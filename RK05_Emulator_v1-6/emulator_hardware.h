@@ -27,12 +27,36 @@ bool is_testmode_selected();
 void check_dc_low(Disk_State* ddisk);
 //void boot_open_the_door();
 bool is_card_present();
+void enable_card_detect_interrupt();
+void note_card_detect_event(uint gpio);
+bool card_change_settled();
+bool card_change_pending();
+uint32_t card_change_count();
+void enable_power_fail_interrupt();
+bool note_power_fail_event(uint gpio);
+bool take_power_fail_event();
+uint32_t last_power_fail_us();
 void load_drive_address(int dr_addr);
 void initialize_spi();
 
 void load_ram_address(int ramaddress);
 void storebyte(int bytevalue);
 int readbyte();
+void write_dram_block(int ramaddress, const uint8_t *buf, int len);
+void read_dram_block(int ramaddress, uint8_t *buf, int len);
+void start_dram_block_write(int ramaddress, const uint8_t *buf, int len);
+void start_dram_block_read(int ramaddress, uint8_t *buf, int len);
+bool finish_dram_block_transfer();
+bool has_dirty_sector_map();
+void read_dirty_sector_map(uint8_t *map, int len);
+void clear_dirty_sector_map();
+bool has_background_sdram_access();
+bool has_demand_loading();
+void set_demand_loading(bool on);
+void mark_cylinder_loaded(int cylinder);
+bool has_sdram_fill();
+bool fill_dram_slots(int ramaddress, int slots, int pattern);
+int read_cylinder_address();
 bool is_it_a_tester();
 int read_board_version();
 
@@ -65,4 +89,5 @@ void enable_interface_test_mode();
 void assert_outputs(int step_count);
 int read_test_inputs();
 int read_int_inputs();
+bool try_read_int_inputs(int *value);
 void update_fpga_disk_state(Disk_State* ddisk);
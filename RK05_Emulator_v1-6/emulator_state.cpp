@@ -21,6 +21,62 @@
 #define UNLOADINGERROROFF 4
 
 static int errorlightcount;
+static bool transfer_requested;     // the image data load or unload has been handed to core1
+static int displayed_cylinder;      // transfer progress shown on the display
+static bool demand_loading;         // the load hands the cartridge over once cylinder 0 is in
+static bool door_closing;           // the door ramp is still running while the image loads
+static bool header_cached;          // the image was opened and its header read when the card was inserted
+
+// advance the door ramp one tick, returns true once the door is closed
+static bool door_closed_yet()
+{
+    if (door_closing && (drive_door_status() == DOORCLOSED)) {
+        door_closing = false;
+        printf("Door closed\r\n");
+    }
+    return(!door_closing);
+}
+
+// show the cylinder core1 has reached, only redrawn when it changes
+static void display_transfer_progress(const char *line1)
+{
+    char display_line_2[30];
+    int cylinder = get_image_transfer_progress();
+
+    if (cylinder != displayed_cylinder) {
+        displayed_cylinder = cylinder;
+        sprintf(display_line_2, " Cyl %d", cylinder);
+        display_status((char *) line1, display_line_2);
+    }
+}
+
+// a demand load keeps reading the image on core1 after the cartridge is made ready, transfer_requested stays
+// set until it is done. Returns false if it failed, in which case the cartridge is dropped with a load error.
+static bool poll_background_load(Disk_State* dstate)
+{
+    int result;
+
+    if (!transfer_requested || !check_image_transfer(&result))
+        return(true);
+    transfer_requested = false;
+    if (result == FILE_OPS_OKAY)
+        result = file_close_disk_image();
+    else
+        file_close_disk_image();
+    if (result == FILE_OPS_OKAY) {
+        printf("Disk image data read, file closed successfully\r\n");
+        return(true);
+    }
+
+    clear_cart_ready();
+    set_demand_loading(false);
+    clear_cpu_rdy_indicator();
+    dstate->File_Ready = false;
+    printf("*** ERROR, problem reading disk image data\n");
+    display_error((char *) "cannot read", (char *) "image data");
+    dstate->run_load_state = RLST18;
+    return(false);
+}
 
 void process_run_load_state(Disk_State* dstate){
 int intermediate_result;
@@ -38,6 +94,13 @@ int intermediate_result;
                 break;
             }
 
+            // a card inserted while idle has its image opened ahead of LOAD, a removed one is let go
+            if (card_change_settled()) {
+                release_preopened_image();
+                if (is_card_present())
+                    preopen_disk_image(dstate);
+            }
+
             // ensure read only is off when we are in idle state
             if (get_read_only()) {
                 printf("Resetting Ready Only in idle state\r\n");    // $$$ CVC $$$
@@ -66,7 +129,14 @@ int intermediate_result;
             // If not, then go to load error state with code 1.
             microSD_LED_on();
             printf("  Drive_Address = %d, RLST%x, %d, %d\r\n", dstate->Drive_Address, dstate->run_load_state, dstate->rl_switch, dstate->wp_switch);
-            if(is_card_present()){
+            if(is_card_present() && !card_change_pending() && take_preopened_image()){
+                printf("Card present, disk image already open\r\n");
+                display_status((char *) "image file", (char *) "is open");
+                header_cached = true;
+                dstate->run_load_state = RLST5; // the image was opened when the card went in, go straight to RLST5
+            }
+            else if(is_card_present()){
+                release_preopened_image();
                 printf("Card present, microSD card detected\r\n");
                 display_status((char *) "microSD", (char *) "detected");
                 dstate->run_load_state = RLST2; // if the microSD card is inserted then advance to RLST2
@@ -115,8 +185,15 @@ int intermediate_result;
             // Read the format identifier in the header of the disk image file. If error, then load error state with code 5.
             // If the header is good then start moving the actuator to close the drive door
             printf("  Drive_Address = %d, RLST%x, %d, %d\r\n", dstate->Drive_Address, dstate->run_load_state, dstate->rl_switch, dstate->wp_switch);
-            printf("Reading image file header\r\n");
-            intermediate_result = read_image_file_header(dstate);
+            if (header_cached) {
+                printf("Image file header read when the card was inserted\r\n");
+                intermediate_result = 0;
+                header_cached = false;
+            }
+            else {
+                printf("Reading image file header\r\n");
+                intermediate_result = read_image_file_header(dstate);
+            }
             if(intermediate_result != 0){
                 file_close_disk_image();
                 switch(intermediate_result) {
@@ -145,27 +222,47 @@ int intermediate_result;
             else{
                 printf("Image file header read successfully\r\n");
                 close_drive_door();
-                printf("Moving the actuator to close the door\r\n");
-                display_status((char *) "Closing", (char *) "microSD door");
-                dstate->run_load_state = RLST6;
+                door_closing = true;
+                printf("Moving the actuator to close the door\r\nReading disk image data from file\r\n");
+                display_status((char *) "Reading", (char *) "image data");
+                dstate->run_load_state = RLST7;
             }
             break;
 
         case RLST6:
             // Wait for the actuator to finish closing the drive door.
+            // The door ramp ran through RLST7 while the image data was read, the cartridge goes ready once both are done.
             printf("  Drive_Address = %d, RLST%x, %d, %d\r\n", dstate->Drive_Address, dstate->run_load_state, dstate->rl_switch, dstate->wp_switch);
-            intermediate_result = drive_door_status();
-            if(intermediate_result == DOORCLOSED){
-                printf("Door closed\r\nReading disk image data from file\r\n");
-                display_status((char *) "Reading", (char *) "image data");
-                dstate->run_load_state = RLST7;
+            if (door_closed_yet()) {
+                dstate->run_load_state = RLST8;
             }
             break;
 
         case RLST7:
             // Read the disk image file and write it to the DRAM. If a read error occurs then go to load error state with code 7.
-            printf("  Drive_Address = %d, RLST%x, %d, %d\r\n", dstate->Drive_Address, dstate->run_load_state, dstate->rl_switch, dstate->wp_switch);
-            intermediate_result = read_disk_image_data(dstate);
+            // The transfer runs on core1, this state waits here until it reports back.
+            // A demand load moves on as soon as cylinder 0 is in and finishes in the background.
+            // The door keeps closing one step per tick meanwhile.
+            door_closed_yet();
+            if (!transfer_requested) {
+                printf("  Drive_Address = %d, RLST%x, %d, %d\r\n", dstate->Drive_Address, dstate->run_load_state, dstate->rl_switch, dstate->wp_switch);
+                displayed_cylinder = -1;
+                // the SDRAM read back check needs the whole image in before the 1130 can write to it
+                demand_loading = has_demand_loading() && !dstate->verify_load;
+                request_image_transfer(demand_loading ? IMAGE_XFER_DEMAND_LOAD : IMAGE_XFER_LOAD, dstate);
+                transfer_requested = true;
+            }
+            if (demand_loading && demand_load_ready()) {
+                printf("Cylinder 0 loaded, loading the rest in the background\r\n");
+                display_status((char *) "Image data", (char *) "cylinder 0 OK");
+                dstate->run_load_state = RLST6;
+                break;
+            }
+            if (!check_image_transfer(&intermediate_result)) {
+                display_transfer_progress("Read card");
+                break;
+            }
+            transfer_requested = false;
             if(intermediate_result != 0){
                 file_close_disk_image();
                 printf("*** ERROR, problem reading disk image data\n");
@@ -175,27 +272,38 @@ int intermediate_result;
             else{
                 printf("Disk image data read successfully\r\n");
                 display_status((char *) "Image data", (char *) "read OK");
-                dstate->run_load_state = RLST8;
+                dstate->run_load_state = RLST6;
             }
             break;
 
         case RLST8:
             // Close the disk image file and set the Cart_Ready bit in the FPGA mode register
+            // during a demand load the file stays open until core1 has read the rest of it
             printf("  Drive_Address = %d, RLST%x, %d, %d\r\n", dstate->Drive_Address, dstate->run_load_state, dstate->rl_switch, dstate->wp_switch);
-            intermediate_result = file_close_disk_image();
+            intermediate_result = transfer_requested ? FILE_OPS_OKAY : file_close_disk_image();
             if(intermediate_result != 0){
                 printf("*** ERROR, problem closing disk image data file\n");
                 display_error((char *) "cannot close", (char *) "image file");
                 dstate->run_load_state = RLST18;
             }
             else{
-                printf("Disk image data read, file closed successfully\r\n");
+                if (!transfer_requested)
+                    printf("Disk image data read, file closed successfully\r\n");
                 dstate->run_load_state = RLST9;
+                // start a fresh dirty sector map for this cartridge
+                clear_dirty_sector_map();
                 set_cart_ready();
             }
             break;
 
         case RLST9:
+        // a checkpoint cut short by the drive going not ready leaves its remaining sectors for later
+        finish_checkpoint();
+
+        // a demand load that fails drops the cartridge
+        if (!poll_background_load(dstate))
+            break;
+
         // show fault that might stop us from going ready
         if (get_disk_fault()) { // disk drive threw a fault and went not ready
             set_cpu_fault_indicator();
@@ -218,6 +326,9 @@ int intermediate_result;
                    if (get_power_fail()) {
                       printf("Terminating loaded cart due to power failure\r\n");
                       clear_cart_ready();
+                      // what the 1130 wrote before the drive went not ready is kept in the power fail journal
+                      if (!get_read_only())
+                         emergency_flush_disk_image(dstate);
                       dstate->run_load_state = RLST15a;
                       break;
                    }
@@ -233,19 +344,33 @@ int intermediate_result;
             //
             microSD_LED_on();
 
+            // a demand load that fails drops the cartridge
+            if (!poll_background_load(dstate))
+                break;
+
             if (get_disk_fault()) { // disk drive threw a fault and went not ready
                 set_cpu_fault_indicator();
             }
 
-            // do unload if power is turned off
+            // do unload if power is turned off, the changed sectors go to the power fail journal at once
+            // and the image is written back as well only if they did not all fit
             if (get_power_fail()) {
                 printf("Unrequested unload due to power fail\r\n");
                 clear_cpu_rdy_indicator();
+                if (!get_read_only()) {
+                    clear_cart_ready();
+                    if (emergency_flush_disk_image(dstate) == FILE_OPS_OKAY) {
+                        dstate->File_Ready = false;
+                        dstate->run_load_state = RLST15a;
+                        break;
+                    }
+                }
                 dstate->run_load_state = RLST11; // If the drive stopped then advance to RLST11
                 break;
             }
 
             if (get_disk_ready() && get_real_mode()) { // just in case real drive drops ready due to speed decline etc
+                checkpoint_disk_image(dstate);
                 break;              // if good, continue in this state
             } else if (get_disk_ready() == 0) {                // drive turned off or failed
                 // the File Ready light tells operator if real/virtual drive is ready or not
@@ -262,10 +387,26 @@ int intermediate_result;
                 clear_cpu_rdy_indicator();
                 dstate->run_load_state = RLST11; // If the drive stopped then advance to RLST11
             }
+            else {
+                // copy the sectors the 1130 changed to the image file a few at a time
+                checkpoint_disk_image(dstate);
+            }
             break;
 
         case RLST11:
             // The Load/Unload switch on the box was turned off. Read the contents of the DRAM and write it to the disk image file. 
+            // a demand load still in progress has to finish first, the SDRAM is not a complete image until then
+            if (!poll_background_load(dstate))
+                break;
+            if (transfer_requested) {
+                display_transfer_progress("Finish load");
+                break;
+            }
+
+            // keep the access counts of this session for ordering the next load
+            save_cylinder_heat(dstate);
+            // the sectors a checkpoint in progress has not written yet are written with the rest below
+            finish_checkpoint();
 
             // if the write protect light is on (toggled R/O switch odd number of times) then skip write back
             if (get_read_only()) { // we want this cartridge to remain as it was
@@ -280,6 +421,15 @@ int intermediate_result;
             // turn off cart ready so FPGA doesn't try to access it
             clear_cart_ready();
 
+            // the FPGA tracks the sectors written, when there are none the file is already up to date
+            // unless its overlay is to be folded in, which rewrites it all the same
+            if ((fetch_dirty_sector_map(dstate) == 0) && !overlay_fold_pending()) {
+                printf("Cartridge was not written\r\n");
+                dstate->File_Ready = false;
+                dstate->run_load_state = RLST15a;
+                break;
+            }
+
             printf("  Drive_Address = %d, RLST%x, %d, %d\r\n", dstate->Drive_Address, dstate->run_load_state, dstate->rl_switch, dstate->wp_switch);
             intermediate_result = file_open_write_disk_image();
             printf("finished file open for write, code %d\r\n", intermediate_result);
@@ -317,9 +467,18 @@ int intermediate_result;
             break;
 
         case RLST13:
-            // Write the disk image data.
-            printf("  Drive_Address = %d, RLST%x, %d, %d\r\n", dstate->Drive_Address, dstate->run_load_state, dstate->rl_switch, dstate->wp_switch);
-            intermediate_result = write_disk_image_data(dstate);
+            // Write the disk image data. The transfer runs on core1, this state waits here until it reports back.
+            if (!transfer_requested) {
+                printf("  Drive_Address = %d, RLST%x, %d, %d\r\n", dstate->Drive_Address, dstate->run_load_state, dstate->rl_switch, dstate->wp_switch);
+                displayed_cylinder = -1;
+                request_image_transfer(IMAGE_XFER_UNLOAD, dstate);
+                transfer_requested = true;
+            }
+            if (!check_image_transfer(&intermediate_result)) {
+                display_transfer_progress("Write card");
+                break;
+            }
+            transfer_requested = false;
             if(intermediate_result != FILE_OPS_OKAY){
                 file_close_disk_image();
                 printf("*** ERROR, write_disk_image_data failed\r\n");
@@ -338,7 +497,7 @@ int intermediate_result;
             // Start moving the actuator to close the drive door
             // Close the disk image file and set the File_Ready bit in the FPGA mode register and illuminate RDY on the front panel.
             printf("  Drive_Address = %d, RLST%x, %d, %d\r\n", dstate->Drive_Address, dstate->run_load_state, dstate->rl_switch, dstate->wp_switch);
-            intermediate_result = file_close_disk_image();
+            intermediate_result = file_commit_disk_image(dstate);
             if(intermediate_result != 0){
                 printf("*** ERROR, problem closing disk image data file\n");
                 display_error((char *) "image file", (char *) "close fail");
@@ -346,6 +505,8 @@ int intermediate_result;
             }
             else{
                 printf("Disk image data write, file closed successfully\r\n");
+                // sectors replayed from the power fail journal at load were written back with the rest
+                retire_power_fail_journal();
                 display_status((char *) "Opening", (char *) "microSD door");
                 open_drive_door();
                 printf("Moving the actuator to open the door\r\n");
@@ -466,6 +627,11 @@ int intermediate_result;
 
         case RLST15a:
             // trigger door to open when we are not writing back a cartridge
+            // but not while a demand load still has the image file open
+            if (!poll_background_load(dstate))
+                break;
+            if (transfer_requested)
+                break;
             printf("Disk image not written back\r\n");
             display_status((char *) "Opening", (char *) "microSD door");
             open_drive_door();
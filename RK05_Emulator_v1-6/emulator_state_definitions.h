@@ -14,7 +14,7 @@
 #define RLST4  0x4  // Check to see if the disk image file can be opened. If not, then go to load error state with code 4.
 #define RLST5  0x5  // Read the format identifier in the header of the disk image file. If there's an error, then go to load error state with code 5.
                     // If the header is good then start moving the actuator to close the drive door
-#define RLST6  0x6  // Wait for the actuator to finish closing the drive door.
+#define RLST6  0x6  // Wait for the actuator to finish closing the drive door, after RLST7 has read the image data.
 #define RLST7  0x7  // Read the disk image file and write it to the DRAM. If a read error occurs then go to load error state with code 7.
 #define RLST8  0x8  // Close the disk image file and set the File_Ready bit in the FPGA mode register and illuminate RDY on the front panel.
 #define RLST9  0x9  // waiting for 1130 disk drive to declare itself ready
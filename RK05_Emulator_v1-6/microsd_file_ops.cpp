@@ -6,6 +6,7 @@
 // 
 #include <stdio.h>
 #include "pico/stdlib.h"
+#include "pico/multicore.h"
 #include <string.h>
 
 //#include "hardware/spi.h"
@@ -19,9 +20,9 @@
 #include "display_functions.h"
 #include "emulator_state_definitions.h"
 #include "emulator_hardware.h"
+#include "microsd_file_ops.h"
 
 
-#define MAX_SECTOR_SIZE 1024 
 #define FILE_OPS_OKAY   0
 #define FILE_OPS_ERROR  1
 
@@ -31,10 +32,171 @@ static int ret;
 
 //const char configfilename[] = "config.txt";
 static char diskimagefilename[FF_LFN_BUF + 1] = "";
-static uint8_t sectordata[MAX_SECTOR_SIZE];  // largest possible sector data is 580 for RK11-E
+static char newfilename[FF_LFN_BUF + 1] = "";
+// two cylinder buffers used ping-pong, the image moves to and from the card a whole cylinder per FatFs call
+// while the SDRAM transfers of the other cylinder run. The SDRAM holds at most 2 heads of 4 sectors per cylinder,
+// 5136 bytes, which is 11 blocks with the padding of a version 2.0 image.
+#define CYLINDER_BUFFER_SIZE (11 * 512)
+static uint8_t cylinderdata[2][CYLINDER_BUFFER_SIZE];
+
+// a version 3.0 image packs every track on its own, the tracks of a cylinder are moved through this buffer
+// and are found with the table of track offsets in the blocks after the header
+#define MAX_PACKED_TRACKS 512
+static uint8_t packeddata[CYLINDER_BUFFER_SIZE];
+static uint32_t track_offsets[MAX_PACKED_TRACKS + 1];   // file offset of each track, the last one is the end of the file
+#define PACK_HASH_SIZE 1024
+static uint16_t pack_hash[PACK_HASH_SIZE];              // last track position + 1 of each 3 byte hash while packing
+
+// per stage timing of the last image load or unload in microseconds
+static uint32_t sd_stage_us;      // time in f_read()/f_write()
+static uint32_t fpga_stage_us;    // time starting SDRAM transfers and waiting for them to complete
+static int fpga_stalls;           // number of times the SDRAM transfer was still running when it was needed
+
+// sector slots the 1130 wrote since the image was loaded, one byte per cylinder from the FPGA dirty sector map
+static uint8_t dirty_sector_map[256];
+static bool incremental_write_back;  // rewrite only the dirty sectors in place instead of the whole file
+static FSIZE_t image_data_offset;    // file offset of the first sector, just past the header
+static FSIZE_t cylinder_stride;      // file bytes from the first sector of one cylinder to the next
+static bool image_aligned;           // the image is version 2.0 or later, header and cylinders on 512 byte blocks
+static bool image_zero_map;          // the image is version 2.1, the block after the header maps the sectors of zeros
+static bool image_compressed;        // the image is version 3.0, each track packed on its own, see pack_track()
+static bool image_contiguous;        // the open image file is one unbroken run of clusters
+static LBA_t image_first_lba;        // card block holding the first byte of the open image file
+static FIL copyfil;                  // the new file while an image is copied to make it contiguous
+
+// FatFs fast seek cluster link map of the open image file, built once at open so a seek to any sector is looked up
+// in the table instead of following the cluster chain from the start of the file. Two entries per fragment plus two.
+#define IMAGE_LINK_MAP_SIZE 64
+static DWORD image_link_map[IMAGE_LINK_MAP_SIZE];
+
+// a full rewrite goes to a sibling file, name.new, that replaces name.dsk only after it is closed and verified
+static bool writing_sibling;         // fil is the sibling file of a full rewrite
+static FSIZE_t image_file_size;      // size of the version 2.1 file a full rewrite of the loaded image makes
+
+// sectors of a version 2.1 image that hold nothing but zeros, one byte per cylinder with a bit for each sector in
+// file order, head * sectors + sector. They are filled in the SDRAM instead of being read, and a cylinder of them
+// is not written when the image is rewritten, so what the file holds for a marked sector does not matter.
+#define ZERO_MAP_OFFSET 512
+static uint8_t zero_sector_map[512];
+static bool zero_map_dirty;          // sectors were marked that are not in the map block of the file yet
+
+// image check of the sector data, the XOR of the CRC-32 of every sector taken over its sector number, 4 bytes
+// high first, and its 642 bytes. It does not depend on the order the cylinders are loaded in and a sector written
+// in place changes it by the old and new CRC of that sector. Images from version 2.0 on keep it in the header
+// block just past the fields, as "CRC" and the value, where a version 1.3 image has its first sector.
+#define HEADER_CRC_OFFSET 365
+static uint32_t crc_table[256];
+static uint32_t image_crc;           // image check of the sectors in the file, taken as they are loaded or written
+static bool image_crc_known;         // image_crc is right for the file, a write in place it cannot follow clears it
+static bool image_crc_dirty;         // the header does not hold image_crc yet
+static bool header_crc_cleared;      // the image check in the header on the card is zeros
+static bool header_has_crc;          // the header read at load had an image check
+static uint32_t header_crc;
+
+// the image is found, opened and its header read into Disk_State when a card is inserted, ahead of LOAD
+static bool image_preopened;
+
+// background write back of the dirty sectors while the cartridge is running, one cylinder per call
+#define CHECKPOINT_CYLINDERS_PER_CALL 1
+static bool checkpoint_open;         // the image file is open for a checkpoint pass
+static int checkpoint_cylinder;      // cylinder the checkpoint pass looks at next
+static int checkpoint_sectors;       // sectors written by the checkpoint pass
+static uint32_t checkpoint_last_us;  // when the last checkpoint pass finished, or the image was loaded
+
+// CRC of every sector taken as the image was loaded, so FPGAs without the dirty sector map can
+// still find the changed sectors by hashing what they read back from the SDRAM at unload
+#define MAX_SECTOR_SLOTS 2048
+static uint32_t sector_hashes[MAX_SECTOR_SLOTS];
+static bool sector_hashes_valid;
+static bool use_sector_hashes;       // the incremental write back compares hashes instead of using the dirty sector map
+
+// base plus overlay. The image is left as it was and the sectors of each write back are added to the end of name.dlt,
+// a 16 byte header of "2315DLTA" and the image check of the image it belongs to, then entries of the session number
+// and the sector slot, 2 bytes each high first, the 642 bytes and a CRC of the three. The last entry of a slot holds
+// its contents, a load reads them over the image as it goes, and each load is a new session so the write backs
+// of one can be dropped again. Once the overlay has grown to OVERLAY_COMPACT_BYTES it is folded into the image.
+#define OVERLAY_MAGIC "2315DLTA"
+#define OVERLAY_HEADER_SIZE 16
+#define OVERLAY_ENTRY_SIZE (4 + 642 + 4)
+#define OVERLAY_COMPACT_BYTES (256 * 1024)
+static FIL deltafil;                 // the overlay while it is read into a load
+static bool deltafil_open;
+static uint32_t delta_index[MAX_SECTOR_SLOTS];   // file offset of the last entry of each sector slot, 0 for none
+static FSIZE_t delta_end;            // end of the last whole entry, 0 when the image has no overlay
+static int delta_sectors;            // sector slots with an entry
+static int delta_session;            // session number of the write backs of this load
+static uint32_t delta_crc;           // image check of the sectors loaded XOR the one of the image
+static bool overlay_active;          // the loaded image has an overlay or gets one at the first write back
+static bool overlay_write_back;      // this write back goes to the overlay
+static bool writing_overlay;         // fil is the overlay, open for a write back or checkpoint
+static bool compact_overlay;         // this write back is a full rewrite and the overlay is removed after it
+
+// power fail journal, name.jnl next to the image. It is allocated as one run of blocks at load, so an emergency
+// flush writes the changed sectors with disk_write() alone, with no FAT or directory updates. The first block holds
+// "2315JRNL", the image check of the image it belongs to, the stamp and sector count of the last flush, the hold-up
+// budget, the measured time to write a block and the measured hold-up time. Entries like those of the overlay follow
+// from the second block, with the stamp as their session number, so a flush cut short leaves the entries before the
+// cut. The last block is where a flush that finished keeps writing the time since it started until the supply is gone.
+#define JOURNAL_MAGIC "2315JRNL"
+#define JOURNAL_ENTRIES 512
+#define JOURNAL_BLOCKS (2 + (JOURNAL_ENTRIES * OVERLAY_ENTRY_SIZE + FF_MAX_SS - 1) / FF_MAX_SS)
+#define JOURNAL_HOLDUP_BLOCK (JOURNAL_BLOCKS - 1)
+#define JOURNAL_ENTRY_BIT 0x80000000u      // a delta_index entry that is in the journal, not the overlay
+#define JOURNAL_PROBE_BLOCKS 8
+#define HOLDUP_MAGIC "2315HOLD"
+#define HOLDUP_LIMIT_US 2000000             // a supply that holds up longer than this is not measured any further
+static FIL jnlfil;                   // the journal while it is replayed into a load
+static bool jnlfil_open;
+static bool journal_ready;           // the journal is allocated in one run and journal_lba is its first block
+static LBA_t journal_lba;
+static uint32_t journal_card_changes;   // card_change_count() when the journal was set up
+static uint8_t journalheader[FF_MAX_SS];
+static bool journal_bound;           // the image had an image check and journal_crc is it
+static uint32_t journal_crc;
+static int journal_stamp;            // stamp of the entries that are replayed
+static int journal_planned;          // sectors the last flush set out to write
+static int journal_budget;           // sectors a flush commits within the hold-up, 0 until a flush is cut short
+static uint32_t journal_block_us;    // time to write one block to the journal
+static uint32_t journal_holdup_us;   // time from the start of a flush until the supply went down, 0 until measured
+static int journal_flush_first;      // entry the last flush started at, the entries before it are from an earlier one
+static int journal_sectors;          // entries replayed at load or written by a flush that are not written back yet
+
+// read back check of a write back, each cylinder or sector is read from the card again right after it is written
+#define MAX_CYLINDER_SLOTS (CYLINDER_BUFFER_SIZE / 642)
+static uint32_t written_crcs[MAX_CYLINDER_SLOTS];   // CRC of each sector of the cylinder last written whole
+static uint32_t verify_us;           // time reading back and comparing
+static uint32_t verify_bytes;        // bytes read back from the card
+static int verify_mismatches;        // sectors that did not read back as written
+
+// sector slots an incremental write back has found changed, one bit each, written in file order cylinder by cylinder
+static uint8_t pending_slots[MAX_SECTOR_SLOTS / 8];
+static int extent_count;             // writes the sectors went to the card in
+static uint32_t extent_bytes;        // bytes in those writes
+
+// accesses by the 1130 to each cylinder, counted from the command interrupt and kept in name.hot next to
+// the image, so the next load brings in the busiest cylinders first
+#define HEAT_MAGIC "2315HEAT"
+static volatile uint32_t cylinder_heat[256];
+static volatile uint32_t session_accesses;   // accesses counted since the image was loaded
+static uint8_t load_order[256];              // cylinders in the order they are loaded
+static FIL heatfil;
+static uint32_t heatcounts[256];
+
+// image transfer engine on core1, core0 posts a command through the intercore FIFO and core1 posts back the result
+static Disk_State* volatile xfer_dstate;
+static volatile int xfer_progress_cylinder;  // cylinder core1 is working on, shown on the display by core0
+static volatile bool xfer_early_ready;       // a demand load has cylinder 0 in the SDRAM
+static bool xfer_busy;
+
+// the volume stays mounted from one load or unload to the next, so the card is not initialized again and the
+// FAT and directory sectors FatFs holds stay valid. Any edge of the card detect switch drops the mount.
+static bool volume_mounted;
+static uint32_t volume_card_changes;  // card_change_count() when the volume was mounted
+static bool write_back_recovered;     // the first mount looked for an interrupted image replacement
 
 static void force_unmount()
 {
+    volume_mounted = false;
     f_unmount("0:");
 
     // Force SD card reinitialization.
@@ -42,15 +204,241 @@ static void force_unmount()
     pSD->m_Status |= STA_NOINIT;
 }
 
+// mount the volume unless it is still mounted and the card has not been removed or swapped since
+// fresh is set when the card was mounted again, the image has to be looked up on it again
+static FRESULT mount_volume(bool *fresh)
+{
+    FRESULT fr;
+
+    *fresh = false;
+    if (volume_mounted && (volume_card_changes == card_change_count()))
+        return(FR_OK);
+    if (volume_mounted)
+        force_unmount();
+
+    volume_card_changes = card_change_count();
+    if ((fr = f_mount(&fs, "0:", 1)) != FR_OK)
+        return(fr);
+    volume_mounted = true;
+    *fresh = true;
+    return(FR_OK);
+}
+
+// the last file is closed, the volume stays mounted for the next load or unload of the same card
+static int unmount_volume()
+{
+    if (volume_mounted && (volume_card_changes != card_change_count()))
+        force_unmount();
+    return(FILE_OPS_OKAY);
+}
+
+// name of a sibling of an image file, the same name with the .dsk extension replaced
+static void sibling_file_name(char *name, const char *filename, const char *extension)
+{
+    char *dot;
+
+    strncpy(name, filename, FF_LFN_BUF);
+    name[FF_LFN_BUF] = '\0';
+    dot = strrchr(name, '.');
+    if ((dot != NULL) && (strlen(dot) == strlen(extension)))
+        strcpy(dot, extension);
+}
+
+// finish or roll back a replacement of an image file that was interrupted by a power loss or reset
+// name.old without name.dsk means the swap stopped between the two renames, and name.new is then the
+// verified rewrite. A name.new without name.old never got verified, so the image it was for is untouched.
+static void recover_interrupted_write_back()
+{
+    DIR dir;
+    FILINFO fno;
+    FILINFO info;
+    FRESULT fr;
+    char oldname[FF_LFN_BUF + 1];
+    char dskname[FF_LFN_BUF + 1];
+    char newname[FF_LFN_BUF + 1];
+
+    // the directory is searched again after every change rather than changed while it is being read
+    for (int limit = 0; limit < 16; limit++) {
+        fr = f_findfirst(&dir, &fno, "", "?*.old");
+        f_closedir(&dir);
+        if ((fr != FR_OK) || (fno.fname[0] == '\0'))
+            break;
+        strcpy(oldname, fno.fname);
+        sibling_file_name(dskname, oldname, ".dsk");
+        sibling_file_name(newname, oldname, ".new");
+        if (f_stat(dskname, &info) == FR_OK) {
+            printf("Removing '%s' left by an interrupted unload\r\n", oldname);
+            fr = f_unlink(oldname);
+        }
+        else if (f_stat(newname, &info) == FR_OK) {
+            printf("Finishing the interrupted replacement of '%s'\r\n", dskname);
+            fr = f_rename(newname, dskname);
+            if (fr == FR_OK)
+                fr = f_unlink(oldname);
+        }
+        else {
+            printf("Restoring '%s' from '%s'\r\n", dskname, oldname);
+            fr = f_rename(oldname, dskname);
+        }
+        if (fr != FR_OK) {
+            printf("*** ERROR, could not recover '%s' (%d)\r\n", dskname, fr);
+            break;
+        }
+    }
+
+    for (int limit = 0; limit < 16; limit++) {
+        fr = f_findfirst(&dir, &fno, "", "?*.new");
+        f_closedir(&dir);
+        if ((fr != FR_OK) || (fno.fname[0] == '\0'))
+            break;
+        printf("Discarding the unfinished rewrite '%s'\r\n", fno.fname);
+        if ((fr = f_unlink(fno.fname)) != FR_OK) {
+            printf("*** ERROR, could not remove '%s' (%d)\r\n", fno.fname, fr);
+            break;
+        }
+    }
+}
+
+// *************** contiguous image fast path ***************
+// A file that occupies one unbroken run of clusters is a fixed range of blocks on the card. The cylinders of a
+// version 2.0 image in such a file are then moved with disk_read()/disk_write() on those blocks directly, without
+// FatFs following the cluster chain or copying through its sector buffer. f_expand() makes every rewrite of an
+// image contiguous, defragment_disk_image() converts an image that is not.
+//
+// follow the cluster chain of the open file a cluster at a time and see that every cluster follows the last
+static bool find_file_extent(FIL *fp, LBA_t *firstlba)
+{
+    FSIZE_t position = f_tell(fp);
+    FSIZE_t remaining = f_size(fp);
+    FSIZE_t clusterbytes = (FSIZE_t) fp->obj.fs->csize * FF_MAX_SS;
+    FSIZE_t step;
+    DWORD cluster = fp->obj.sclust - 1;
+
+    if ((remaining == 0) || (fp->obj.sclust < 2) || (f_lseek(fp, 0) != FR_OK))
+        return(false);
+    while (remaining > 0) {
+        step = (remaining >= clusterbytes) ? clusterbytes : remaining;
+        if ((f_lseek(fp, f_tell(fp) + step) != FR_OK) || (fp->clust != cluster + 1))
+            break;
+        cluster = fp->clust;
+        remaining -= step;
+    }
+    *firstlba = fp->obj.fs->database + (LBA_t) (fp->obj.sclust - 2) * fp->obj.fs->csize;
+    f_lseek(fp, position);
+    return(remaining == 0);
+}
+
+static void find_image_extent(FIL *fp)
+{
+    image_contiguous = false;
+    if ((f_size(fp) == 0) || (fp->obj.sclust < 2))
+        return;
+    image_contiguous = find_file_extent(fp, &image_first_lba);
+    printf("Image file is %s on the card\r\n", image_contiguous ? "contiguous" : "fragmented");
+}
+
+// build the fast seek table for the image file just opened, without one seeks follow the cluster chain as before
+static void build_image_link_map()
+{
+#if FF_USE_FASTSEEK
+    FRESULT fr;
+
+    fil.cltbl = image_link_map;
+    image_link_map[0] = IMAGE_LINK_MAP_SIZE;
+    if ((fr = f_lseek(&fil, CREATE_LINKMAP)) != FR_OK) {
+        printf("Image file is in too many fragments for fast seek (%d), %d table entries needed\r\n",
+               fr, (int) image_link_map[0]);
+        fil.cltbl = NULL;
+    }
+#endif
+}
+
+// the cylinders of the open image are whole blocks at a fixed place on the card
+static bool direct_image_io()
+{
+    return(image_contiguous && image_aligned);
+}
+
+// first card block of a cylinder of a contiguous version 2.0 image
+static LBA_t cylinder_lba(int cylindercount)
+{
+    return(image_first_lba + (LBA_t) ((image_data_offset + (FSIZE_t) cylindercount * cylinder_stride) / FF_MAX_SS));
+}
+
+// card block holding a byte of the open image file, found when the file is contiguous or has a fast seek table
+static bool image_block_lba(FSIZE_t offset, LBA_t *lba)
+{
+    DWORD cluster = (DWORD) (offset / ((FSIZE_t) fs.csize * FF_MAX_SS));
+
+    if (image_contiguous) {
+        *lba = image_first_lba + (LBA_t) (offset / FF_MAX_SS);
+        return(true);
+    }
+#if FF_USE_FASTSEEK
+    // the table is its size and then the length and first cluster of each fragment, ending in a 0 length
+    if (fil.cltbl != NULL) {
+        for (DWORD *fragment = fil.cltbl + 1; fragment[0] != 0; fragment += 2) {
+            if (cluster < fragment[0]) {
+                *lba = fs.database + (LBA_t) (fragment[1] + cluster - 2) * fs.csize + (LBA_t) ((offset / FF_MAX_SS) % fs.csize);
+                return(true);
+            }
+            cluster -= fragment[0];
+        }
+    }
+#endif
+    return(false);
+}
+
+// read whole blocks of the open image file back from the card after FatFs has written out what it still holds of
+// them, straight from their card blocks. Where the blocks cannot be found f_read() takes them, it reads whole blocks
+// that are not dirty from the card as well.
+static FRESULT read_back_image_blocks(FSIZE_t offset, uint8_t *buf, UINT len)
+{
+    FRESULT fr;
+    UINT nr = 0;
+    UINT blocks;
+    LBA_t lba;
+
+    if ((fr = f_sync(&fil)) != FR_OK)
+        return(fr);
+    while ((len >= FF_MAX_SS) && image_block_lba(offset, &lba)) {
+        // the blocks to the end of the cluster follow each other on the card
+        blocks = fs.csize - (UINT) ((offset / FF_MAX_SS) % fs.csize);
+        if (blocks > len / FF_MAX_SS)
+            blocks = len / FF_MAX_SS;
+        if (disk_read(fs.pdrv, buf, lba, blocks) != RES_OK)
+            return(FR_DISK_ERR);
+        offset += (FSIZE_t) blocks * FF_MAX_SS;
+        buf += blocks * FF_MAX_SS;
+        len -= blocks * FF_MAX_SS;
+    }
+    if (len == 0)
+        return(FR_OK);
+    fr = f_lseek(&fil, offset);
+    if (fr == FR_OK)
+        fr = f_read(&fil, buf, len, &nr);
+    if ((fr == FR_OK) && (nr != len))
+        fr = FR_INT_ERR;
+    return(fr);
+}
+
 int file_init_and_mount()
 {
     FRESULT fr;
+    bool fresh;
     if (!sd_init_driver()){
         //error_code = 2;
         printf("*** ERROR, could not initialize microSD card\r\n");
         display_error((char *) "cannot init", (char *) "microSD card");
         return(100);
     }
+
+    // an unload cut short by a power loss or reset is finished or undone once at startup, before a load
+    // could find name.old or name.new instead of the image
+    if (!write_back_recovered && (mount_volume(&fresh) == FR_OK)) {
+        recover_interrupted_write_back();
+        write_back_recovered = true;
+    }
     return(FILE_OPS_OKAY);
 }
 
@@ -59,13 +447,24 @@ int file_open_read_disk_image()
     DIR dir;
     FILINFO fno;
     FRESULT fr;
+    bool fresh;
     printf("file_open_read_disk_image\r\n");
-    if ((fr = f_mount(&fs, "0:", 1)) != FR_OK){
+    if ((fr = mount_volume(&fresh)) != FR_OK){
         printf("*** ERROR, could not mount filesystem before open for read (%d)\r\n", fr);
         display_error((char *) "cannot mount", (char *) "filesystem");
+        force_unmount();
         return(fr);
     }
 
+    // the same card is still mounted, the image found last time is opened without searching the directory
+    if (!fresh && (diskimagefilename[0] != '\0') && (f_open(&fil, diskimagefilename, FA_READ) == FR_OK)) {
+        find_image_extent(&fil);
+        build_image_link_map();
+        return(FILE_OPS_OKAY);
+    }
+
+    recover_interrupted_write_back();
+
     // Find first disk image file name
     fr = f_findfirst(&dir, &fno, "", "?*.dsk");
     f_closedir(&dir);
@@ -87,63 +486,377 @@ int file_open_read_disk_image()
         force_unmount();
         return(fr);
     }
+    find_image_extent(&fil);
+    build_image_link_map();
     return(FILE_OPS_OKAY);
 }
 
+// open the overlay to add a write back at its end, it is made with its header at the first write back of the image
+// anything after the last whole entry was cut short and is dropped
+static FRESULT open_overlay_for_append()
+{
+    FRESULT fr;
+    UINT nw;
+    uint8_t header[OVERLAY_HEADER_SIZE];
+    char deltafilename[FF_LFN_BUF + 1];
+
+    sibling_file_name(deltafilename, diskimagefilename, ".dlt");
+    if ((fr = f_open(&fil, deltafilename, FA_READ | FA_WRITE | FA_OPEN_ALWAYS)) != FR_OK)
+        return(fr);
+    writing_overlay = true;
+    if (delta_end == 0) {
+        memset(header, 0, sizeof(header));
+        memcpy(header, OVERLAY_MAGIC, 8);
+        header[8]  = (header_crc >> 24) & 0xFF;
+        header[9]  = (header_crc >> 16) & 0xFF;
+        header[10] = (header_crc >>  8) & 0xFF;
+        header[11] = (header_crc >>  0) & 0xFF;
+        fr = f_write(&fil, header, sizeof(header), &nw);
+        if ((fr == FR_OK) && (nw != sizeof(header)))
+            fr = FR_DENIED;
+        if (fr == FR_OK)
+            delta_end = OVERLAY_HEADER_SIZE;
+    }
+    if (fr == FR_OK)
+        fr = f_lseek(&fil, delta_end);
+    if (fr == FR_OK)
+        fr = f_truncate(&fil);
+    return(fr);
+}
+
 int file_open_write_disk_image()
 {
     FRESULT fr;
+    bool fresh;
     printf("file_open_write_disk_image\r\n");
-    if ((fr = f_mount(&fs, "0:", 1)) != FR_OK){
+    if ((fr = mount_volume(&fresh)) != FR_OK){
         printf("*** ERROR, could not mount filesystem before open for write (%d)\r\n", fr);
         display_error((char *) "cannot mount", (char *) "filesystem");
+        force_unmount();
         return(fr);
     }
 
-    if((fr = f_open(&fil, diskimagefilename, FA_WRITE | FA_CREATE_ALWAYS))!= FR_OK){
-        printf("*** ERROR, could not open disk image file for write (%d)\r\n", fr);
+    // the sectors of an incremental write back are not whole blocks and go through FatFs
+    image_contiguous = false;
+
+    // the image is not opened at all when the changed sectors go to its overlay
+    if (overlay_write_back) {
+        if ((fr = open_overlay_for_append()) != FR_OK) {
+            printf("*** ERROR, could not open the overlay of '%s' for write (%d)\r\n", diskimagefilename, fr);
+            display_error((char *) "cannot open", (char *) "overlay");
+            f_close(&fil);
+            writing_overlay = false;
+            force_unmount();
+            return(fr);
+        }
+        return(FILE_OPS_OKAY);
+    }
+
+    // the header is unchanged and the file is already the right size when only the dirty sectors are written
+    if (incremental_write_back) {
+        if((fr = f_open(&fil, diskimagefilename, FA_READ | FA_WRITE | FA_OPEN_EXISTING))!= FR_OK){
+            printf("*** ERROR, could not open disk image file for write (%d)\r\n", fr);
+            display_error((char *) "cannot open", (char *) "disk image");
+            force_unmount();
+            return(fr);
+        }
+        build_image_link_map();
+        return(FILE_OPS_OKAY);
+    }
+
+    // a full rewrite leaves the image alone until the new copy is complete
+    sibling_file_name(newfilename, diskimagefilename, ".new");
+    if((fr = f_open(&fil, newfilename, FA_READ | FA_WRITE | FA_CREATE_ALWAYS))!= FR_OK){
+        printf("*** ERROR, could not open file '%s' for write (%d)\r\n", newfilename, fr);
         display_error((char *) "cannot open", (char *) "disk image");
         force_unmount();
         return(fr);
     }
+    writing_sibling = true;
+
+#if FF_USE_EXPAND
+    // one contiguous allocation up front keeps the write sequential, without it the file grows as it is written
+    if ((image_file_size != 0) && ((fr = f_expand(&fil, image_file_size, 1)) != FR_OK))
+        printf("Could not preallocate '%s' (%d), writing it anyway\r\n", newfilename, fr);
+    else if (image_file_size != 0)
+        find_image_extent(&fil);
+#endif
     return(FILE_OPS_OKAY);
 }
 
+// write the zero sector map block of the open version 2.1 image
+static FRESULT write_zero_sector_map()
+{
+    FRESULT fr;
+    UINT nw;
+
+    fr = f_lseek(&fil, ZERO_MAP_OFFSET);
+    if (fr == FR_OK)
+        fr = f_write(&fil, zero_sector_map, sizeof(zero_sector_map), &nw);
+    if ((fr == FR_OK) && (nw != sizeof(zero_sector_map)))
+        fr = FR_DENIED;
+    if (fr == FR_OK)
+        zero_map_dirty = false;
+    return(fr);
+}
+
+// write the image check into the header of the open image, or clear it if it is no longer known
+static FRESULT write_header_crc()
+{
+    FRESULT fr;
+    UINT nw;
+    uint8_t field[8];
+
+    image_crc_dirty = false;
+    if (!image_aligned && !image_compressed)
+        return(FR_OK);
+    header_crc_cleared = !image_crc_known;
+    memset(field, 0, sizeof(field));
+    if (image_crc_known) {
+        memcpy(field, "CRC", 4);
+        field[4] = (image_crc >> 24) & 0xFF;
+        field[5] = (image_crc >> 16) & 0xFF;
+        field[6] = (image_crc >>  8) & 0xFF;
+        field[7] = (image_crc >>  0) & 0xFF;
+    }
+    fr = f_lseek(&fil, HEADER_CRC_OFFSET);
+    if (fr == FR_OK)
+        fr = f_write(&fil, field, sizeof(field), &nw);
+    if ((fr == FR_OK) && (nw != sizeof(field)))
+        fr = FR_DENIED;
+    // the power fail journal belongs to the image by the image check in its header
+    if ((fr == FR_OK) && !writing_sibling) {
+        journal_bound = image_crc_known;
+        journal_crc = image_crc;
+    }
+    return(fr);
+}
+
 int file_close_disk_image()
 {
     // Close file
     FRESULT fr;
+
+    // the image itself was not open for a write back to its overlay
+    if (writing_overlay) {
+        writing_overlay = false;
+        image_crc_dirty = false;
+        zero_map_dirty = false;
+    }
+
+    // sectors written in place changed the image check
+    if (image_crc_dirty && !writing_sibling && (write_header_crc() != FR_OK))
+        printf("###ERROR, could not update the image check of '%s'\r\n", diskimagefilename);
+    image_crc_dirty = false;
+
+    // sectors an in place write back found to be zero are added to the map
+    if (zero_map_dirty && !writing_sibling && (write_zero_sector_map() != FR_OK))
+        printf("###ERROR, could not update the zero sector map of '%s'\r\n", diskimagefilename);
+    zero_map_dirty = false;
     fr = f_close(&fil);
+
+    // a rewrite that is closed without being committed failed part way, the image it was for is untouched
+    if (writing_sibling) {
+        writing_sibling = false;
+        sibling_file_name(newfilename, diskimagefilename, ".new");
+        printf("Discarding '%s', '%s' is unchanged\r\n", newfilename, diskimagefilename);
+        f_unlink(newfilename);
+    }
+
     if (fr != FR_OK) {
         printf("ERROR: Could not close file (%d)\r\n", fr);
         return(fr);
     }
-    //unmount the drive
-    if ((fr = f_unmount("0:")) != FR_OK){
-        printf("*** ERROR, could not unmount filesystem (%d)\r\n", fr);
-        display_error((char *) "can't unmount", (char *) "filesystem");
+    return(unmount_volume());
+}
+
+// *************** image opened ahead of LOAD ***************
+// mount the card, find and open the image and read its header while the drive is idle
+int preopen_disk_image(struct Disk_State* dstate)
+{
+    int result;
+
+    if (image_preopened)
+        return(FILE_OPS_OKAY);
+    printf("microSD card inserted, opening the disk image ahead of LOAD\r\n");
+    if ((result = file_init_and_mount()) != FILE_OPS_OKAY)
+        return(result);
+    if ((result = file_open_read_disk_image()) != FILE_OPS_OKAY)
+        return(result);
+    if ((result = read_image_file_header(dstate)) != 0) {
+        printf("*** ERROR, image header not valid (%d), it is read again at LOAD\r\n", result);
+        file_close_disk_image();
+        return(result);
+    }
+    image_preopened = true;
+    return(FILE_OPS_OKAY);
+}
+
+// let go of the open image when the card is removed, without trying to flush to a card that is gone
+void release_preopened_image()
+{
+    if (!image_preopened)
+        return;
+    image_preopened = false;
+    f_close(&fil);
+    force_unmount();
+}
+
+// LOAD takes over the open image and the header already read, returns false if there is none
+bool take_preopened_image()
+{
+    bool preopened = image_preopened;
+
+    image_preopened = false;
+    return(preopened);
+}
+
+// close the image file after the write back, a full rewrite replaces the image only if it closed cleanly
+// and is the size that was loaded. Otherwise it is discarded and the image is left as it was.
+// name.dsk -> name.old, name.new -> name.dsk, then drop name.old; recover_interrupted_write_back()
+// completes this at the next load if it is cut short
+static FRESULT replace_with_sibling(const char *siblingname)
+{
+    FRESULT fr;
+    char oldfilename[FF_LFN_BUF + 1];
+
+    sibling_file_name(oldfilename, diskimagefilename, ".old");
+    f_unlink(oldfilename);
+    fr = f_rename(diskimagefilename, oldfilename);
+    if (fr == FR_OK)
+        fr = f_rename(siblingname, diskimagefilename);
+    if (fr == FR_OK)
+        fr = f_unlink(oldfilename);
+    return(fr);
+}
+
+static FRESULT check_rewritten_image(struct Disk_State* dstate, const char *name);
+
+int file_commit_disk_image(struct Disk_State* dstate)
+{
+    FRESULT fr;
+    FILINFO fno;
+    FSIZE_t written;
+
+    if (!writing_sibling)
+        return(file_close_disk_image());
+
+    writing_sibling = false;
+    written = f_tell(&fil);
+    sibling_file_name(newfilename, diskimagefilename, ".new");
+
+    fr = f_close(&fil);
+    if (fr == FR_OK)
+        fr = f_stat(newfilename, &fno);
+    if ((fr == FR_OK) && ((written != image_file_size) || (fno.fsize != image_file_size))) {
+        printf("*** ERROR, '%s' is %d bytes, expected %d\r\n", newfilename, (int) fno.fsize, (int) image_file_size);
+        fr = FR_INT_ERR;
+    }
+    if (fr == FR_OK)
+        fr = check_rewritten_image(dstate, newfilename);
+    if (fr != FR_OK) {
+        printf("*** ERROR, could not verify '%s' (%d), '%s' is unchanged\r\n", newfilename, fr, diskimagefilename);
+        f_unlink(newfilename);
+        unmount_volume();
         return(fr);
     }
 
-    // Force SD card reinitialization in case it has been swapped or removed and the volume is remounted.
-    sd_card_t *pSD = sd_get_by_num(0);
-    pSD->m_Status |= STA_NOINIT;
+    if ((fr = replace_with_sibling(newfilename)) != FR_OK) {
+        printf("*** ERROR, could not replace '%s' with '%s' (%d)\r\n", diskimagefilename, newfilename, fr);
+        unmount_volume();
+        return(fr);
+    }
+    printf("'%s' replaced by the rewritten image\r\n", diskimagefilename);
 
-    return(FILE_OPS_OKAY);
+    // the image holds the sectors of the overlay now, an overlay left behind has the image check of the old image
+    // and is removed at the next load
+    if (compact_overlay) {
+        compact_overlay = false;
+        sibling_file_name(newfilename, diskimagefilename, ".dlt");
+        if (f_unlink(newfilename) == FR_OK)
+            printf("Overlay '%s' folded into the image\r\n", newfilename);
+    }
+    return(unmount_volume());
 }
 
-bool deserialize_int(int *vp)
+// copy an image that is fragmented on the card into a new contiguous file and put it in place of the old one
+// run from the console while no cartridge is loaded, the copy is byte for byte so the version is unchanged
+int defragment_disk_image()
 {
     FRESULT fr;
+    FILINFO fno;
     UINT nr;
-    uint8_t buf[4];
+    UINT nw;
+    FSIZE_t imagesize;
+    int result;
+
+    release_preopened_image();
+    if ((result = file_init_and_mount()) != FILE_OPS_OKAY)
+        return(result);
+    if ((result = file_open_read_disk_image()) != FILE_OPS_OKAY)
+        return(result);
+    if (image_contiguous) {
+        printf("'%s' is already contiguous\r\n", diskimagefilename);
+        return(file_close_disk_image());
+    }
+
+#if FF_USE_EXPAND
+    imagesize = f_size(&fil);
+    sibling_file_name(newfilename, diskimagefilename, ".new");
+    printf("Copying '%s' into a contiguous file\r\n", diskimagefilename);
+    fr = f_open(&copyfil, newfilename, FA_WRITE | FA_CREATE_ALWAYS);
+    if (fr == FR_OK) {
+        if ((fr = f_expand(&copyfil, imagesize, 1)) != FR_OK)
+            printf("*** ERROR, no contiguous free space for %d bytes (%d)\r\n", (int) imagesize, fr);
+        while (fr == FR_OK) {
+            fr = f_read(&fil, cylinderdata[0], CYLINDER_BUFFER_SIZE, &nr);
+            if ((fr != FR_OK) || (nr == 0))
+                break;
+            fr = f_write(&copyfil, cylinderdata[0], nr, &nw);
+            if ((fr == FR_OK) && (nw != nr))
+                fr = FR_DENIED;
+        }
+        if (fr == FR_OK)
+            fr = f_close(&copyfil);
+        else
+            f_close(&copyfil);
+    }
+    f_close(&fil);
+    if (fr == FR_OK)
+        fr = f_stat(newfilename, &fno);
+    if ((fr == FR_OK) && (fno.fsize != imagesize))
+        fr = FR_INT_ERR;
+    if (fr == FR_OK)
+        fr = replace_with_sibling(newfilename);
+    if (fr != FR_OK) {
+        printf("*** ERROR, could not make '%s' contiguous (%d), it is unchanged\r\n", diskimagefilename, fr);
+        f_unlink(newfilename);
+        unmount_volume();
+        return(fr);
+    }
+    printf("'%s' is now contiguous\r\n", diskimagefilename);
+    return(unmount_volume());
+#else
+    printf("*** ERROR, this build has no f_expand(), '%s' stays fragmented\r\n", diskimagefilename);
+    return(file_close_disk_image());
+#endif
+}
+
+// the header is moved in one block, the fields are taken from and put into this buffer
+static uint8_t headerdata[512];
+static UINT header_len;    // bytes of the header read from the file
+static UINT header_pos;    // next field in headerdata
+
+bool deserialize_int(int *vp)
+{
+    uint8_t *buf = &headerdata[header_pos];
     int value = 0;
 
-    fr = f_read(&fil, buf, 4, &nr);
-    if (fr != FR_OK || nr != 4) {
-        printf("###ERROR, Header data read error fr=%d, nr=%u\r\n", fr, nr);
+    if (header_pos + 4 > header_len) {
+        printf("###ERROR, Header data read error, %u bytes\r\n", header_len);
         return(false);
     }
+    header_pos += 4;
 
     value  = buf[0] << 24;
     value |= buf[1] << 16;
@@ -157,121 +870,518 @@ bool deserialize_int(int *vp)
 
 bool serialize_int(int value)
 {
-    FRESULT fr;
-    UINT nw;
-    uint8_t buf[4];
+    uint8_t *buf = &headerdata[header_pos];
+
+    if (header_pos + 4 > sizeof(headerdata)) {
+        printf("###ERROR, Header data write error, header full\r\n");
+        return(false);
+    }
+    header_pos += 4;
 
     buf[0] = (value >> 24) & 0xFF;
     buf[1] = (value >> 16) & 0xFF;
     buf[2] = (value >>  8) & 0xFF;
     buf[3] = (value >>  0) & 0xFF;
 
-    fr = f_write(&fil, buf, 4, &nw);
-    if (fr != FR_OK || nw != 4) {
-        printf("###ERROR, Header data write error fr=%d, nw=%u\r\n", fr, nw);
-        return(false);
-    }
-
     return(true);
 }
 
 bool deserialize_string(char *cp, int size)
 {
-    FRESULT fr;
-    UINT nr;
-    int value = 0;
-
-    fr = f_read(&fil, cp, size, &nr);
-    if (fr != FR_OK || nr != size) {
-        printf("###ERROR, Header data read error fr=%d, nr=%u\r\n", fr, nr);
+    if (header_pos + size > header_len) {
+        printf("###ERROR, Header data read error, %u bytes\r\n", header_len);
         return(false);
     }
+    memcpy(cp, &headerdata[header_pos], size);
+    header_pos += size;
 
     return(true);
 }
 
-#define MAX_SBUF 256
 bool serialize_string(char *cp, int size)
 {
-    FRESULT fr;
-    UINT nw;
-    static char buf[MAX_SBUF];
-
-    if (size > MAX_SBUF) {
-        printf("###ERROR, Header string too long: %d (MAX=%d)\r\n", size, MAX_SBUF);
+    if (header_pos + size > sizeof(headerdata)) {
+        printf("###ERROR, Header string too long: %d\r\n", size);
         return(false);
     }
 
     // pad string with zeroes and enforce zero terminator.
-    strncpy(buf, cp, size - 1);
-    buf[size - 1] = '\0';
-
-    fr = f_write(&fil, buf, size, &nw);
-    if (fr != FR_OK || nw != size) {
-        printf("###ERROR, Header data write error fr=%d, nw=%u\r\n", fr, nw);
-        return(false);
-    }
+    strncpy((char *) &headerdata[header_pos], cp, size - 1);
+    headerdata[header_pos + size - 1] = '\0';
+    header_pos += size;
 
     return(true);
 }
 
 static char magicNumber[10] = "\x89" "2315\r\n\x1A"; 
-static char versionNumber[4] = "1.3";
+static char versionNumber[4] = "2.1";
+static char alignedVersionNumber[4] = "2.0";
+static char packedVersionNumber[4] = "1.3";
+static char compressedVersionNumber[4] = "3.0";
 
-int read_image_file_header(struct Disk_State* dstate)
+// Version 1.3 images pack the 365 byte header and the 642 byte sectors end to end, so nearly every sector
+// straddles two 512 byte blocks of the card. Version 2.0 pads the header to one block and every cylinder to a
+// whole number of blocks, so a cylinder starts on a block boundary and FatFs can move all but its last block
+// straight between the card and the buffer. Version 2.1 adds the zero sector map in the block after the header.
+// Version 3.0 follows the header block with a table of track offsets, padded to whole blocks, and the packed
+// tracks. All four are read. A full rewrite makes version 3.0 of a compressed image and version 2.1 of the rest.
+#define IMAGE_BLOCK_SIZE 512
+#define PACKED_HEADER_SIZE 365
+#define IMAGE_PACKED 13
+#define IMAGE_ALIGNED 20
+#define IMAGE_ZERO_MAP 21
+#define IMAGE_COMPRESSED 30
+
+// bytes of sector data in one cylinder
+static UINT cylinder_bytes(struct Disk_State* dstate)
 {
-    bool rc;
-    static char tmp[10];
+    return((UINT) (dstate->numberOfHeads * (dstate->numberOfSectorsPerTrack/2) * 642));
+}
 
-    printf("Reading header from file '%s'\r\n", diskimagefilename);
+// bytes of the track offset table of a version 3.0 image, one offset per track and one for the end of the file
+static UINT track_table_bytes(struct Disk_State* dstate)
+{
+    return((UINT) (((dstate->numberOfCylinders * dstate->numberOfHeads + 1) * 4 + IMAGE_BLOCK_SIZE - 1)
+                   & ~(IMAGE_BLOCK_SIZE - 1)));
+}
 
-    if (!deserialize_string(tmp, sizeof(magicNumber)) || strncmp(tmp, magicNumber, sizeof(magicNumber)) != 0) {
-        // invalid magic
-        return 2;
-    }
+static void set_image_layout(struct Disk_State* dstate, int version)
+{
+    FSIZE_t cylinderbytes = cylinder_bytes(dstate);
 
-    if (!deserialize_string(tmp, sizeof(versionNumber)) || strncmp(tmp, versionNumber, sizeof(versionNumber)) != 0) {
-        // unexpected version
-        return 3;
+    image_aligned = (version == IMAGE_ALIGNED) || (version == IMAGE_ZERO_MAP);
+    image_zero_map = (version == IMAGE_ZERO_MAP);
+    image_compressed = (version == IMAGE_COMPRESSED);
+    if (image_compressed) {
+        image_data_offset = IMAGE_BLOCK_SIZE + track_table_bytes(dstate);
+        cylinder_stride = cylinderbytes;
+    }
+    else if (image_aligned) {
+        image_data_offset = image_zero_map ? ZERO_MAP_OFFSET + IMAGE_BLOCK_SIZE : IMAGE_BLOCK_SIZE;
+        cylinder_stride = (cylinderbytes + IMAGE_BLOCK_SIZE - 1) & ~(FSIZE_t) (IMAGE_BLOCK_SIZE - 1);
+    }
+    else {
+        image_data_offset = PACKED_HEADER_SIZE;
+        cylinder_stride = cylinderbytes;
     }
+}
 
+// file offset of a sector in the layout of the image that is open
+static FSIZE_t sector_file_offset(struct Disk_State* dstate, int cylinder, int head, int sector)
+{
+    return(image_data_offset + (FSIZE_t) cylinder * cylinder_stride
+           + (FSIZE_t) (head * (dstate->numberOfSectorsPerTrack/2) + sector) * 642);
+}
 
-    rc =       deserialize_string(dstate->imageName, sizeof(dstate->imageName));
-    rc = rc && deserialize_string(dstate->imageDescription, sizeof(dstate->imageDescription));
-    rc = rc && deserialize_string(dstate->imageDate, sizeof(dstate->imageDate));
-    rc = rc && deserialize_string(dstate->controller, sizeof(dstate->controller));
-    rc = rc && deserialize_int(&dstate->bitRate);                 
-    rc = rc && deserialize_int(&dstate->numberOfCylinders);       
-    rc = rc && deserialize_int(&dstate->numberOfSectorsPerTrack); 
-    rc = rc && deserialize_int(&dstate->numberOfHeads);           
-    rc = rc && deserialize_int(&dstate->microsecondsPerSector);
+static char *image_version_name()
+{
+    if (image_compressed)
+        return(compressedVersionNumber);
+    return(image_zero_map ? versionNumber : (image_aligned ? alignedVersionNumber : packedVersionNumber));
+}
 
-    if (rc) {
-        printf("controller = %s\r\n", dstate->controller);
-        printf("bitRate = %d\r\n", dstate->bitRate);
-        printf("numberOfCylinders = %d\r\n", dstate->numberOfCylinders);
-        printf("numberOfSectorsPerTrack = %d\r\n", dstate->numberOfSectorsPerTrack);
-        printf("numberOfHeads = %d\r\n", dstate->numberOfHeads);
-        printf("microsecondsPerSector = %d\r\n", dstate->microsecondsPerSector);
+// bit of a sector in its cylinder byte of the zero sector map
+static uint8_t zero_map_bit(struct Disk_State* dstate, int head, int sector)
+{
+    return((uint8_t) (1 << (head * (dstate->numberOfSectorsPerTrack/2) + sector)));
+}
 
-        // write the data read from the JSON  header into the FPGA registers
-        update_fpga_disk_state(dstate);
-        return 0;
-    }
+// the bits of every sector of a cylinder
+static uint8_t zero_map_cylinder_mask(struct Disk_State* dstate)
+{
+    return((uint8_t) ((1 << (dstate->numberOfHeads * (dstate->numberOfSectorsPerTrack/2))) - 1));
+}
 
-    return 1;
+// the sectors of a cylinder of the open image known to be zero
+static uint8_t cylinder_zero_bits(int cylinder)
+{
+    if (!image_zero_map || (cylinder >= (int) sizeof(zero_sector_map)))
+        return(0);
+    return(zero_sector_map[cylinder]);
 }
 
-int write_image_file_header(struct Disk_State* dstate)
+static bool sector_is_zero(const uint8_t *buf)
 {
-    bool rc;
+    for (int i = 0; i < 642; i++){
+        if (buf[i] != 0)
+            return(false);
+    }
+    return(true);
+}
 
-    printf("Writing header to file '%s'\r\n", diskimagefilename);
+// *************** compressed images ***************
+// A packed track is a series of runs, each starting with a control byte:
+//   0x00-0x7F  the next 1 to 128 bytes are copied
+//   0x80-0xFF  3 to 130 bytes are repeated from 1 to 65535 bytes back in the track, the distance is in the next
+//              two bytes high first. The copy may overlap the bytes it makes, so a distance of 1 or 2 repeats a
+//              byte or a word, which is what the zero sectors, blank cards and DMS working storage are made of.
+// Unpacking is a byte copy loop, cheap enough to keep up with the card. A track never grows by more than one
+// byte in 128, so the packed tracks of a cylinder still fit a cylinder buffer.
+#define PACK_MIN_MATCH 3
+#define PACK_MAX_MATCH 130
+#define PACK_MAX_LITERAL 128
 
-    rc =       serialize_string(magicNumber, sizeof(magicNumber));
-    rc = rc && serialize_string(versionNumber, sizeof(versionNumber));
-    rc = rc && serialize_string(dstate->imageName, sizeof(dstate->imageName));
-    rc = rc && serialize_string(dstate->imageDescription, sizeof(dstate->imageDescription));
+static uint32_t get_offset(const uint8_t *buf)
+{
+    return(((uint32_t) buf[0] << 24) | ((uint32_t) buf[1] << 16) | ((uint32_t) buf[2] << 8) | buf[3]);
+}
+
+static void put_offset(uint8_t *buf, uint32_t value)
+{
+    buf[0] = (value >> 24) & 0xFF;
+    buf[1] = (value >> 16) & 0xFF;
+    buf[2] = (value >>  8) & 0xFF;
+    buf[3] = (value >>  0) & 0xFF;
+}
+
+static int match_length(const uint8_t *src, int pos, int len, int distance)
+{
+    int n = 0;
+
+    while ((pos + n < len) && (n < PACK_MAX_MATCH) && (src[pos + n] == src[pos + n - distance]))
+        n++;
+    return(n);
+}
+
+static int put_literals(const uint8_t *src, int start, int end, uint8_t *dst, int out)
+{
+    if (end > start) {
+        dst[out++] = (uint8_t) (end - start - 1);
+        memcpy(&dst[out], &src[start], end - start);
+        out += end - start;
+    }
+    return(out);
+}
+
+// pack len bytes of a track into dst, returns the packed length
+// greedy, at each byte the longest of a repeat of the last byte, of the last word or of the last place
+// the same three bytes were seen is taken if it is longer than 3 bytes
+static int pack_track(const uint8_t *src, int len, uint8_t *dst)
+{
+    int pos = 0;
+    int literal = 0;
+    int out = 0;
+    int best;
+    int bestdistance;
+    int candidate;
+    int n;
+    int hash;
+
+    memset(pack_hash, 0, sizeof(pack_hash));
+    while (pos < len) {
+        best = 0;
+        bestdistance = 0;
+        for (int distance = 1; (distance <= 2) && (distance <= pos); distance++) {
+            if ((n = match_length(src, pos, len, distance)) > best) {
+                best = n;
+                bestdistance = distance;
+            }
+        }
+        if (pos + 2 < len) {
+            hash = ((src[pos] * 33 + src[pos + 1]) * 33 + src[pos + 2]) & (PACK_HASH_SIZE - 1);
+            candidate = pack_hash[hash] - 1;
+            pack_hash[hash] = (uint16_t) (pos + 1);
+            if ((candidate >= 0) && ((n = match_length(src, pos, len, pos - candidate)) > best)) {
+                best = n;
+                bestdistance = pos - candidate;
+            }
+        }
+
+        // a 3 byte repeat saves nothing once it splits a run of copied bytes
+        if (best > PACK_MIN_MATCH) {
+            out = put_literals(src, literal, pos, dst, out);
+            dst[out++] = (uint8_t) (0x80 | (best - PACK_MIN_MATCH));
+            dst[out++] = (uint8_t) (bestdistance >> 8);
+            dst[out++] = (uint8_t) (bestdistance & 0xFF);
+            pos += best;
+            literal = pos;
+        }
+        else if (++pos - literal == PACK_MAX_LITERAL) {
+            out = put_literals(src, literal, pos, dst, out);
+            literal = pos;
+        }
+    }
+    return(put_literals(src, literal, pos, dst, out));
+}
+
+// unpack a track of exactly len bytes, returns false if the packed data is damaged
+static bool unpack_track(const uint8_t *src, int srclen, uint8_t *dst, int len)
+{
+    int pos = 0;
+    int out = 0;
+    int n;
+    int distance;
+
+    while (pos < srclen) {
+        if (src[pos] < 0x80) {
+            n = src[pos++] + 1;
+            if ((pos + n > srclen) || (out + n > len))
+                return(false);
+            memcpy(&dst[out], &src[pos], n);
+            pos += n;
+            out += n;
+        }
+        else {
+            n = (src[pos++] & 0x7F) + PACK_MIN_MATCH;
+            if (pos + 2 > srclen)
+                return(false);
+            distance = (src[pos] << 8) | src[pos + 1];
+            pos += 2;
+            if ((distance == 0) || (distance > out) || (out + n > len))
+                return(false);
+            for (; n > 0; n--, out++)
+                dst[out] = dst[out - distance];
+        }
+    }
+    return(out == len);
+}
+
+// read the track offsets of a version 3.0 image, from the file position just past the header block
+static bool read_track_table(struct Disk_State* dstate)
+{
+    FRESULT fr;
+    UINT nr;
+    int heads = dstate->numberOfHeads;
+    int tracks = dstate->numberOfCylinders * heads;
+    UINT tablebytes = (UINT) (tracks + 1) * 4;
+
+    fr = f_read(&fil, packeddata, tablebytes, &nr);
+    if (fr != FR_OK || nr != tablebytes) {
+        printf("###ERROR, Track table read error fr=%d, nr=%u\r\n", fr, nr);
+        return(false);
+    }
+    for (int i = 0; i <= tracks; i++)
+        track_offsets[i] = get_offset(&packeddata[i * 4]);
+
+    // the tracks follow one another after the table and the tracks of a cylinder fit a cylinder buffer
+    if (track_offsets[0] < image_data_offset) {
+        printf("###ERROR, Track table is damaged\r\n");
+        return(false);
+    }
+    for (int i = 0; i < tracks; i++){
+        if ((track_offsets[i + 1] < track_offsets[i])
+            || (((i % heads) == 0) && (track_offsets[i + heads] - track_offsets[i] > CYLINDER_BUFFER_SIZE))) {
+            printf("###ERROR, Track table is damaged at track %d\r\n", i);
+            return(false);
+        }
+    }
+    printf("image is compressed to %d%%\r\n",
+           (int) ((uint64_t) (track_offsets[tracks] - track_offsets[0]) * 100
+                  / ((uint64_t) dstate->numberOfCylinders * cylinder_bytes(dstate))));
+    return(true);
+}
+
+// write the track offsets of the version 3.0 image just rewritten, the file position is its end
+static FRESULT write_track_table(struct Disk_State* dstate)
+{
+    FRESULT fr;
+    UINT nw;
+    int tracks = dstate->numberOfCylinders * dstate->numberOfHeads;
+    UINT tablebytes = (UINT) (tracks + 1) * 4;
+
+    image_file_size = f_tell(&fil);
+    track_offsets[tracks] = (uint32_t) image_file_size;
+    for (int i = 0; i <= tracks; i++)
+        put_offset(&packeddata[i * 4], track_offsets[i]);
+    fr = f_lseek(&fil, IMAGE_BLOCK_SIZE);
+    if (fr == FR_OK)
+        fr = f_write(&fil, packeddata, tablebytes, &nw);
+    if ((fr == FR_OK) && (nw != tablebytes))
+        fr = FR_DENIED;
+    return(fr);
+}
+
+// read the packed tracks of a cylinder with one f_read() and unpack them into the cylinder buffer
+static FRESULT read_packed_cylinder(struct Disk_State* dstate, int cylindercount, uint8_t *buf)
+{
+    FRESULT fr;
+    UINT nr;
+    int first = cylindercount * dstate->numberOfHeads;
+    int trackbytes = (dstate->numberOfSectorsPerTrack/2) * 642;
+    UINT packedbytes = track_offsets[first + dstate->numberOfHeads] - track_offsets[first];
+
+    if ((f_tell(&fil) != track_offsets[first]) && ((fr = f_lseek(&fil, track_offsets[first])) != FR_OK))
+        return(fr);
+    if ((fr = f_read(&fil, packeddata, packedbytes, &nr)) != FR_OK)
+        return(fr);
+    if (nr != packedbytes)
+        return(FR_INT_ERR);
+    for (int head = 0; head < dstate->numberOfHeads; head++){
+        if (!unpack_track(&packeddata[track_offsets[first + head] - track_offsets[first]],
+                          (int) (track_offsets[first + head + 1] - track_offsets[first + head]),
+                          &buf[head * trackbytes], trackbytes)) {
+            printf("###ERROR, Packed track %d/%d is damaged\r\n", cylindercount, head);
+            return(FR_INT_ERR);
+        }
+    }
+    return(FR_OK);
+}
+
+// read and unpack one packed track of a cylinder into its place in the cylinder buffer
+static FRESULT read_packed_track(struct Disk_State* dstate, int cylindercount, int head, uint8_t *buf)
+{
+    FRESULT fr;
+    UINT nr;
+    int track = cylindercount * dstate->numberOfHeads + head;
+    int trackbytes = (dstate->numberOfSectorsPerTrack/2) * 642;
+    UINT packedbytes = track_offsets[track + 1] - track_offsets[track];
+
+    if ((f_tell(&fil) != track_offsets[track]) && ((fr = f_lseek(&fil, track_offsets[track])) != FR_OK))
+        return(fr);
+    if ((fr = f_read(&fil, packeddata, packedbytes, &nr)) != FR_OK)
+        return(fr);
+    if (nr != packedbytes)
+        return(FR_INT_ERR);
+    if (!unpack_track(packeddata, (int) packedbytes, &buf[head * trackbytes], trackbytes)) {
+        printf("###ERROR, Packed track %d/%d is damaged\r\n", cylindercount, head);
+        return(FR_INT_ERR);
+    }
+    return(FR_OK);
+}
+
+// pack the tracks of a cylinder and add them to the end of the image being rewritten with one f_write()
+static FRESULT write_packed_cylinder(struct Disk_State* dstate, int cylindercount, const uint8_t *buf)
+{
+    FRESULT fr;
+    UINT nw;
+    int first = cylindercount * dstate->numberOfHeads;
+    int trackbytes = (dstate->numberOfSectorsPerTrack/2) * 642;
+    UINT packedbytes = 0;
+
+    for (int head = 0; head < dstate->numberOfHeads; head++){
+        track_offsets[first + head] = (uint32_t) (f_tell(&fil) + packedbytes);
+        packedbytes += pack_track(&buf[head * trackbytes], trackbytes, &packeddata[packedbytes]);
+    }
+    fr = f_write(&fil, packeddata, packedbytes, &nw);
+    if ((fr == FR_OK) && (nw != packedbytes))
+        fr = FR_DENIED;
+    return(fr);
+}
+
+int read_image_file_header(struct Disk_State* dstate)
+{
+    bool rc;
+    static char tmp[10];
+    int version;
+    int crc;
+    FRESULT fr;
+    UINT nr;
+
+    printf("Reading header from file '%s'\r\n", diskimagefilename);
+
+    // both versions fit in the first block, a version 1.3 file is only shorter than that if it holds no sectors
+    header_pos = 0;
+    fr = f_read(&fil, headerdata, sizeof(headerdata), &header_len);
+    if (fr != FR_OK) {
+        printf("###ERROR, Header data read error fr=%d\r\n", fr);
+        return 1;
+    }
+
+    if (!deserialize_string(tmp, sizeof(magicNumber)) || strncmp(tmp, magicNumber, sizeof(magicNumber)) != 0) {
+        // invalid magic
+        return 2;
+    }
+
+    if (!deserialize_string(tmp, sizeof(versionNumber))) {
+        return 3;
+    }
+    if (strncmp(tmp, versionNumber, sizeof(versionNumber)) == 0)
+        version = IMAGE_ZERO_MAP;
+    else if (strncmp(tmp, alignedVersionNumber, sizeof(alignedVersionNumber)) == 0)
+        version = IMAGE_ALIGNED;
+    else if (strncmp(tmp, packedVersionNumber, sizeof(packedVersionNumber)) == 0)
+        version = IMAGE_PACKED;
+    else if (strncmp(tmp, compressedVersionNumber, sizeof(compressedVersionNumber)) == 0)
+        version = IMAGE_COMPRESSED;
+    else {
+        // unexpected version
+        return 3;
+    }
+
+
+    rc =       deserialize_string(dstate->imageName, sizeof(dstate->imageName));
+    rc = rc && deserialize_string(dstate->imageDescription, sizeof(dstate->imageDescription));
+    rc = rc && deserialize_string(dstate->imageDate, sizeof(dstate->imageDate));
+    rc = rc && deserialize_string(dstate->controller, sizeof(dstate->controller));
+    rc = rc && deserialize_int(&dstate->bitRate);                 
+    rc = rc && deserialize_int(&dstate->numberOfCylinders);       
+    rc = rc && deserialize_int(&dstate->numberOfSectorsPerTrack); 
+    rc = rc && deserialize_int(&dstate->numberOfHeads);           
+    rc = rc && deserialize_int(&dstate->microsecondsPerSector);
+
+    // the image check follows the fields in the header block, a version 1.3 image has none
+    header_has_crc = false;
+    if (rc && (version != IMAGE_PACKED) && deserialize_string(tmp, 4) && (strncmp(tmp, "CRC", 4) == 0)
+        && deserialize_int(&crc)) {
+        header_has_crc = true;
+        header_crc = (uint32_t) crc;
+    }
+
+    if (rc && (cylinder_bytes(dstate) > CYLINDER_BUFFER_SIZE)) {
+        printf("###ERROR, %d heads of %d sectors do not fit the cylinder buffer\r\n",
+               dstate->numberOfHeads, dstate->numberOfSectorsPerTrack);
+        return 4;
+    }
+    if (rc && (version == IMAGE_ZERO_MAP) && (dstate->numberOfCylinders > (int) sizeof(zero_sector_map))) {
+        printf("###ERROR, %d cylinders do not fit the zero sector map\r\n", dstate->numberOfCylinders);
+        return 4;
+    }
+    if (rc && (version == IMAGE_COMPRESSED) && (dstate->numberOfCylinders * dstate->numberOfHeads > MAX_PACKED_TRACKS)) {
+        printf("###ERROR, %d tracks do not fit the track table\r\n", dstate->numberOfCylinders * dstate->numberOfHeads);
+        return 4;
+    }
+
+    if (rc) {
+        printf("controller = %s\r\n", dstate->controller);
+        printf("bitRate = %d\r\n", dstate->bitRate);
+        printf("numberOfCylinders = %d\r\n", dstate->numberOfCylinders);
+        printf("numberOfSectorsPerTrack = %d\r\n", dstate->numberOfSectorsPerTrack);
+        printf("numberOfHeads = %d\r\n", dstate->numberOfHeads);
+        printf("microsecondsPerSector = %d\r\n", dstate->microsecondsPerSector);
+        set_image_layout(dstate, version);
+        printf("image version %s\r\n", image_version_name());
+        if (image_compressed && !read_track_table(dstate))
+            return 1;
+
+        // the zero sector map follows the header block, older images have no sectors known to be zero
+        memset(zero_sector_map, 0, sizeof(zero_sector_map));
+        zero_map_dirty = false;
+        if (image_zero_map) {
+            fr = f_read(&fil, zero_sector_map, sizeof(zero_sector_map), &nr);
+            if (fr != FR_OK || nr != sizeof(zero_sector_map)) {
+                printf("###ERROR, Zero sector map read error fr=%d, nr=%u\r\n", fr, nr);
+                return 1;
+            }
+        }
+
+        // write the data read from the JSON  header into the FPGA registers
+        update_fpga_disk_state(dstate);
+        return 0;
+    }
+
+    return 1;
+}
+
+int write_image_file_header(struct Disk_State* dstate)
+{
+    bool rc;
+    FRESULT fr;
+    UINT nw;
+
+    if (incremental_write_back) {
+        printf("Header of file '%s' unchanged\r\n", diskimagefilename);
+        return 0;
+    }
+
+    printf("Writing header to file '%s'\r\n", diskimagefilename);
+
+    // the rest of the block is zero, the sector data starts at the second block
+    memset(headerdata, 0, sizeof(headerdata));
+    header_pos = 0;
+    rc =       serialize_string(magicNumber, sizeof(magicNumber));
+    rc = rc && serialize_string(image_compressed ? compressedVersionNumber : versionNumber, sizeof(versionNumber));
+    rc = rc && serialize_string(dstate->imageName, sizeof(dstate->imageName));
+    rc = rc && serialize_string(dstate->imageDescription, sizeof(dstate->imageDescription));
     rc = rc && serialize_string(dstate->imageDate, sizeof(dstate->imageDate));
     rc = rc && serialize_string(dstate->controller, sizeof(dstate->controller));
     rc = rc && serialize_int(dstate->bitRate);                 
@@ -280,97 +1390,2099 @@ int write_image_file_header(struct Disk_State* dstate)
     rc = rc && serialize_int(dstate->numberOfHeads);           
     rc = rc && serialize_int(dstate->microsecondsPerSector);   
 
-    return rc ? 0 : 1;
+    if (rc) {
+        fr = f_write(&fil, headerdata, IMAGE_BLOCK_SIZE, &nw);
+        if (fr != FR_OK || nw != IMAGE_BLOCK_SIZE) {
+            printf("###ERROR, Header data write error fr=%d, nw=%u\r\n", fr, nw);
+            rc = false;
+        }
+    }
+
+    // the zero sector map block or the track table stays empty until the sector data is written,
+    // a compressed image stays compressed
+    set_image_layout(dstate, image_compressed ? IMAGE_COMPRESSED : IMAGE_ZERO_MAP);
+    memset(headerdata, 0, sizeof(headerdata));
+    for (FSIZE_t offset = IMAGE_BLOCK_SIZE; rc && (offset < image_data_offset); offset += IMAGE_BLOCK_SIZE) {
+        fr = f_write(&fil, headerdata, IMAGE_BLOCK_SIZE, &nw);
+        if (fr != FR_OK || nw != IMAGE_BLOCK_SIZE) {
+            printf("###ERROR, %s write error fr=%d, nw=%u\r\n", image_compressed ? "Track table" : "Zero sector map", fr, nw);
+            rc = false;
+        }
+    }
+
+    return rc ? 0 : 1;
+
+}
+
+// table for the byte at a time CRC-32, the same as zlib's, the M0+ has no cache for larger slice tables to pay off
+static void make_crc_table()
+{
+    uint32_t crc;
+
+    for (uint32_t i = 0; i < 256; i++){
+        crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : (crc >> 1);
+        crc_table[i] = crc;
+    }
+}
+
+// CRC-32 of one sector, taken over its sector number and its bytes, a buf of NULL is a sector of zeros
+static uint32_t sector_crc(int fileslot, const uint8_t *buf, int len)
+{
+    uint32_t crc = 0xFFFFFFFFu;
+
+    for (int shift = 24; shift >= 0; shift -= 8)
+        crc = crc_table[(crc ^ (fileslot >> shift)) & 0xFF] ^ (crc >> 8);
+    if (buf == NULL) {
+        for (int i = 0; i < len; i++)
+            crc = crc_table[crc & 0xFF] ^ (crc >> 8);
+    }
+    else {
+        for (int i = 0; i < len; i++)
+            crc = crc_table[(crc ^ buf[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return(~crc);
+}
+
+// read a rewritten image back from the card, the image check in its header and the one taken again from its
+// sectors have to be the image check the rewrite took from the SDRAM before it may replace the image
+static FRESULT check_rewritten_image(struct Disk_State* dstate, const char *name)
+{
+    FRESULT fr;
+    UINT nr;
+    uint8_t field[8];
+    uint8_t zerobits;
+    uint32_t crc = 0;
+    int slots = dstate->numberOfHeads * (dstate->numberOfSectorsPerTrack/2);
+    UINT readbytes = slots * 642;
+
+    if ((fr = f_open(&fil, name, FA_READ)) != FR_OK)
+        return(fr);
+    fr = f_lseek(&fil, HEADER_CRC_OFFSET);
+    if (fr == FR_OK)
+        fr = f_read(&fil, field, sizeof(field), &nr);
+    if ((fr == FR_OK) && ((nr != sizeof(field)) || (memcmp(field, "CRC", 4) != 0)
+        || ((((uint32_t) field[4] << 24) | (field[5] << 16) | (field[6] << 8) | field[7]) != image_crc))) {
+        printf("*** ERROR, the header of '%s' does not hold the image check %08x\r\n", name, (unsigned int) image_crc);
+        fr = FR_INT_ERR;
+    }
+
+    for (int cylinder = 0; (fr == FR_OK) && (cylinder < dstate->numberOfCylinders); cylinder++) {
+        zerobits = cylinder_zero_bits(cylinder);
+        if (zerobits == zero_map_cylinder_mask(dstate)) {
+            nr = readbytes;
+        }
+        else if (image_compressed) {
+            fr = read_packed_cylinder(dstate, cylinder, cylinderdata[0]);
+            nr = readbytes;
+        }
+        else {
+            fr = f_lseek(&fil, sector_file_offset(dstate, cylinder, 0, 0));
+            if (fr == FR_OK)
+                fr = f_read(&fil, cylinderdata[0], readbytes, &nr);
+        }
+        if ((fr == FR_OK) && (nr != readbytes))
+            fr = FR_INT_ERR;
+        for (int slot = 0; (fr == FR_OK) && (slot < slots); slot++) {
+            if (zerobits & (1 << slot))
+                crc ^= sector_crc(cylinder * slots + slot, NULL, 642);
+            else
+                crc ^= sector_crc(cylinder * slots + slot, cylinderdata[0] + slot * 642, 642);
+        }
+    }
+    if ((fr == FR_OK) && (crc != image_crc)) {
+        printf("*** ERROR, image check %08x of '%s' read back is not %08x\r\n", (unsigned int) crc, name, (unsigned int) image_crc);
+        fr = FR_INT_ERR;
+    }
+    f_close(&fil);
+    return(fr);
+}
+
+// follow a sector written in place in the image check and its sector hash, the header is updated when the file is
+// closed, a sector whose old CRC is not known leaves the image without an image check
+static void update_image_crc(int fileslot, const uint8_t *buf)
+{
+    uint32_t crc;
+
+    if (image_crc_known)
+        image_crc_dirty = true;
+    if (!sector_hashes_valid || (fileslot >= MAX_SECTOR_SLOTS)) {
+        image_crc_known = false;
+        return;
+    }
+    crc = sector_crc(fileslot, buf, 642);
+    if (image_crc_known)
+        image_crc ^= sector_hashes[fileslot] ^ crc;
+    sector_hashes[fileslot] = crc;
+}
+
+// *************** base plus overlay ***************
+static uint32_t overlay_entry_crc(int session, int fileslot, const uint8_t *buf)
+{
+    return(sector_crc(fileslot, buf, 642) ^ (uint32_t) session);
+}
+
+// read the next overlay or journal entry into packeddata, false at the end of the entries or at one that was cut short
+static bool read_overlay_entry(FIL *fp, int *session, int *fileslot)
+{
+    UINT nr;
+
+    if ((f_read(fp, packeddata, OVERLAY_ENTRY_SIZE, &nr) != FR_OK) || (nr != OVERLAY_ENTRY_SIZE))
+        return(false);
+    *session = (packeddata[0] << 8) | packeddata[1];
+    *fileslot = (packeddata[2] << 8) | packeddata[3];
+    return(get_offset(&packeddata[4 + 642]) == overlay_entry_crc(*session, *fileslot, &packeddata[4]));
+}
+
+// index the overlay of the image before it is loaded, the entries are read over the image by the load
+// An overlay is tied to the image by its image check, so one left behind by a rewrite of the image is removed.
+static void open_image_overlay(struct Disk_State* dstate)
+{
+    FRESULT fr;
+    UINT nr;
+    FSIZE_t offset;
+    int slots = dstate->numberOfCylinders * dstate->numberOfHeads * (dstate->numberOfSectorsPerTrack/2);
+    int session;
+    int lastsession = -1;
+    int sessions = 0;
+    int fileslot;
+    char deltafilename[FF_LFN_BUF + 1];
+
+    memset(delta_index, 0, sizeof(delta_index));
+    delta_end = 0;
+    delta_sectors = 0;
+    delta_session = 0;
+    delta_crc = 0;
+    overlay_write_back = false;
+    compact_overlay = false;
+    if (deltafil_open)
+        f_close(&deltafil);
+    deltafil_open = false;
+    // the overlay is tied to the image by its image check and indexed by sector slot
+    overlay_active = header_has_crc && (slots <= MAX_SECTOR_SLOTS) && dstate->overlay_mode;
+
+    sibling_file_name(deltafilename, diskimagefilename, ".dlt");
+    if (f_open(&deltafil, deltafilename, FA_READ) != FR_OK)
+        return;
+    fr = f_read(&deltafil, packeddata, OVERLAY_HEADER_SIZE, &nr);
+    if ((fr != FR_OK) || (nr != OVERLAY_HEADER_SIZE) || (memcmp(packeddata, OVERLAY_MAGIC, 8) != 0)
+        || !header_has_crc || (get_offset(&packeddata[8]) != header_crc) || (slots > MAX_SECTOR_SLOTS)) {
+        printf(" '%s' is not an overlay of this image, removing it\r\n", deltafilename);
+        f_close(&deltafil);
+        f_unlink(deltafilename);
+        return;
+    }
+
+    for (offset = OVERLAY_HEADER_SIZE; read_overlay_entry(&deltafil, &session, &fileslot); offset += OVERLAY_ENTRY_SIZE) {
+        if (fileslot >= slots)
+            break;
+        if (delta_index[fileslot] == 0)
+            delta_sectors++;
+        delta_index[fileslot] = (uint32_t) offset;
+        if (session != lastsession)
+            sessions++;
+        lastsession = session;
+    }
+    delta_end = offset;
+    delta_session = lastsession + 1;
+    overlay_active = true;
+    if (delta_sectors != 0) {
+        printf(" %d sectors from %d write backs in '%s' are read over the image\r\n", delta_sectors, sessions, deltafilename);
+        deltafil_open = true;
+        return;
+    }
+    f_close(&deltafil);
+    // an empty overlay is not kept once the mode is off, the image is written in place again
+    if (!dstate->overlay_mode) {
+        f_unlink(deltafilename);
+        delta_end = 0;
+        overlay_active = false;
+    }
+}
+
+// read the last overlay or journal entry of a sector over the sector read from the image, the image check stays
+// the one of the image and delta_crc follows the difference
+static int merge_overlay_sector(int fileslot, uint8_t *buf, uint32_t imagecrc, uint32_t *crc)
+{
+    FRESULT fr;
+    UINT nr = 0;
+    FIL *fp = (delta_index[fileslot] & JOURNAL_ENTRY_BIT) ? &jnlfil : &deltafil;
+    uint32_t starttime = time_us_32();
+
+    fr = f_lseek(fp, (delta_index[fileslot] & ~JOURNAL_ENTRY_BIT) + 4);
+    if (fr == FR_OK)
+        fr = f_read(fp, buf, 642, &nr);
+    sd_stage_us += time_us_32() - starttime;
+    if (fr != FR_OK || nr != 642) {
+        printf("###ERROR, Overlay sector slot %d read error fr=%d, nr=%u\r\n", fileslot, fr, nr);
+        return(FILE_OPS_ERROR);
+    }
+    *crc = sector_crc(fileslot, buf, 642);
+    delta_crc ^= imagecrc ^ *crc;
+    return(FILE_OPS_OKAY);
+}
+
+static void close_image_overlay()
+{
+    if (deltafil_open)
+        f_close(&deltafil);
+    deltafil_open = false;
+    if (jnlfil_open)
+        f_close(&jnlfil);
+    jnlfil_open = false;
+}
+
+// add a sector to the end of the overlay, fil is at delta_end
+static int write_overlay_sector(struct Disk_State* dstate, int cylinder, int head, int sector, const uint8_t *buf)
+{
+    FRESULT fr;
+    UINT nw = 0;
+    UINT nr = 0;
+    int fileslot = (cylinder * dstate->numberOfHeads + head) * (dstate->numberOfSectorsPerTrack/2) + sector;
+    uint8_t *readback = &packeddata[1024];
+    uint32_t starttime;
+
+    packeddata[0] = (delta_session >> 8) & 0xFF;
+    packeddata[1] = delta_session & 0xFF;
+    packeddata[2] = (fileslot >> 8) & 0xFF;
+    packeddata[3] = fileslot & 0xFF;
+    memcpy(&packeddata[4], buf, 642);
+    put_offset(&packeddata[4 + 642], overlay_entry_crc(delta_session, fileslot, buf));
+    fr = f_write(&fil, packeddata, OVERLAY_ENTRY_SIZE, &nw);
+    if (fr != FR_OK || nw != OVERLAY_ENTRY_SIZE) {
+        printf("###ERROR, Overlay sector %d/%d/%d write error fr=%d, nw=%u\r\n", cylinder, head, sector, fr, nw);
+        return(FILE_OPS_ERROR);
+    }
+
+    if (dstate->verify_write_back) {
+        starttime = time_us_32();
+        fr = f_lseek(&fil, delta_end);
+        if (fr == FR_OK)
+            fr = f_read(&fil, readback, OVERLAY_ENTRY_SIZE, &nr);
+        verify_bytes += nr;
+        verify_us += time_us_32() - starttime;
+        if (fr != FR_OK || nr != OVERLAY_ENTRY_SIZE) {
+            printf("###ERROR, Overlay sector %d/%d/%d read back error fr=%d, nr=%u\r\n", cylinder, head, sector, fr, nr);
+            return(FILE_OPS_ERROR);
+        }
+        if (memcmp(readback, packeddata, OVERLAY_ENTRY_SIZE) != 0) {
+            verify_mismatches++;
+            printf("###ERROR, Overlay sector %d/%d/%d did not read back as written\r\n", cylinder, head, sector);
+            return(FILE_OPS_ERROR);
+        }
+    }
+
+    if (delta_index[fileslot] == 0)
+        delta_sectors++;
+    delta_index[fileslot] = (uint32_t) delta_end;
+    delta_end += OVERLAY_ENTRY_SIZE;
+    sector_hashes[fileslot] = sector_crc(fileslot, buf, 642);
+    return(FILE_OPS_OKAY);
+}
+
+// drop the entries the last write back added to the overlay of the image, so the cartridge loads as it was
+// before that session, run from the console while no cartridge is loaded
+int rollback_disk_image()
+{
+    FRESULT fr;
+    FSIZE_t offset;
+    FSIZE_t laststart = 0;
+    int session;
+    int lastsession = -1;
+    int fileslot;
+    int entries = 0;
+    int result;
+    char deltafilename[FF_LFN_BUF + 1];
+
+    release_preopened_image();
+    if ((result = file_init_and_mount()) != FILE_OPS_OKAY)
+        return(result);
+    if ((result = file_open_read_disk_image()) != FILE_OPS_OKAY)
+        return(result);
+    f_close(&fil);
+
+    sibling_file_name(deltafilename, diskimagefilename, ".dlt");
+    if (f_open(&deltafil, deltafilename, FA_READ | FA_WRITE | FA_OPEN_EXISTING) != FR_OK) {
+        printf("'%s' has no overlay to roll back\r\n", diskimagefilename);
+        return(unmount_volume());
+    }
+    fr = f_lseek(&deltafil, OVERLAY_HEADER_SIZE);
+    for (offset = OVERLAY_HEADER_SIZE; (fr == FR_OK) && read_overlay_entry(&deltafil, &session, &fileslot); offset += OVERLAY_ENTRY_SIZE) {
+        if (session != lastsession) {
+            laststart = offset;
+            entries = 0;
+        }
+        lastsession = session;
+        entries++;
+    }
+    if ((fr == FR_OK) && (lastsession < 0)) {
+        printf("The overlay of '%s' holds no write backs\r\n", diskimagefilename);
+        f_close(&deltafil);
+        return(unmount_volume());
+    }
+
+    // the entries of the last session go, along with anything after them that was cut short
+    if (fr == FR_OK)
+        fr = f_lseek(&deltafil, laststart);
+    if (fr == FR_OK)
+        fr = f_truncate(&deltafil);
+    if (fr == FR_OK)
+        fr = f_close(&deltafil);
+    else
+        f_close(&deltafil);
+    if ((fr == FR_OK) && (laststart == OVERLAY_HEADER_SIZE))
+        fr = f_unlink(deltafilename);
+    if (fr != FR_OK) {
+        printf("*** ERROR, could not roll back '%s' (%d)\r\n", deltafilename, fr);
+        unmount_volume();
+        return(fr);
+    }
+    printf("Rolled back the %d sectors of the last write back to '%s'\r\n", entries, diskimagefilename);
+    return(unmount_volume());
+}
+
+// *************** power fail journal ***************
+static void fill_journal_header(uint8_t *header)
+{
+    memset(header, 0, FF_MAX_SS);
+    memcpy(header, JOURNAL_MAGIC, 8);
+    header[8] = journal_bound ? 1 : 0;
+    put_offset(&header[12], journal_crc);
+    header[16] = (journal_stamp >> 8) & 0xFF;
+    header[17] = journal_stamp & 0xFF;
+    header[18] = (journal_planned >> 8) & 0xFF;
+    header[19] = journal_planned & 0xFF;
+    header[20] = (journal_budget >> 8) & 0xFF;
+    header[21] = journal_budget & 0xFF;
+    put_offset(&header[22], journal_block_us);
+    header[26] = (journal_flush_first >> 8) & 0xFF;
+    header[27] = journal_flush_first & 0xFF;
+    put_offset(&header[28], journal_holdup_us);
+}
+
+static DRESULT write_journal_header()
+{
+    fill_journal_header(journalheader);
+    return(disk_write(fs.pdrv, journalheader, journal_lba, 1));
+}
+
+// set up the power fail journal of the image before it is loaded, allocating it the first time, and index the
+// entries of a flush that were not written back, so the load reads them over the image and marks them dirty.
+// A flush that was cut short shows how many sectors the hold-up lasted for, which becomes the budget. A flush that
+// finished leaves the hold-up time in the last block instead, which the budget is worked out from.
+static void open_power_fail_journal(struct Disk_State* dstate)
+{
+    FRESULT fr = FR_OK;
+    UINT nr = 0;
+    int trackslots = dstate->numberOfSectorsPerTrack/2;
+    int slots = dstate->numberOfCylinders * dstate->numberOfHeads * trackslots;
+    int session;
+    int fileslot;
+    int replayed = 0;
+    bool stored;
+    bool belongs;
+    uint32_t starttime;
+    char jnlfilename[FF_LFN_BUF + 1];
+
+    journal_ready = false;
+    journal_sectors = 0;
+    if (jnlfil_open)
+        f_close(&jnlfil);
+    jnlfil_open = false;
+    if (slots > MAX_SECTOR_SLOTS)
+        return;
+
+#if FF_USE_EXPAND
+    sibling_file_name(jnlfilename, diskimagefilename, ".jnl");
+    if ((fr = f_open(&jnlfil, jnlfilename, FA_READ | FA_WRITE | FA_OPEN_ALWAYS)) != FR_OK) {
+        printf(" no power fail journal, could not open '%s' (%d)\r\n", jnlfilename, fr);
+        return;
+    }
+    // a journal that is not the right size is allocated again
+    stored = (f_size(&jnlfil) == (FSIZE_t) JOURNAL_BLOCKS * FF_MAX_SS)
+             && (f_read(&jnlfil, journalheader, FF_MAX_SS, &nr) == FR_OK) && (nr == FF_MAX_SS)
+             && (memcmp(journalheader, JOURNAL_MAGIC, 8) == 0);
+    if (!stored) {
+        memset(journalheader, 0, sizeof(journalheader));
+        fr = f_lseek(&jnlfil, 0);
+        if (fr == FR_OK)
+            fr = f_truncate(&jnlfil);
+        if (fr == FR_OK)
+            fr = f_expand(&jnlfil, (FSIZE_t) JOURNAL_BLOCKS * FF_MAX_SS, 1);
+    }
+    if ((fr != FR_OK) || !find_file_extent(&jnlfil, &journal_lba)) {
+        printf(" no power fail journal, could not allocate '%s' in one piece (%d)\r\n", jnlfilename, fr);
+        f_close(&jnlfil);
+        return;
+    }
+    journal_stamp = (journalheader[16] << 8) | journalheader[17];
+    journal_planned = (journalheader[18] << 8) | journalheader[19];
+    journal_budget = (journalheader[20] << 8) | journalheader[21];
+    journal_block_us = get_offset(&journalheader[22]);
+    journal_flush_first = (journalheader[26] << 8) | journalheader[27];
+    journal_holdup_us = get_offset(&journalheader[28]);
+
+    // the entries are replayed only over the image they were flushed from
+    belongs = stored && (journalheader[8] ? (header_has_crc && (get_offset(&journalheader[12]) == header_crc)) : !header_has_crc);
+    if (belongs && (f_lseek(&jnlfil, FF_MAX_SS) == FR_OK)) {
+        while ((replayed < journal_planned) && read_overlay_entry(&jnlfil, &session, &fileslot)
+               && (session == journal_stamp) && (fileslot < slots)) {
+            delta_index[fileslot] = (uint32_t) (FF_MAX_SS + replayed * OVERLAY_ENTRY_SIZE) | JOURNAL_ENTRY_BIT;
+            dirty_sector_map[fileslot / (dstate->numberOfHeads * trackslots)]
+                |= 1 << ((((fileslot / trackslots) % dstate->numberOfHeads) << 2) | (fileslot % trackslots));
+            replayed++;
+        }
+        if (replayed < journal_planned) {
+            journal_budget = (replayed > journal_flush_first) ? replayed - journal_flush_first : 1;
+            journal_holdup_us = 0;
+            printf(" the last power fail flush was cut short after %d of %d sectors\r\n",
+                   replayed - journal_flush_first, journal_planned - journal_flush_first);
+        }
+        else if ((journal_budget != 0) && (replayed - journal_flush_first > journal_budget))
+            journal_budget = replayed - journal_flush_first;
+    }
+    // the hold-up block counts only if it was written after the last flush, the same stamp and sector count
+    if (stored && (replayed == journal_planned) && (disk_read(fs.pdrv, cylinderdata[0], journal_lba + JOURNAL_HOLDUP_BLOCK, 1) == RES_OK)
+        && (memcmp(cylinderdata[0], HOLDUP_MAGIC, 8) == 0)
+        && (((cylinderdata[0][8] << 8) | cylinderdata[0][9]) == journal_stamp)
+        && (((cylinderdata[0][10] << 8) | cylinderdata[0][11]) == journal_planned)
+        && (get_offset(&cylinderdata[0][12]) == get_offset(&cylinderdata[0][16]))
+        && (get_offset(&cylinderdata[0][12]) != 0)) {
+        journal_holdup_us = get_offset(&cylinderdata[0][12]);
+        journal_budget = 0;
+        printf(" the supply held up for %d ms after the last power fail flush started\r\n", (int) (journal_holdup_us / 1000));
+    }
+    journal_planned = replayed;
+    journal_flush_first = 0;
+    journal_sectors = replayed;
+    if (replayed != 0) {
+        printf(" replaying %d sectors from the power fail journal '%s'\r\n", replayed, jnlfilename);
+        jnlfil_open = true;
+    }
+
+    // the time to write a few blocks is measured once, for the budget until a flush measures it, and only by a load
+    // with no entries to keep as the blocks written are where the entries go
+    if ((replayed == 0) && (journal_block_us == 0)) {
+        memset(cylinderdata[0], 0, JOURNAL_PROBE_BLOCKS * FF_MAX_SS);
+        starttime = time_us_32();
+        if (disk_write(fs.pdrv, cylinderdata[0], journal_lba + 1, JOURNAL_PROBE_BLOCKS) == RES_OK)
+            journal_block_us = (time_us_32() - starttime) / JOURNAL_PROBE_BLOCKS + 1;
+    }
+    journal_bound = header_has_crc;
+    journal_crc = header_crc;
+    journal_card_changes = card_change_count();
+    // the header is only written again when the load changed it, the buffer is free until the first cylinder is read
+    fill_journal_header(cylinderdata[0]);
+    if (stored && (memcmp(cylinderdata[0], journalheader, FF_MAX_SS) == 0))
+        journal_ready = true;
+    else
+        journal_ready = (write_journal_header() == RES_OK);
+    if (!journal_ready)
+        printf(" no power fail journal, could not write the header of '%s'\r\n", jnlfilename);
+    if (!jnlfil_open)
+        f_close(&jnlfil);
+#endif
+}
+
+// sectors a flush can commit within the hold-up. Both come from the last power fail: the sectors a flush that was
+// cut short got to the card, or the hold-up time a flush that finished measured over the time to write a block.
+// 0 until a power fail has measured one of them.
+static int power_fail_budget()
+{
+    if (journal_budget != 0)
+        return(journal_budget);
+    if ((journal_holdup_us == 0) || (journal_block_us == 0))
+        return(0);
+    return((int) ((uint64_t) journal_holdup_us * FF_MAX_SS / ((uint64_t) journal_block_us * OVERLAY_ENTRY_SIZE)));
+}
+
+// a flush finished with the supply still failing, the rest of the hold-up is measured by writing the time since the
+// flush started to the hold-up block until the card stops taking writes, the next load reads the last that made it.
+// A supply that comes back is no measurement and the block is cleared.
+static void measure_power_holdup(uint32_t starttime)
+{
+    uint8_t *block = cylinderdata[0];
+    uint32_t elapsed = 0;
+    DRESULT res = RES_OK;
+
+    memset(block, 0, FF_MAX_SS);
+    memcpy(block, HOLDUP_MAGIC, 8);
+    block[8] = (journal_stamp >> 8) & 0xFF;
+    block[9] = journal_stamp & 0xFF;
+    block[10] = (journal_planned >> 8) & 0xFF;
+    block[11] = journal_planned & 0xFF;
+    while ((res == RES_OK) && get_power_fail() && (elapsed < HOLDUP_LIMIT_US)) {
+        elapsed = time_us_32() - starttime;
+        put_offset(&block[12], elapsed);
+        put_offset(&block[16], elapsed);
+        res = disk_write(fs.pdrv, block, journal_lba + JOURNAL_HOLDUP_BLOCK, 1);
+    }
+    if ((res == RES_OK) && !get_power_fail()) {
+        memset(&block[12], 0, 8);
+        disk_write(fs.pdrv, block, journal_lba + JOURNAL_HOLDUP_BLOCK, 1);
+        printf(" the supply came back %d ms after the flush started\r\n", (int) (elapsed / 1000));
+    }
+}
+
+// the sectors in the journal are in the image or its overlay now, so a later load must not replay them
+void retire_power_fail_journal()
+{
+    for (int i = 0; i < MAX_SECTOR_SLOTS; i++){
+        if (delta_index[i] & JOURNAL_ENTRY_BIT)
+            delta_index[i] = 0;
+    }
+    if (!journal_ready || (journal_sectors == 0) || (journal_card_changes != card_change_count()))
+        return;
+    journal_stamp = (journal_stamp + 1) & 0xFFFF;
+    journal_planned = 0;
+    journal_flush_first = 0;
+    journal_sectors = 0;
+    if (write_journal_header() != RES_OK)
+        printf("###ERROR, could not retire the power fail journal\r\n");
+}
+
+// the image check in the header is cleared and synced before the first sector is written in place after it was
+// last written, a write back cut short then leaves an image without an image check rather than with a wrong one
+static FRESULT clear_header_crc()
+{
+    FRESULT fr;
+    UINT nw;
+    uint8_t field[8];
+
+    if (header_crc_cleared || (!image_aligned && !image_compressed))
+        return(FR_OK);
+    memset(field, 0, sizeof(field));
+    fr = f_lseek(&fil, HEADER_CRC_OFFSET);
+    if (fr == FR_OK)
+        fr = f_write(&fil, field, sizeof(field), &nw);
+    if ((fr == FR_OK) && (nw != sizeof(field)))
+        fr = FR_DENIED;
+    if (fr == FR_OK)
+        fr = f_sync(&fil);
+    if (fr != FR_OK)
+        return(fr);
+    header_crc_cleared = true;
+    // the header gets the image check again when the file is closed
+    image_crc_dirty = true;
+
+    // entries still in the power fail journal are replayed over the image without an image check now
+    if (journal_ready && (journal_sectors != 0) && journal_bound) {
+        journal_bound = false;
+        if (write_journal_header() != RES_OK)
+            fr = FR_DISK_ERR;
+    }
+    return(fr);
+}
+
+static void clear_stage_timing()
+{
+    sd_stage_us = 0;
+    fpga_stage_us = 0;
+    fpga_stalls = 0;
+}
+
+// a stage that is fully overlapped shows up with few stalls and a total close to the slower of the two stages
+static void print_stage_timing(uint32_t total_us, int sectors)
+{
+    printf(" %d sectors in %d ms: microSD %d ms, FPGA %d ms, FPGA stalls %d\r\n",
+        sectors, (int) (total_us / 1000), (int) (sd_stage_us / 1000), (int) (fpga_stage_us / 1000), fpga_stalls);
+}
+
+static void finish_fpga_stage()
+{
+    uint32_t starttime = time_us_32();
+
+    if (finish_dram_block_transfer())
+        fpga_stalls++;
+    fpga_stage_us += time_us_32() - starttime;
+}
+
+// zero a run of adjacent sector slots in the SDRAM with one FPGA fill, once the transfer still running is done
+static int fill_zero_slots(int ramaddress, int slots, bool *pending)
+{
+    uint32_t starttime;
+    bool filled;
+
+    if (*pending)
+        finish_fpga_stage();
+    *pending = false;
+    starttime = time_us_32();
+    filled = fill_dram_slots(ramaddress, slots, 0);
+    fpga_stage_us += time_us_32() - starttime;
+    if (!filled) {
+        printf("###ERROR, SDRAM fill of %d slots at %06x did not finish\r\n", slots, ramaddress);
+        return(FILE_OPS_ERROR);
+    }
+    return(FILE_OPS_OKAY);
+}
+
+// read one cylinder of the image file into the SDRAM with a single f_read() from the current file position
+// the SDRAM write of the last sector is left running, *pending says whether one is outstanding
+// Sectors the zero sector map marks are filled by the FPGA, or from zeros in the buffer if it cannot fill,
+// and a cylinder with every sector marked is not read at all.
+static int read_cylinder_image_data(struct Disk_State* dstate, int cylindercount, int *bufindex, bool *pending)
+{
+    FRESULT fr;
+    UINT nr;
+    UINT readbytes = cylinder_bytes(dstate);
+    int bytecount = 642;
+    int sectorcount;
+    int headcount;
+    int ramaddress;
+    int fileslot;
+    uint8_t *sectorbuf = cylinderdata[*bufindex];
+    uint32_t crc;
+    uint8_t zerobits = cylinder_zero_bits(cylindercount);
+    bool merged;
+    int filladdress = 0;
+    int fillslots = 0;
+    uint32_t starttime;
+
+    // the last sector of the previous cylinder streams into the SDRAM from the other buffer meanwhile
+    starttime = time_us_32();
+    if (zerobits == zero_map_cylinder_mask(dstate)) {
+        fr = FR_OK;
+        nr = readbytes;
+    }
+    else if (image_compressed) {
+        fr = read_packed_cylinder(dstate, cylindercount, sectorbuf);
+        nr = readbytes;
+    }
+    else if (direct_image_io()) {
+        readbytes = (UINT) cylinder_stride;
+        fr = (disk_read(fs.pdrv, sectorbuf, cylinder_lba(cylindercount), readbytes / FF_MAX_SS) == RES_OK) ? FR_OK : FR_DISK_ERR;
+        nr = readbytes;
+    }
+    else {
+        fr = f_read(&fil, sectorbuf, readbytes, &nr);
+    }
+    sd_stage_us += time_us_32() - starttime;
+    if (fr != FR_OK || nr != readbytes) {
+        if (*pending)
+            finish_dram_block_transfer();
+        *pending = false;
+        printf("###ERROR, Image data read error fr=%d, nr=%u\r\n", fr, nr);
+        return(FILE_OPS_ERROR);
+    }
+
+    for (headcount = 0; headcount < dstate->numberOfHeads; headcount++){
+        for( sectorcount = 0; sectorcount < (dstate->numberOfSectorsPerTrack)/2; sectorcount++){
+            ramaddress = (cylindercount << 12) | (headcount << 11) | (sectorcount << 9);
+            fileslot = (cylindercount * dstate->numberOfHeads + headcount) * (dstate->numberOfSectorsPerTrack/2) + sectorcount;
+            merged = (deltafil_open || jnlfil_open) && (delta_index[fileslot] != 0);
+
+            if ((zerobits & zero_map_bit(dstate, headcount, sectorcount)) && has_sdram_fill() && !merged) {
+                if ((fillslots != 0) && (ramaddress != filladdress + fillslots * 512)) {
+                    if (fill_zero_slots(filladdress, fillslots, pending) != FILE_OPS_OKAY)
+                        return(FILE_OPS_ERROR);
+                    fillslots = 0;
+                }
+                if (fillslots == 0)
+                    filladdress = ramaddress;
+                fillslots++;
+                crc = sector_crc(fileslot, NULL, bytecount);
+                image_crc ^= crc;
+                if (fileslot < MAX_SECTOR_SLOTS)
+                    sector_hashes[fileslot] = crc;
+                sectorbuf += bytecount;
+                continue;
+            }
+            if (zerobits & zero_map_bit(dstate, headcount, sectorcount))
+                memset(sectorbuf, 0, bytecount);
+
+            // the CRC overlaps the SDRAM transfer of the previous sector
+            crc = sector_crc(fileslot, sectorbuf, bytecount);
+            image_crc ^= crc;
+            if (merged && (merge_overlay_sector(fileslot, sectorbuf, crc, &crc) != FILE_OPS_OKAY)) {
+                if (*pending)
+                    finish_dram_block_transfer();
+                *pending = false;
+                return(FILE_OPS_ERROR);
+            }
+            if (fileslot < MAX_SECTOR_SLOTS)
+                sector_hashes[fileslot] = crc;
+            // a sector from the journal is not in the image or overlay yet, without the dirty sector map
+            // its hash is made stale so the write back finds it
+            if (merged && (delta_index[fileslot] & JOURNAL_ENTRY_BIT))
+                sector_hashes[fileslot] = ~crc;
+
+            // gpio_put(22, 1); // for debugging to time the loop
+            if (*pending)
+                finish_fpga_stage();
+            starttime = time_us_32();
+            start_dram_block_write(ramaddress, sectorbuf, bytecount);
+            fpga_stage_us += time_us_32() - starttime;
+            // gpio_put(22, 0); // for debugging to time the loop
+            *pending = true;
+            sectorbuf += bytecount;
+        }
+    }
+    if ((fillslots != 0) && (fill_zero_slots(filladdress, fillslots, pending) != FILE_OPS_OKAY))
+        return(FILE_OPS_ERROR);
+    *bufindex ^= 1;
+    return(FILE_OPS_OKAY);
+}
+
+// *************** sector access ***************
+// one sector of the open image by cylinder, head and sector, in the layout of the image, seeking with the fast
+// seek table when there is one so scattered sectors cost no cluster chain walks
+
+// read the last overlay or journal entry of a sector, from the file that is already open for it or else by opening
+// it for the read. The overlay being written back to is fil, which is left at delta_end again.
+static int read_entry_sector(int fileslot, uint8_t *buf)
+{
+    FRESULT fr = FR_OK;
+    UINT nr = 0;
+    bool journal = (delta_index[fileslot] & JOURNAL_ENTRY_BIT) != 0;
+    FIL *fp = journal ? &jnlfil : &deltafil;
+    bool opened = false;
+    char entryfilename[FF_LFN_BUF + 1];
+
+    if (!journal && writing_overlay)
+        fp = &fil;
+    else if (!(journal ? jnlfil_open : deltafil_open)) {
+        sibling_file_name(entryfilename, diskimagefilename, journal ? ".jnl" : ".dlt");
+        fr = f_open(fp, entryfilename, FA_READ);
+        opened = (fr == FR_OK);
+    }
+    if (fr == FR_OK)
+        fr = f_lseek(fp, (delta_index[fileslot] & ~JOURNAL_ENTRY_BIT) + 4);
+    if (fr == FR_OK)
+        fr = f_read(fp, buf, 642, &nr);
+    if (opened)
+        f_close(fp);
+    if ((fp == &fil) && (fr == FR_OK))
+        fr = f_lseek(&fil, delta_end);
+    if (fr != FR_OK || nr != 642) {
+        printf("###ERROR, %s sector slot %d read error fr=%d, nr=%u\r\n", journal ? "Journal" : "Overlay", fileslot, fr, nr);
+        return(FILE_OPS_ERROR);
+    }
+    return(FILE_OPS_OKAY);
+}
+
+int read_image_sector(struct Disk_State* dstate, int cylinder, int head, int sector, uint8_t *buf)
+{
+    FRESULT fr;
+    UINT nr = 0;
+    int fileslot = (cylinder * dstate->numberOfHeads + head) * (dstate->numberOfSectorsPerTrack/2) + sector;
+
+    // the last overlay or journal entry of the sector stands for it, with or without an overlay
+    if ((fileslot < MAX_SECTOR_SLOTS) && (delta_index[fileslot] != 0))
+        return(read_entry_sector(fileslot, buf));
+
+    if (writing_overlay) {
+        printf("###ERROR, Image is not open while its overlay is written\r\n");
+        return(FILE_OPS_ERROR);
+    }
+    if (cylinder_zero_bits(cylinder) & zero_map_bit(dstate, head, sector)) {
+        memset(buf, 0, 642);
+        return(FILE_OPS_OKAY);
+    }
+    if (image_compressed) {
+        printf("###ERROR, Image is compressed, its sectors are only read a cylinder at a time\r\n");
+        return(FILE_OPS_ERROR);
+    }
+    fr = f_lseek(&fil, sector_file_offset(dstate, cylinder, head, sector));
+    if (fr == FR_OK)
+        fr = f_read(&fil, buf, 642, &nr);
+    if (fr != FR_OK || nr != 642) {
+        printf("###ERROR, Image sector %d/%d/%d read error fr=%d, nr=%u\r\n", cylinder, head, sector, fr, nr);
+        return(FILE_OPS_ERROR);
+    }
+    return(FILE_OPS_OKAY);
+}
+
+// read a sector back from the card right after it was written in place and compare it, the blocks it is in come
+// from the card and not from the FatFs buffer, packeddata is free as compressed images are never written in place
+static int verify_image_sector(struct Disk_State* dstate, int cylinder, int head, int sector, const uint8_t *buf)
+{
+    FRESULT fr;
+    FSIZE_t offset = sector_file_offset(dstate, cylinder, head, sector);
+    FSIZE_t first = offset & ~(FSIZE_t) (FF_MAX_SS - 1);
+    UINT len = (UINT) (((offset + 642 + FF_MAX_SS - 1) & ~(FSIZE_t) (FF_MAX_SS - 1)) - first);
+    uint32_t starttime = time_us_32();
+
+    fr = read_back_image_blocks(first, packeddata, len);
+    if (fr == FR_OK)
+        verify_bytes += len;
+    verify_us += time_us_32() - starttime;
+    if (fr != FR_OK) {
+        printf("###ERROR, Image sector %d/%d/%d read back error fr=%d\r\n", cylinder, head, sector, fr);
+        return(FILE_OPS_ERROR);
+    }
+    if (memcmp(packeddata + (offset - first), buf, 642) != 0) {
+        verify_mismatches++;
+        printf("###ERROR, Image sector %d/%d/%d did not read back as written\r\n", cylinder, head, sector);
+        return(FILE_OPS_ERROR);
+    }
+    return(FILE_OPS_OKAY);
+}
+
+// a sector goes to the end of the overlay while the image has one, otherwise it is written in place. The zero
+// sector map follows it like it follows an extent, the map block is written when the file is closed.
+int write_image_sector(struct Disk_State* dstate, int cylinder, int head, int sector, const uint8_t *buf)
+{
+    FRESULT fr;
+    UINT nw = 0;
+    int fileslot = (cylinder * dstate->numberOfHeads + head) * (dstate->numberOfSectorsPerTrack/2) + sector;
+    uint8_t bit = zero_map_bit(dstate, head, sector);
+    bool marked = (cylinder_zero_bits(cylinder) & bit) != 0;
+    bool zero = sector_is_zero(buf);
+
+    // the image is not written while it has an overlay
+    if (writing_overlay)
+        return(write_overlay_sector(dstate, cylinder, head, sector, buf));
+    // a packed track changes length, a compressed image is only ever rewritten whole
+    if (image_compressed) {
+        printf("###ERROR, Image is compressed, its sectors cannot be written in place\r\n");
+        return(FILE_OPS_ERROR);
+    }
+    if ((fr = clear_header_crc()) != FR_OK) {
+        printf("###ERROR, Image check clear error fr=%d\r\n", fr);
+        return(FILE_OPS_ERROR);
+    }
+
+    // the file contents of a marked sector are never read
+    if (!(marked && zero)) {
+        fr = FR_OK;
+        if (f_tell(&fil) != sector_file_offset(dstate, cylinder, head, sector))
+            fr = f_lseek(&fil, sector_file_offset(dstate, cylinder, head, sector));
+        if (fr == FR_OK)
+            fr = f_write(&fil, buf, 642, &nw);
+        if (fr != FR_OK || nw != 642) {
+            printf("###ERROR, Image sector %d/%d/%d write error fr=%d, nw=%u\r\n", cylinder, head, sector, fr, nw);
+            return(FILE_OPS_ERROR);
+        }
+        if (dstate->verify_write_back && (verify_image_sector(dstate, cylinder, head, sector, buf) != FILE_OPS_OKAY))
+            return(FILE_OPS_ERROR);
+    }
+    update_image_crc(fileslot, buf);
+    if (image_zero_map && (cylinder < (int) sizeof(zero_sector_map)) && (zero != marked)) {
+        zero_sector_map[cylinder] ^= bit;
+        zero_map_dirty = true;
+    }
+    return(FILE_OPS_OKAY);
+}
+
+// *************** write scheduler ***************
+// The changed sectors of a cylinder are written in place as one extent, from the first to the last of them with the
+// unchanged sectors in between read from the SDRAM as well. With the sector hashes the extent is then rounded out to
+// whole blocks, taking in a sector it only reaches part of when it still hashes as the file holds it and widening
+// over it otherwise, so the card gets whole blocks and not a read-modify-write of a partial block for each sector.
+// The cylinders go in file order, and an extent that ends with its cylinder runs on into the next without a seek.
+// The zero sector map and the image check follow every sector the extent covers whole.
+
+// the cylinder slot bits of a dirty sector map entry, which has 4 bits for each head
+static uint8_t dirty_slot_bits(struct Disk_State* dstate, uint8_t dirtybits)
+{
+    int sectors = dstate->numberOfSectorsPerTrack/2;
+    uint8_t slotbits = 0;
+
+    for (int i = 0; i < dstate->numberOfHeads * sectors; i++){
+        if (dirtybits & (1 << (((i / sectors) << 2) | (i % sectors))))
+            slotbits |= (uint8_t) (1 << i);
+    }
+    return(slotbits);
+}
+
+static void read_extent_sector(struct Disk_State* dstate, int cylinder, int slot, uint8_t *buf)
+{
+    int sectors = dstate->numberOfSectorsPerTrack/2;
+
+    read_dram_block((cylinder << 12) | ((slot / sectors) << 11) | ((slot % sectors) << 9), buf + slot * 642, 642);
+}
+
+// read a sector the rounded extent reaches part of and tell whether it changed since it was loaded or written
+static bool extent_sector_changed(struct Disk_State* dstate, int cylinder, int slot, uint8_t *buf)
+{
+    int fileslot = cylinder * dstate->numberOfHeads * (dstate->numberOfSectorsPerTrack/2) + slot;
+
+    read_extent_sector(dstate, cylinder, slot, buf);
+    return(sector_crc(fileslot, buf + slot * 642, 642) != sector_hashes[fileslot]);
+}
+
+// compare an extent read back from the card with what was written, each sector that differs is reported
+static int verify_image_extent(struct Disk_State* dstate, int cylinder, int firstslot, int lastslot, const uint8_t *buf, UINT start, UINT len, FSIZE_t offset)
+{
+    FRESULT fr;
+    UINT nr = 0;
+    UINT first = start & ~(UINT) (FF_MAX_SS - 1);
+    UINT last = (start + len + FF_MAX_SS - 1) & ~(UINT) (FF_MAX_SS - 1);
+    int mismatches = 0;
+    uint32_t starttime = time_us_32();
+
+    // the blocks the extent is in come back from the card and not from the FatFs buffer, the cylinder starts a block
+    fr = read_back_image_blocks(offset + first, packeddata, last - first);
+    if (fr == FR_OK)
+        nr = last - first;
+    verify_bytes += nr;
+    verify_us += time_us_32() - starttime;
+    if (fr != FR_OK) {
+        printf("###ERROR, Image cylinder %d read back error fr=%d\r\n", cylinder, fr);
+        return(FILE_OPS_ERROR);
+    }
+    if (memcmp(packeddata + (start - first), buf + start, len) == 0)
+        return(FILE_OPS_OKAY);
+    for (int i = firstslot; i <= lastslot; i++){
+        if (memcmp(packeddata + (i * 642 - first), buf + i * 642, 642) != 0) {
+            printf("###ERROR, Image sector %d/%d/%d did not read back as written\r\n", cylinder,
+                i / (dstate->numberOfSectorsPerTrack/2), i % (dstate->numberOfSectorsPerTrack/2));
+            mismatches++;
+        }
+    }
+    if (mismatches == 0) {
+        printf("###ERROR, Image cylinder %d did not read back as written\r\n", cylinder);
+        mismatches++;
+    }
+    verify_mismatches += mismatches;
+    return(FILE_OPS_ERROR);
+}
+
+// write the sectors of a cylinder set in slotbits, counting them in written
+static int write_cylinder_extent(struct Disk_State* dstate, int cylinder, uint8_t slotbits, int *written)
+{
+    FRESULT fr;
+    UINT nw = 0;
+    int slots = dstate->numberOfHeads * (dstate->numberOfSectorsPerTrack/2);
+    int firstslot = -1;
+    int lastslot = -1;
+    UINT start;
+    UINT end;
+    UINT head;
+    UINT tail;
+    FSIZE_t offset = image_data_offset + (FSIZE_t) cylinder * cylinder_stride;
+    uint8_t *buf = cylinderdata[0];
+    uint8_t zerobits = cylinder_zero_bits(cylinder);
+    uint8_t bit;
+    bool zero;
+    bool needed = false;
+
+    for (int i = 0; i < slots; i++){
+        if (slotbits & (1 << i)) {
+            if (firstslot < 0)
+                firstslot = i;
+            lastslot = i;
+        }
+    }
+    if (firstslot < 0)
+        return(FILE_OPS_OKAY);
+
+    // sectors added to the overlay are appended one after the other as they come
+    if (writing_overlay) {
+        for (int i = firstslot; i <= lastslot; i++){
+            if (!(slotbits & (1 << i)))
+                continue;
+            read_extent_sector(dstate, cylinder, i, buf);
+            if (write_image_sector(dstate, cylinder, i / (dstate->numberOfSectorsPerTrack/2),
+                                   i % (dstate->numberOfSectorsPerTrack/2), buf + i * 642) != FILE_OPS_OKAY)
+                return(FILE_OPS_ERROR);
+            (*written)++;
+        }
+        return(FILE_OPS_OKAY);
+    }
+    if (image_compressed) {
+        printf("###ERROR, Image is compressed, its sectors cannot be written in place\r\n");
+        return(FILE_OPS_ERROR);
+    }
+    if ((fr = clear_header_crc()) != FR_OK) {
+        printf("###ERROR, Image check clear error fr=%d\r\n", fr);
+        return(FILE_OPS_ERROR);
+    }
+
+    for (int i = firstslot; i <= lastslot; i++)
+        read_extent_sector(dstate, cylinder, i, buf);
+    memset(buf + slots * 642, 0, (size_t) cylinder_stride - slots * 642);
+    start = firstslot * 642;
+    end = (lastslot + 1) * 642;
+    head = start;
+    tail = end;
+    if (sector_hashes_valid && ((cylinder + 1) * slots <= MAX_SECTOR_SLOTS)) {
+        for (;;){
+            head = start & ~(UINT) (IMAGE_BLOCK_SIZE - 1);
+            tail = (end + IMAGE_BLOCK_SIZE - 1) & ~(UINT) (IMAGE_BLOCK_SIZE - 1);
+            if ((head < start) && extent_sector_changed(dstate, cylinder, start / 642 - 1, buf))
+                start -= 642;
+            else if ((tail > end) && (end < (UINT) slots * 642) && extent_sector_changed(dstate, cylinder, end / 642, buf))
+                end += 642;
+            else
+                break;
+        }
+    }
+    firstslot = start / 642;
+    lastslot = end / 642 - 1;
+
+    // an extent of one sector that was not rounded out is a single sector write
+    if ((firstslot == lastslot) && (head == start) && (tail == end)) {
+        if (write_image_sector(dstate, cylinder, firstslot / (dstate->numberOfSectorsPerTrack/2),
+                               firstslot % (dstate->numberOfSectorsPerTrack/2), buf + start) != FILE_OPS_OKAY)
+            return(FILE_OPS_ERROR);
+        if (!(zerobits & (1 << firstslot)) || !sector_is_zero(buf + start)) {
+            extent_count++;
+            extent_bytes += 642;
+        }
+        if (slotbits & (1 << firstslot))
+            (*written)++;
+        return(FILE_OPS_OKAY);
+    }
+
+    // the file contents of a marked sector are never read, an extent of nothing but those is not written
+    for (int i = firstslot; i <= lastslot; i++){
+        if (!(zerobits & (1 << i)) || !sector_is_zero(buf + i * 642))
+            needed = true;
+    }
+    if (needed) {
+        fr = FR_OK;
+        if (f_tell(&fil) != offset + head)
+            fr = f_lseek(&fil, offset + head);
+        if (fr == FR_OK)
+            fr = f_write(&fil, buf + head, tail - head, &nw);
+        if (fr != FR_OK || nw != tail - head) {
+            printf("###ERROR, Image cylinder %d write error fr=%d, nw=%u\r\n", cylinder, fr, nw);
+            return(FILE_OPS_ERROR);
+        }
+        if (dstate->verify_write_back
+            && (verify_image_extent(dstate, cylinder, firstslot, lastslot, buf, head, tail - head, offset) != FILE_OPS_OKAY))
+            return(FILE_OPS_ERROR);
+        extent_count++;
+        extent_bytes += tail - head;
+    }
+
+    // the map block is written once the extents are, so a marked sector reads as zeros until its data is there
+    for (int i = firstslot; i <= lastslot; i++){
+        update_image_crc(cylinder * slots + i, buf + i * 642);
+        if (image_zero_map && (cylinder < (int) sizeof(zero_sector_map))) {
+            bit = (uint8_t) (1 << i);
+            zero = sector_is_zero(buf + i * 642);
+            if (zero != ((zero_sector_map[cylinder] & bit) != 0)) {
+                zero_sector_map[cylinder] ^= bit;
+                zero_map_dirty = true;
+            }
+        }
+        if (slotbits & (1 << i))
+            (*written)++;
+    }
+    return(FILE_OPS_OKAY);
+}
+
+// write the pending sector slots in file order, then the zero sector map, and sync the file once at the end
+static int write_pending_sectors(struct Disk_State* dstate, int *written)
+{
+    FRESULT fr;
+    int slots = dstate->numberOfHeads * (dstate->numberOfSectorsPerTrack/2);
+    int fileslot;
+    uint8_t slotbits;
+
+    extent_count = 0;
+    extent_bytes = 0;
+    for (int cylindercount = 0; cylindercount < dstate->numberOfCylinders; cylindercount++){
+        xfer_progress_cylinder = cylindercount;
+        slotbits = 0;
+        for (int i = 0; i < slots; i++){
+            fileslot = cylindercount * slots + i;
+            if ((fileslot < MAX_SECTOR_SLOTS) && (pending_slots[fileslot >> 3] & (1 << (fileslot & 7))))
+                slotbits |= (uint8_t) (1 << i);
+        }
+        if (write_cylinder_extent(dstate, cylindercount, slotbits, written) != FILE_OPS_OKAY)
+            return(FILE_OPS_ERROR);
+    }
+    if (zero_map_dirty && !writing_overlay && ((fr = write_zero_sector_map()) != FR_OK)) {
+        printf("###ERROR, Zero sector map write error fr=%d\r\n", fr);
+        return(FILE_OPS_ERROR);
+    }
+    if ((fr = f_sync(&fil)) != FR_OK) {
+        printf("###ERROR, Image file sync error fr=%d\r\n", fr);
+        return(FILE_OPS_ERROR);
+    }
+    return(FILE_OPS_OKAY);
+}
 
+// *************** cylinder access heat ***************
+// count an access by the 1130, called from the command interrupt handler
+void record_cylinder_access(int cylinder)
+{
+    if ((cylinder >= 0) && (cylinder < 256)) {
+        cylinder_heat[cylinder]++;
+        session_accesses++;
+    }
 }
 
-int read_disk_image_data(struct Disk_State* dstate)
+// read the counts saved at the last unload and put the busiest cylinders first in load_order
+// the saved counts are halved so the order follows how the pack has been used lately
+static void load_cylinder_heat(struct Disk_State* dstate)
 {
     FRESULT fr;
     UINT nr;
-    uint8_t *bp;
+    char magic[8];
+    int cylinders = 0;
+    int i;
+    int j;
+    uint8_t cylinder;
+    char heatfilename[FF_LFN_BUF + 1];
+
+    for (i = 0; i < 256; i++)
+        cylinder_heat[i] = 0;
+    session_accesses = 0;
+
+    sibling_file_name(heatfilename, diskimagefilename, ".hot");
+    if (f_open(&heatfil, heatfilename, FA_READ) == FR_OK) {
+        fr = f_read(&heatfil, magic, sizeof(magic), &nr);
+        if ((fr == FR_OK) && (nr == sizeof(magic)) && (memcmp(magic, HEAT_MAGIC, sizeof(magic)) == 0))
+            fr = f_read(&heatfil, &cylinders, sizeof(cylinders), &nr);
+        if ((fr == FR_OK) && (cylinders == dstate->numberOfCylinders) && (cylinders <= 256)) {
+            fr = f_read(&heatfil, heatcounts, cylinders * sizeof(uint32_t), &nr);
+            if ((fr == FR_OK) && (nr == cylinders * sizeof(uint32_t))) {
+                printf(" loading the busiest cylinders first, from '%s'\r\n", heatfilename);
+                for (i = 0; i < cylinders; i++)
+                    cylinder_heat[i] = heatcounts[i] / 2;
+            }
+        }
+        f_close(&heatfil);
+    }
+
+    // insertion sort, cylinders with equal counts stay in ascending order
+    for (i = 0; i < dstate->numberOfCylinders; i++) {
+        cylinder = i;
+        for (j = i; (j > 0) && (cylinder_heat[load_order[j - 1]] < cylinder_heat[cylinder]); j--)
+            load_order[j] = load_order[j - 1];
+        load_order[j] = cylinder;
+    }
+}
+
+// write the counts next to the image at unload, only when the 1130 used the cartridge
+int save_cylinder_heat(struct Disk_State* dstate)
+{
+    FRESULT fr;
+    bool fresh;
+    UINT nw;
+    int cylinders = dstate->numberOfCylinders;
+    int touched = 0;
+    int busiest = 0;
+    char heatfilename[FF_LFN_BUF + 1];
+
+    if ((session_accesses == 0) || (cylinders > 256))
+        return(FILE_OPS_OKAY);
+
+    for (int i = 0; i < cylinders; i++) {
+        heatcounts[i] = cylinder_heat[i];
+        touched += (heatcounts[i] != 0);
+        if (heatcounts[i] > heatcounts[busiest])
+            busiest = i;
+    }
+    printf("%d accesses this session, busiest cylinder %d, %d of %d cylinders in use\r\n",
+           (int) session_accesses, busiest, touched, cylinders);
+
+    sibling_file_name(heatfilename, diskimagefilename, ".hot");
+    if ((fr = mount_volume(&fresh)) != FR_OK){
+        printf("*** ERROR, could not mount filesystem to save '%s' (%d)\r\n", heatfilename, fr);
+        force_unmount();
+        return(fr);
+    }
+    if ((fr = f_open(&heatfil, heatfilename, FA_WRITE | FA_CREATE_ALWAYS)) == FR_OK) {
+        fr = f_write(&heatfil, HEAT_MAGIC, 8, &nw);
+        if (fr == FR_OK)
+            fr = f_write(&heatfil, &cylinders, sizeof(cylinders), &nw);
+        if (fr == FR_OK)
+            fr = f_write(&heatfil, heatcounts, cylinders * sizeof(uint32_t), &nw);
+        if (fr == FR_OK)
+            fr = f_close(&heatfil);
+        else
+            f_close(&heatfil);
+    }
+    if (fr != FR_OK)
+        printf("*** ERROR, could not save '%s' (%d)\r\n", heatfilename, fr);
+    unmount_volume();
+    return(fr);
+}
+
+// position the image file at the first sector of a cylinder
+static int seek_cylinder_image_data(struct Disk_State* dstate, int cylindercount)
+{
+    FRESULT fr;
+    FSIZE_t offset = sector_file_offset(dstate, cylindercount, 0, 0);
+
+    // the packed tracks are found and read by read_packed_cylinder()
+    if (direct_image_io() || image_compressed)
+        return(FILE_OPS_OKAY);
+
+    if ((f_tell(&fil) != offset) && ((fr = f_lseek(&fil, offset)) != FR_OK)) {
+        printf("###ERROR, Image data seek error fr=%d\r\n", fr);
+        return(FILE_OPS_ERROR);
+    }
+    return(FILE_OPS_OKAY);
+}
+
+static void start_image_load(struct Disk_State* dstate)
+{
+    printf("Reading disk data from file '%s'\r\n", diskimagefilename);
+    printf("  %s\r\n", dstate->controller);
+    printf(" cylinders=%d, heads=%d, sectors=%d\r\n", dstate->numberOfCylinders, dstate->numberOfHeads, dstate->numberOfSectorsPerTrack);
+    clear_stage_timing();
+    sector_hashes_valid = false;
+    image_crc = 0;
+    image_crc_known = false;
+    image_crc_dirty = false;
+    header_crc_cleared = false;
+    memset(dirty_sector_map, 0, sizeof(dirty_sector_map));
+    load_cylinder_heat(dstate);
+    open_image_overlay(dstate);
+    open_power_fail_journal(dstate);
+}
+
+// check the sectors loaded against the image check in the header, a mismatch fails the load
+static int finish_image_load(struct Disk_State* dstate, uint32_t looptime)
+{
+    int sectors = dstate->numberOfCylinders * dstate->numberOfHeads * (dstate->numberOfSectorsPerTrack/2);
+
+    print_stage_timing(time_us_32() - looptime, sectors);
+    close_image_overlay();
+    if (header_has_crc && (image_crc != header_crc)) {
+        printf("###ERROR, image check %08x of the sectors read is not %08x from the header\r\n",
+               (unsigned int) image_crc, (unsigned int) header_crc);
+        return(FILE_OPS_ERROR);
+    }
+    if (header_has_crc)
+        printf(" image check %08x verified\r\n", (unsigned int) image_crc);
+    image_crc_known = true;
+    sector_hashes_valid = (sectors <= MAX_SECTOR_SLOTS);
+    checkpoint_last_us = time_us_32();
+    // the size of a compressed image is known only once it has been rewritten
+    image_file_size = image_compressed ? 0 : ZERO_MAP_OFFSET + IMAGE_BLOCK_SIZE
+                    + (FSIZE_t) dstate->numberOfCylinders
+                      * ((dstate->numberOfHeads * (dstate->numberOfSectorsPerTrack/2) * 642 + IMAGE_BLOCK_SIZE - 1)
+                         & ~(IMAGE_BLOCK_SIZE - 1));
+    return(FILE_OPS_OKAY);
+}
+
+// read every sector back from the SDRAM and check what it holds against the image check taken as it was loaded
+// the SDRAM read of one sector overlaps the CRC of the previous one
+static int verify_sdram_image(struct Disk_State* dstate)
+{
     int bytecount = 642;
     int sectorcount;
     int headcount;
     int cylindercount;
     int ramaddress;
-    char display_line_2[30];
+    int bufindex = 0;
+    bool pending = false;
+    int fileslot = 0;
+    uint32_t crc = 0;
+    uint32_t looptime = time_us_32();
 
-    printf("Reading disk data from file '%s'\r\n", diskimagefilename);
-    printf("  %s\r\n", dstate->controller);
-    printf(" cylinders=%d, heads=%d, sectors=%d\r\n", dstate->numberOfCylinders, dstate->numberOfHeads, dstate->numberOfSectorsPerTrack);
     for (cylindercount = 0; cylindercount < dstate->numberOfCylinders; cylindercount++){
-        if ((cylindercount % 20) == 0)
-            printf("  cylindercount = %d\r\n", cylindercount);
-            if ((cylindercount % 10) == 0){
-            sprintf(display_line_2," Cyl %d", cylindercount);
-            display_status((char *) "Read card", display_line_2);
-        }
+        xfer_progress_cylinder = cylindercount;
         for (headcount = 0; headcount < dstate->numberOfHeads; headcount++){
-            for( sectorcount = 0; sectorcount < (dstate->numberOfSectorsPerTrack)/2; sectorcount++){
+            for( sectorcount = 0; sectorcount < (dstate->numberOfSectorsPerTrack/2); sectorcount++){
                 ramaddress = (cylindercount << 12) | (headcount << 11) | (sectorcount << 9);
-                load_ram_address(ramaddress);
-    
-                fr = f_read(&fil, sectordata, bytecount, &nr);
-                if (fr != FR_OK || nr != bytecount) {
-                    printf("###ERROR, Image data read error fr=%d, nr=%u\r\n", fr, nr);
+                if (pending)
+                    finish_dram_block_transfer();
+                start_dram_block_read(ramaddress, cylinderdata[bufindex], bytecount);
+                if (pending)
+                    crc ^= sector_crc(fileslot - 1, cylinderdata[bufindex ^ 1], bytecount);
+                pending = true;
+                bufindex ^= 1;
+                fileslot++;
+            }
+        }
+    }
+    if (pending) {
+        finish_dram_block_transfer();
+        crc ^= sector_crc(fileslot - 1, cylinderdata[bufindex ^ 1], bytecount);
+    }
+    if (crc != (image_crc ^ delta_crc)) {
+        printf("###ERROR, SDRAM read back check %08x is not %08x as loaded\r\n", (unsigned int) crc, (unsigned int) (image_crc ^ delta_crc));
+        return(FILE_OPS_ERROR);
+    }
+    printf(" SDRAM read back verified in %d ms\r\n", (int) ((time_us_32() - looptime) / 1000));
+    return(FILE_OPS_OKAY);
+}
+
+int read_disk_image_data(struct Disk_State* dstate)
+{
+    int cylindercount;
+    int loadedcount;
+    int bufindex = 0;
+    bool pending = false;
+    uint32_t looptime = time_us_32();
+
+    start_image_load(dstate);
+    for (loadedcount = 0; loadedcount < dstate->numberOfCylinders; loadedcount++){
+        if ((loadedcount % 20) == 0)
+            printf("  cylindercount = %d\r\n", loadedcount);
+        xfer_progress_cylinder = loadedcount;
+        cylindercount = load_order[loadedcount];
+        if (seek_cylinder_image_data(dstate, cylindercount) != FILE_OPS_OKAY) {
+            if (pending)
+                finish_dram_block_transfer();
+            return(FILE_OPS_ERROR);
+        }
+        if (read_cylinder_image_data(dstate, cylindercount, &bufindex, &pending) != FILE_OPS_OKAY)
+            return(FILE_OPS_ERROR);
+    }
+    if (pending)
+        finish_fpga_stage();
+    if (finish_image_load(dstate, looptime) != FILE_OPS_OKAY)
+        return(FILE_OPS_ERROR);
+
+    // the SDRAM read back check is chosen from the console
+    if (dstate->verify_load)
+        return(verify_sdram_image(dstate));
+    return(FILE_OPS_OKAY);
+}
+
+// load the image on demand. Cylinder 0 goes first so the cartridge can be made ready, then the rest
+// busiest first, except that a cylinder the 1130 has sought to is loaded next. The FPGA holds Access Ready
+// low on a cylinder until it is marked loaded, which is done only once its last sector is in the SDRAM.
+static int demand_load_disk_image_data(struct Disk_State* dstate)
+{
+    static bool loaded[256];
+    int cylindercount;
+    int loadedcount;
+    int orderindex = 0;
+    int bufindex = 0;
+    bool pending = false;
+    uint32_t looptime = time_us_32();
+
+    start_image_load(dstate);
+    printf(" loading on demand\r\n");
+    memset(loaded, 0, sizeof(loaded));
+    set_demand_loading(true);
+    for (loadedcount = 0; loadedcount < dstate->numberOfCylinders; loadedcount++){
+        cylindercount = (loadedcount == 0) ? 0 : read_cylinder_address();
+        if ((cylindercount >= dstate->numberOfCylinders) || loaded[cylindercount]) {
+            while (loaded[load_order[orderindex]])
+                orderindex++;
+            cylindercount = load_order[orderindex];
+        }
+        else if (loadedcount != 0) {
+            printf("  1130 is on cylinder %d, loading it next\r\n", cylindercount);
+        }
+
+        if (seek_cylinder_image_data(dstate, cylindercount) != FILE_OPS_OKAY)
+            return(FILE_OPS_ERROR);
+        xfer_progress_cylinder = loadedcount;
+        if (read_cylinder_image_data(dstate, cylindercount, &bufindex, &pending) != FILE_OPS_OKAY)
+            return(FILE_OPS_ERROR);
+        if (pending)
+            finish_fpga_stage();
+        pending = false;
+
+        mark_cylinder_loaded(cylindercount);
+        loaded[cylindercount] = true;
+        if (loadedcount == 0)
+            xfer_early_ready = true;
+    }
+    set_demand_loading(false);
+    return(finish_image_load(dstate, looptime));
+}
+
+// the dirty sector map can be used for this geometry
+static bool dirty_sector_map_fits(struct Disk_State* dstate)
+{
+    return(has_dirty_sector_map() && (dstate->numberOfCylinders <= 256) && (dstate->numberOfHeads <= 2)
+           && ((dstate->numberOfSectorsPerTrack / 2) <= 4));
+}
+
+// add the sectors marked in the FPGA since it was last read, which clears them there
+// a write back that fails leaves its sectors in the map for the next try
+static void merge_dirty_sector_map(struct Disk_State* dstate)
+{
+    uint8_t map[256];
+
+    read_dirty_sector_map(map, dstate->numberOfCylinders);
+    for (int i = 0; i < dstate->numberOfCylinders; i++)
+        dirty_sector_map[i] |= map[i];
+}
+
+// write back to the overlay while it is small enough and changes can be found sector by sector, otherwise
+// rewrite the image whole with the overlay folded in, which is also how an overlay goes once the mode is off
+static void choose_overlay_write_back(struct Disk_State* dstate, int dirtycount)
+{
+    overlay_write_back = false;
+    compact_overlay = false;
+    if (!overlay_active)
+        return;
+    if (dstate->overlay_mode && (dirty_sector_map_fits(dstate) || sector_hashes_valid)
+        && ((delta_end + (FSIZE_t) dirtycount * OVERLAY_ENTRY_SIZE) < OVERLAY_COMPACT_BYTES)) {
+        overlay_write_back = true;
+        incremental_write_back = true;
+        return;
+    }
+    incremental_write_back = false;
+    compact_overlay = (delta_end != 0);
+    if (compact_overlay)
+        printf("Folding the %d sectors of the overlay into the image\r\n", delta_sectors);
+}
+
+// the unload rewrites the image to fold its overlay in, even if the 1130 wrote nothing
+bool overlay_fold_pending()
+{
+    return(compact_overlay);
+}
+
+// fetch the dirty sector map from the FPGA and choose between a full and an incremental write back
+// returns the number of sector slots the 1130 wrote, or -1 if they are not known yet
+// Sectors a checkpoint has not written back yet stay in the map, the FPGA map is added to them.
+// Without the FPGA map the sector hashes from load time are compared as the data is written back,
+// and only if neither is available is the whole image rewritten.
+int fetch_dirty_sector_map(struct Disk_State* dstate)
+{
+    int dirtycount = 0;
+    int cylindercount;
+    int headcount;
+    int sectorcount;
+
+    incremental_write_back = false;
+    use_sector_hashes = false;
+    if (!dirty_sector_map_fits(dstate)) {
+        if (sector_hashes_valid && (image_zero_map || overlay_active)) {
+            printf("Changed sectors will be found by comparing sector hashes\r\n");
+            incremental_write_back = true;
+            use_sector_hashes = true;
+        }
+        choose_overlay_write_back(dstate, 0);
+        return(-1);
+    }
+
+    merge_dirty_sector_map(dstate);
+    for (cylindercount = 0; cylindercount < dstate->numberOfCylinders; cylindercount++){
+        for (headcount = 0; headcount < dstate->numberOfHeads; headcount++){
+            for( sectorcount = 0; sectorcount < (dstate->numberOfSectorsPerTrack/2); sectorcount++){
+                if (dirty_sector_map[cylindercount] & (1 << ((headcount << 2) | sectorcount)))
+                    dirtycount++;
+            }
+        }
+    }
+    printf("%d sectors were written since the image was loaded\r\n", dirtycount);
+
+    // an older image that was changed is rewritten whole, which converts it to version 2.1
+    // a compressed image is rewritten whole and stays compressed
+    incremental_write_back = image_zero_map;
+    choose_overlay_write_back(dstate, dirtycount);
+    if (overlay_write_back || (dirtycount == 0))
+        return(dirtycount);
+    if (image_compressed)
+        printf("Image is compressed, rewriting it whole\r\n");
+    else if (!image_zero_map)
+        printf("Image is version %s, rewriting it as version %s\r\n", image_version_name(), versionNumber);
+    return(dirtycount);
+}
+
+// rewrite only the sectors marked in the dirty sector map, in place in the existing file
+static int write_dirty_disk_image_data(struct Disk_State* dstate)
+{
+    int slots = dstate->numberOfHeads * (dstate->numberOfSectorsPerTrack/2);
+    int cylindercount;
+    uint8_t slotbits;
+    int sectors = 0;
+    uint32_t looptime = time_us_32();
+
+    printf("Writing changed sectors to file '%s':\r\n", diskimagefilename);
+    memset(pending_slots, 0, sizeof(pending_slots));
+    for (cylindercount = 0; cylindercount < dstate->numberOfCylinders; cylindercount++){
+        slotbits = dirty_slot_bits(dstate, dirty_sector_map[cylindercount]);
+        for (int i = 0; i < slots; i++){
+            if (slotbits & (1 << i))
+                pending_slots[(cylindercount * slots + i) >> 3] |= (uint8_t) (1 << ((cylindercount * slots + i) & 7));
+        }
+    }
+    if (write_pending_sectors(dstate, &sectors) != FILE_OPS_OKAY)
+        return(FILE_OPS_ERROR);
+    printf(" %d changed sectors written in %d ms, %d writes of %d KB\r\n", sectors,
+        (int) ((time_us_32() - looptime) / 1000), extent_count, (int) ((extent_bytes + 1023) / 1024));
+    return(FILE_OPS_OKAY);
+}
+
+// *************** background checkpoint ***************
+// While the cartridge is running the sectors the 1130 wrote are copied from the SDRAM to the image file,
+// so that at most checkpoint_interval seconds of writes are lost if the emulator dies before the unload.
+// Called from the running state on every tick, each call writes the dirty sectors of no more than
+// CHECKPOINT_CYLINDERS_PER_CALL cylinders, each as one extent, so the switches and display stay responsive. The FPGA
+// serves the 1130 ahead of these SDRAM reads, and a sector the 1130 writes again after it was copied is marked again
+// and copied on the next pass.
+// Needs FPGA version 2.15 and the dirty sector map, otherwise everything is written back at unload.
+//
+int checkpoint_disk_image(struct Disk_State* dstate)
+{
+    FRESULT fr;
+    bool fresh;
+    int cylinders = 0;
+    int dirtycylinders = 0;
+
+    if (!checkpoint_open) {
+        // the image file is still open for a demand load
+        if (xfer_busy)
+            return(FILE_OPS_OKAY);
+        if ((dstate->checkpoint_interval == 0) || !has_background_sdram_access() || !dirty_sector_map_fits(dstate))
+            return(FILE_OPS_OKAY);
+        // sectors cannot be written in place in a compressed image, they can be added to an overlay
+        // an overlay that is to be folded in at unload is not added to, nor is the image written under it
+        if (overlay_active ? !dstate->overlay_mode : image_compressed)
+            return(FILE_OPS_OKAY);
+        if ((time_us_32() - checkpoint_last_us) < ((uint32_t) dstate->checkpoint_interval * 1000000u))
+            return(FILE_OPS_OKAY);
+
+        checkpoint_last_us = time_us_32();
+        merge_dirty_sector_map(dstate);
+        for (int i = 0; i < dstate->numberOfCylinders; i++)
+            dirtycylinders += (dirty_sector_map[i] != 0);
+        if (dirtycylinders == 0)
+            return(FILE_OPS_OKAY);
+
+        if ((fr = mount_volume(&fresh)) != FR_OK){
+            printf("*** ERROR, could not mount filesystem for checkpoint (%d)\r\n", fr);
+            force_unmount();
+            return(fr);
+        }
+        if (overlay_active) {
+            if ((fr = open_overlay_for_append()) != FR_OK) {
+                printf("*** ERROR, could not open the overlay for checkpoint (%d)\r\n", fr);
+                f_close(&fil);
+                writing_overlay = false;
+                force_unmount();
+                return(fr);
+            }
+        }
+        else if ((fr = f_open(&fil, diskimagefilename, FA_READ | FA_WRITE | FA_OPEN_EXISTING)) != FR_OK){
+            printf("*** ERROR, could not open disk image file for checkpoint (%d)\r\n", fr);
+            force_unmount();
+            return(fr);
+        }
+        else
+            build_image_link_map();
+        checkpoint_open = true;
+        checkpoint_cylinder = 0;
+        checkpoint_sectors = 0;
+    }
+
+    for (; checkpoint_cylinder < dstate->numberOfCylinders; checkpoint_cylinder++){
+        if (dirty_sector_map[checkpoint_cylinder] == 0)
+            continue;
+        if (cylinders == CHECKPOINT_CYLINDERS_PER_CALL)
+            return(FILE_OPS_OKAY);
+
+        if (write_cylinder_extent(dstate, checkpoint_cylinder, dirty_slot_bits(dstate, dirty_sector_map[checkpoint_cylinder]),
+                                  &checkpoint_sectors) != FILE_OPS_OKAY) {
+            // the sectors stay marked and are written at the next checkpoint or at unload
+            printf("###ERROR, checkpoint write failed\r\n");
+            finish_checkpoint();
+            return(FILE_OPS_ERROR);
+        }
+        dirty_sector_map[checkpoint_cylinder] = 0;
+        cylinders++;
+    }
+
+    printf("Checkpoint wrote %d changed sectors to file '%s'\r\n", checkpoint_sectors, diskimagefilename);
+    finish_checkpoint();
+    // the sectors replayed from the power fail journal were dirty and have been written with the rest
+    retire_power_fail_journal();
+    return(FILE_OPS_OKAY);
+}
+
+// close the image file of a checkpoint pass, the sectors it did not get to stay in the dirty sector map
+void finish_checkpoint()
+{
+    if (!checkpoint_open)
+        return;
+    checkpoint_open = false;
+    checkpoint_last_us = time_us_32();
+    file_close_disk_image();
+}
+
+// *************** emergency flush ***************
+// On a power fail the sectors the 1130 changed are added to the power fail journal, busiest cylinders first, in
+// whole blocks straight to the card so nothing but the data is written while the supply holds up. A flush that
+// follows one that was not written back yet goes after its entries with the same stamp. Returns FILE_OPS_OKAY
+// only if every changed sector is in the journal, otherwise the image has to be written back as usual.
+// The flush is started by RLST9/RLST10 on the pass of the state machine after the power fail edge, not by the edge
+// itself, as the card may be in the middle of a FatFs call on this core that cannot be cut into. A power fail while
+// a checkpoint cylinder or another card operation runs waits for it to end, and one while core1 owns the card for a
+// load or demand load (xfer_busy) is refused and falls back to the write back once the transfer is done.
+//
+int emergency_flush_disk_image(struct Disk_State* dstate)
+{
+    static uint8_t order[256];
+    uint8_t *stage = cylinderdata[0];
+    int trackslots = dstate->numberOfSectorsPerTrack/2;
+    int dirty = 0;
+    int first;
+    int planned;
+    int written = 0;
+    int budget;
+    int blocks;
+    int cylinder;
+    int headcount;
+    int sectorcount;
+    int fileslot;
+    int i;
+    int j;
+    uint8_t bits;
+    UINT pos;
+    LBA_t lba;
+    FSIZE_t offset;
+    uint32_t edge_us = last_power_fail_us();
+    uint32_t starttime = time_us_32();
+
+    if (!journal_ready || xfer_busy || (journal_card_changes != card_change_count()) || !dirty_sector_map_fits(dstate)) {
+        printf("###ERROR, there is no power fail journal to flush the changed sectors to\r\n");
+        return(FILE_OPS_ERROR);
+    }
+    // a checkpoint pass is closed first so the image and the image check in its header agree
+    finish_checkpoint();
+    merge_dirty_sector_map(dstate);
+
+    // busiest cylinders first, what the hold-up does not cover is what the 1130 used least
+    for (i = 0; i < dstate->numberOfCylinders; i++) {
+        for (j = i; (j > 0) && (cylinder_heat[order[j - 1]] < cylinder_heat[i]); j--)
+            order[j] = order[j - 1];
+        order[j] = (uint8_t) i;
+        for (bits = dirty_sector_map[i]; bits != 0; bits &= bits - 1)
+            dirty++;
+    }
+    if (dirty == 0)
+        return(FILE_OPS_OKAY);
+
+    if (journal_sectors == 0) {
+        journal_stamp = (journal_stamp + 1) & 0xFFFF;
+        journal_planned = 0;
+    }
+    first = journal_planned;
+    planned = (first + dirty < JOURNAL_ENTRIES) ? first + dirty : JOURNAL_ENTRIES;
+    budget = power_fail_budget();
+    journal_flush_first = first;
+    journal_planned = planned;
+    if (write_journal_header() != RES_OK) {
+        printf("###ERROR, power fail journal header write error\r\n");
+        return(FILE_OPS_ERROR);
+    }
+
+    // the block the entries before this flush end in is read so the new ones go on after them
+    offset = FF_MAX_SS + (FSIZE_t) first * OVERLAY_ENTRY_SIZE;
+    lba = journal_lba + (LBA_t) (offset / FF_MAX_SS);
+    pos = (UINT) (offset % FF_MAX_SS);
+    if ((pos != 0) && (disk_read(fs.pdrv, stage, lba, 1) != RES_OK)) {
+        printf("###ERROR, power fail journal read error\r\n");
+        return(FILE_OPS_ERROR);
+    }
+    for (i = 0; (i < dstate->numberOfCylinders) && (first + written < planned); i++) {
+        cylinder = order[i];
+        for (headcount = 0; headcount < dstate->numberOfHeads; headcount++){
+            for( sectorcount = 0; sectorcount < trackslots; sectorcount++){
+                if (!(dirty_sector_map[cylinder] & (1 << ((headcount << 2) | sectorcount))) || (first + written == planned))
+                    continue;
+                fileslot = (cylinder * dstate->numberOfHeads + headcount) * trackslots + sectorcount;
+                read_dram_block((cylinder << 12) | (headcount << 11) | (sectorcount << 9), &stage[pos + 4], 642);
+                stage[pos + 0] = (journal_stamp >> 8) & 0xFF;
+                stage[pos + 1] = journal_stamp & 0xFF;
+                stage[pos + 2] = (fileslot >> 8) & 0xFF;
+                stage[pos + 3] = fileslot & 0xFF;
+                put_offset(&stage[pos + 4 + 642], overlay_entry_crc(journal_stamp, fileslot, &stage[pos + 4]));
+                pos += OVERLAY_ENTRY_SIZE;
+                written++;
+                if ((pos + OVERLAY_ENTRY_SIZE <= CYLINDER_BUFFER_SIZE) && (first + written < planned))
+                    continue;
+
+                // the whole blocks go to the card once the next entry does not fit, the last one is padded
+                blocks = (first + written < planned) ? pos / FF_MAX_SS : (pos + FF_MAX_SS - 1) / FF_MAX_SS;
+                if ((UINT) blocks * FF_MAX_SS > pos)
+                    memset(&stage[pos], 0, blocks * FF_MAX_SS - pos);
+                if (disk_write(fs.pdrv, stage, lba, blocks) != RES_OK) {
+                    printf("###ERROR, power fail journal write error after %d sectors\r\n", written);
                     return(FILE_OPS_ERROR);
                 }
+                lba += blocks;
+                pos = (pos > (UINT) blocks * FF_MAX_SS) ? pos - blocks * FF_MAX_SS : 0;
+                memmove(stage, &stage[blocks * FF_MAX_SS], pos);
+                journal_sectors = first + written;
+            }
+        }
+    }
 
-                // gpio_put(22, 1); // for debugging to time the loop
-                bp = sectordata;
-                for (int i = 0; i < bytecount; i++){
-                    storebyte(*bp++);
-                }
-                // gpio_put(22, 0); // for debugging to time the loop
+    printf("%d of %d changed sectors written to the power fail journal in %d ms\r\n",
+           written, dirty, (int) ((time_us_32() - starttime) / 1000));
+    if ((time_us_32() - edge_us) < 1000000)
+        printf(" the flush ended %d ms after the power fail edge\r\n", (int) ((time_us_32() - edge_us) / 1000));
+    if (budget == 0)
+        printf(" the hold-up budget is not measured yet\r\n");
+    else if (written > budget)
+        printf(" %d sectors were past the hold-up budget of %d sectors\r\n", written - budget, budget);
+    else
+        printf(" within the hold-up budget of %d sectors\r\n", budget);
+    if (written != dirty)
+        return(FILE_OPS_ERROR);
+    measure_power_holdup(starttime);
+    return(FILE_OPS_OKAY);
+}
+
+// hash a sector read back from the SDRAM and mark it to be written if it differs from load time
+static void mark_sector_if_changed(int fileslot, const uint8_t *buf, int bytecount, int *changed)
+{
+    if (sector_crc(fileslot, buf, bytecount) == sector_hashes[fileslot])
+        return;
+    pending_slots[fileslot >> 3] |= (uint8_t) (1 << (fileslot & 7));
+    (*changed)++;
+}
+
+// read back every sector from the SDRAM, hashing each while the next is read, then rewrite in place only those
+// whose hash changed
+static int write_changed_disk_image_data(struct Disk_State* dstate)
+{
+    int bytecount = 642;
+    int sectorcount;
+    int headcount;
+    int cylindercount;
+    int ramaddress;
+    int bufindex = 0;
+    bool pending = false;
+    int fileslot = 0;
+    int changed = 0;
+    int written = 0;
+    uint32_t starttime;
+    uint32_t looptime = time_us_32();
+
+    printf("Writing changed sectors to file '%s' by hash:\r\n", diskimagefilename);
+    memset(pending_slots, 0, sizeof(pending_slots));
+    clear_stage_timing();
+    for (cylindercount = 0; cylindercount < dstate->numberOfCylinders; cylindercount++){
+        xfer_progress_cylinder = cylindercount;
+        for (headcount = 0; headcount < dstate->numberOfHeads; headcount++){
+            for( sectorcount = 0; sectorcount < (dstate->numberOfSectorsPerTrack/2); sectorcount++){
+                ramaddress = (cylindercount << 12) | (headcount << 11) | (sectorcount << 9);
+
+                if (pending)
+                    finish_fpga_stage();
+                starttime = time_us_32();
+                start_dram_block_read(ramaddress, cylinderdata[bufindex], bytecount);
+                fpga_stage_us += time_us_32() - starttime;
+
+                if (pending)
+                    mark_sector_if_changed(fileslot - 1, cylinderdata[bufindex ^ 1], bytecount, &changed);
+                pending = true;
+                bufindex ^= 1;
+                fileslot++;
             }
         }
     }
+    if (pending) {
+        finish_fpga_stage();
+        mark_sector_if_changed(fileslot - 1, cylinderdata[bufindex ^ 1], bytecount, &changed);
+    }
+    print_stage_timing(time_us_32() - looptime, fileslot);
+
+    looptime = time_us_32();
+    if (write_pending_sectors(dstate, &written) != FILE_OPS_OKAY)
+        return(FILE_OPS_ERROR);
+    printf(" %d changed sectors written in %d ms, %d writes of %d KB\r\n", written,
+        (int) ((time_us_32() - looptime) / 1000), extent_count, (int) ((extent_bytes + 1023) / 1024));
+    return(FILE_OPS_OKAY);
+}
+
+// write one cylinder with its padding into the file being rewritten, straight to the card if it is contiguous
+// its sectors are added to the image check, its zero sectors are marked in the zero sector map,
+// and a cylinder of nothing but zeros is skipped
+static FRESULT write_image_cylinder(struct Disk_State* dstate, int cylindercount, const uint8_t *buf, UINT bytecount, UINT *nw)
+{
+    FRESULT fr;
+    FSIZE_t offset = image_data_offset + (FSIZE_t) cylindercount * cylinder_stride;
+    int slots = dstate->numberOfHeads * (dstate->numberOfSectorsPerTrack/2);
+    uint8_t zerobits = 0;
+    uint32_t crc;
+
+    for (int i = 0; i < slots; i++){
+        crc = sector_crc(cylindercount * slots + i, buf + i * 642, 642);
+        image_crc ^= crc;
+        written_crcs[i] = crc;
+        if (cylindercount * slots + i < MAX_SECTOR_SLOTS)
+            sector_hashes[cylindercount * slots + i] = crc;
+    }
+
+    if (image_compressed) {
+        *nw = bytecount;
+        return(write_packed_cylinder(dstate, cylindercount, buf));
+    }
+
+    if (cylindercount < (int) sizeof(zero_sector_map)) {
+        for (int i = 0; i < slots; i++){
+            if (sector_is_zero(buf + i * 642))
+                zerobits |= (uint8_t) (1 << i);
+        }
+        zero_sector_map[cylindercount] = zerobits;
+    }
+
+    *nw = bytecount;
+    if ((cylindercount < (int) sizeof(zero_sector_map)) && (zerobits == zero_map_cylinder_mask(dstate)))
+        return(FR_OK);
+    if (!direct_image_io()) {
+        if ((f_tell(&fil) != offset) && ((fr = f_lseek(&fil, offset)) != FR_OK))
+            return(fr);
+        return(f_write(&fil, buf, bytecount, nw));
+    }
+
+    if (disk_write(fs.pdrv, buf, cylinder_lba(cylindercount), bytecount / FF_MAX_SS) != RES_OK)
+        return(FR_DISK_ERR);
+    return(FR_OK);
+}
+
+// read one track of a cylinder back into its buffer after the cylinder was written and compare each of its sectors
+// with the CRC taken as it came out of the SDRAM. The tracks are read back one at a time, head 0 first, while the
+// sectors of the next cylinder stream out of the SDRAM on spi0, which does not wait for the card on spi1. The buffer
+// is free until the cylinder after next comes out of the SDRAM into it.
+// the sectors that do not match are all reported and fail the rewrite at the end, only a read error stops it
+static int verify_image_track(struct Disk_State* dstate, int cylindercount, int head, uint8_t *buf, UINT bytecount)
+{
+    static FSIZE_t position;             // where the file was left by the write of the cylinder
+    static UINT readback;                // bytes of the cylinder read back so far, in whole blocks
+    FRESULT fr = FR_OK;
+    UINT nr = 0;
+    UINT end;
+    int trackslots = dstate->numberOfSectorsPerTrack/2;
+    int slots = dstate->numberOfHeads * trackslots;
+    uint32_t starttime = time_us_32();
+
+    // a cylinder of zeros was not written, the zero sector map stands for it
+    if (!image_compressed && (cylindercount < (int) sizeof(zero_sector_map))
+        && (zero_sector_map[cylindercount] == zero_map_cylinder_mask(dstate)))
+        return(FILE_OPS_OKAY);
+
+    if (head == 0) {
+        position = f_tell(&fil);
+        readback = 0;
+        // the end of the last track is only set by the next cylinder, it is where the file is now
+        if (image_compressed)
+            track_offsets[(cylindercount + 1) * dstate->numberOfHeads] = (uint32_t) position;
+    }
+    if (image_compressed) {
+        nr = track_offsets[cylindercount * dstate->numberOfHeads + head + 1] - track_offsets[cylindercount * dstate->numberOfHeads + head];
+        fr = read_packed_track(dstate, cylindercount, head, buf);
+    }
+    else {
+        // the blocks up to the end of this track, the last track takes the padding with it
+        end = (head == dstate->numberOfHeads - 1) ? bytecount
+            : ((UINT) ((head + 1) * trackslots * 642) + FF_MAX_SS - 1) / FF_MAX_SS * FF_MAX_SS;
+        nr = end - readback;
+        if (nr == 0)
+            fr = FR_OK;
+        else if (direct_image_io())
+            fr = (disk_read(fs.pdrv, buf + readback, cylinder_lba(cylindercount) + readback / FF_MAX_SS, nr / FF_MAX_SS) == RES_OK) ? FR_OK : FR_DISK_ERR;
+        else
+            fr = read_back_image_blocks(image_data_offset + (FSIZE_t) cylindercount * cylinder_stride + readback, buf + readback, nr);
+        readback = end;
+    }
+    if ((fr == FR_OK) && !direct_image_io() && (f_tell(&fil) != position))
+        fr = f_lseek(&fil, position);
+    if (fr != FR_OK) {
+        printf("###ERROR, Track %d/%d read back error fr=%d\r\n", cylindercount, head, fr);
+        return(FILE_OPS_ERROR);
+    }
 
+    verify_bytes += nr;
+    for (int i = head * trackslots; i < (head + 1) * trackslots; i++){
+        if (sector_crc(cylindercount * slots + i, buf + i * 642, 642) != written_crcs[i]) {
+            verify_mismatches++;
+            printf("###ERROR, Image sector %d/%d/%d did not read back as written\r\n",
+                cylindercount, i / trackslots, i % trackslots);
+        }
+    }
+    verify_us += time_us_32() - starttime;
     return(FILE_OPS_OKAY);
 }
 
+// report the read back check of a write back, one that read back sectors different from what was written fails
+static int finish_write_verify(struct Disk_State* dstate, int rc)
+{
+    if (!dstate->verify_write_back)
+        return(rc);
+    printf(" read back %d KB in %d ms, %d KB/s, %d sectors did not match\r\n", (int) (verify_bytes / 1024),
+        (int) (verify_us / 1000), (int) ((uint64_t) verify_bytes * 1000000 / 1024 / (verify_us + 1)), verify_mismatches);
+    if (verify_mismatches != 0)
+        return(FILE_OPS_ERROR);
+    return(rc);
+}
+
 int write_disk_image_data(struct Disk_State* dstate)
 {
     FRESULT fr;
     UINT nw;
-    uint8_t *bp;
     int bytecount = 642;
     int sectorcount;
     int headcount;
     int cylindercount;
     int ramaddress;
-    char display_line_2[30];
+    int bufindex = 0;
+    bool pending = false;
+    int sectors = 0;
+    int verifyhead = dstate->numberOfHeads;   // next track of the previous cylinder to read back
+    uint8_t *sectorbuf;
+    UINT writebytes;
+    uint32_t starttime;
+    uint32_t looptime = time_us_32();
+
+    verify_us = 0;
+    verify_bytes = 0;
+    verify_mismatches = 0;
+    if (incremental_write_back && use_sector_hashes)
+        return(finish_write_verify(dstate, write_changed_disk_image_data(dstate)));
+    if (incremental_write_back)
+        return(finish_write_verify(dstate, write_dirty_disk_image_data(dstate)));
 
     printf("Writing disk image data to file '%s':\r\n", diskimagefilename);
     printf(" cylinders=%d, heads=%d, sectors=%d\r\n", dstate->numberOfCylinders, dstate->numberOfHeads, dstate->numberOfSectorsPerTrack);
+    clear_stage_timing();
+
+    // each cylinder is written with its padding in one f_write(), the padding at the end of the buffers stays zero
+    // the image check is taken again from the sectors as they go past
+    memset(zero_sector_map, 0, sizeof(zero_sector_map));
+    image_crc = 0;
+    writebytes = (UINT) cylinder_stride;
+    memset(cylinderdata[0] + cylinder_bytes(dstate), 0, writebytes - cylinder_bytes(dstate));
+    memset(cylinderdata[1] + cylinder_bytes(dstate), 0, writebytes - cylinder_bytes(dstate));
     for (cylindercount = 0; cylindercount < dstate->numberOfCylinders; cylindercount++){
         if ((cylindercount % 20) == 0)
             printf("  cylindercount = %d\r\n", cylindercount);
-        if ((cylindercount % 10) == 0){
-            sprintf(display_line_2,"Cyl %d", cylindercount);
-            display_status((char *) "Write card", display_line_2);
-        }
+        xfer_progress_cylinder = cylindercount;
+        sectorbuf = cylinderdata[bufindex];
         for (headcount = 0; headcount < dstate->numberOfHeads; headcount++){
             for( sectorcount = 0; sectorcount < (dstate->numberOfSectorsPerTrack/2); sectorcount++){
                 ramaddress = (cylindercount << 12) | (headcount << 11) | (sectorcount << 9);
-                 load_ram_address(ramaddress);
 
-                //gpio_put(22, 1); // for debugging to time the loop
-                bp = sectordata;
-                for (int i = 0; i < bytecount; i++){
-                    *bp++ = readbyte();
-                 }
+                if (pending)
+                    finish_fpga_stage();
+                starttime = time_us_32();
+                start_dram_block_read(ramaddress, sectorbuf, bytecount);
+                fpga_stage_us += time_us_32() - starttime;
+                pending = true;
+                sectorbuf += bytecount;
+                sectors++;
 
-                fr = f_write(&fil, sectordata, bytecount, &nw);
-                if (fr != FR_OK || nw != bytecount) {
-                    printf("###ERROR, Image data write error fr=%d, nw=%u\r\n", fr, nw);
-                    return(FILE_OPS_ERROR);
+                // the previous cylinder is written to the card while the first sector of this one streams out of the SDRAM
+                if ((headcount == 0) && (sectorcount == 0) && (cylindercount != 0)) {
+                    starttime = time_us_32();
+                    fr = write_image_cylinder(dstate, cylindercount - 1, cylinderdata[bufindex ^ 1], writebytes, &nw);
+                    sd_stage_us += time_us_32() - starttime;
+                    if (fr != FR_OK || nw != writebytes) {
+                        finish_dram_block_transfer();
+                        printf("###ERROR, Image data write error fr=%d, nw=%u\r\n", fr, nw);
+                        return(FILE_OPS_ERROR);
+                    }
+                    verifyhead = dstate->verify_write_back ? 0 : dstate->numberOfHeads;
+                }
+                // and read back a track of it while each of the next sectors of this one streams out of the SDRAM
+                else if (verifyhead < dstate->numberOfHeads) {
+                    if (verify_image_track(dstate, cylindercount - 1, verifyhead, cylinderdata[bufindex ^ 1], writebytes) != FILE_OPS_OKAY) {
+                        finish_dram_block_transfer();
+                        return(FILE_OPS_ERROR);
+                    }
+                    verifyhead++;
                 }
-            
             }
         }
+        // the tracks not read back yet are done before the buffer takes the next cylinder
+        for (; verifyhead < dstate->numberOfHeads; verifyhead++) {
+            if (verify_image_track(dstate, cylindercount - 1, verifyhead, cylinderdata[bufindex ^ 1], writebytes) != FILE_OPS_OKAY) {
+                finish_dram_block_transfer();
+                return(FILE_OPS_ERROR);
+            }
+        }
+        bufindex ^= 1;
+    }
+    if (pending) {
+        finish_fpga_stage();
+        starttime = time_us_32();
+        fr = write_image_cylinder(dstate, cylindercount - 1, cylinderdata[bufindex ^ 1], writebytes, &nw);
+        sd_stage_us += time_us_32() - starttime;
+        if (fr != FR_OK || nw != writebytes) {
+            printf("###ERROR, Image data write error fr=%d, nw=%u\r\n", fr, nw);
+            return(FILE_OPS_ERROR);
+        }
+        // nothing is left to stream out of the SDRAM, the last cylinder is read back on its own
+        for (verifyhead = 0; dstate->verify_write_back && (verifyhead < dstate->numberOfHeads); verifyhead++) {
+            if (verify_image_track(dstate, cylindercount - 1, verifyhead, cylinderdata[bufindex ^ 1], writebytes) != FILE_OPS_OKAY)
+                return(FILE_OPS_ERROR);
+        }
+    }
+
+    // the zero sector map or the track table goes after the header, then the file position has to show the whole
+    // image was written, FatFs did not see the blocks written directly or the cylinders of zeros that were skipped
+    if (image_compressed && ((fr = write_track_table(dstate)) != FR_OK)) {
+        printf("###ERROR, Track table write error fr=%d\r\n", fr);
+        return(FILE_OPS_ERROR);
+    }
+    if (!image_compressed && ((fr = write_zero_sector_map()) != FR_OK)) {
+        printf("###ERROR, Zero sector map write error fr=%d\r\n", fr);
+        return(FILE_OPS_ERROR);
+    }
+    image_crc_known = true;
+    if ((fr = write_header_crc()) != FR_OK) {
+        printf("###ERROR, Image check write error fr=%d\r\n", fr);
+        return(FILE_OPS_ERROR);
+    }
+    printf(" image check %08x\r\n", (unsigned int) image_crc);
+    if ((fr = f_lseek(&fil, image_file_size)) != FR_OK) {
+        printf("###ERROR, Image data seek error fr=%d\r\n", fr);
+        return(FILE_OPS_ERROR);
+    }
+    print_stage_timing(time_us_32() - looptime, sectors);
+    return(finish_write_verify(dstate, FILE_OPS_OKAY));
+}
+
+// *************** image transfer engine on core1 ***************
+// The bulk load and unload of the image data runs on core1 so that core0 keeps the rocker switches,
+// power fail input, display timers and console live during the many seconds it takes.
+// core1 must not touch the display, core0 shows the progress from get_image_transfer_progress().
+//
+static void image_transfer_engine()
+{
+    uint32_t command;
+    int result;
+
+    while (true) {
+        command = multicore_fifo_pop_blocking();
+        if (command == IMAGE_XFER_LOAD)
+            result = read_disk_image_data(xfer_dstate);
+        else if (command == IMAGE_XFER_DEMAND_LOAD)
+            result = demand_load_disk_image_data(xfer_dstate);
+        else if (command == IMAGE_XFER_UNLOAD)
+            result = write_disk_image_data(xfer_dstate);
+        else
+            result = FILE_OPS_ERROR;
+        multicore_fifo_push_blocking(result);
     }
-    return(FILE_OPS_OKAY);
 }
 
+void start_image_transfer_engine()
+{
+    xfer_busy = false;
+    make_crc_table();
+    multicore_launch_core1(image_transfer_engine);
+}
+
+// hand a load or unload of the open image file to core1
+void request_image_transfer(int command, Disk_State* dstate)
+{
+    xfer_dstate = dstate;
+    xfer_progress_cylinder = 0;
+    xfer_early_ready = false;
+    xfer_busy = true;
+    multicore_fifo_push_blocking(command);
+}
+
+// returns true once the requested transfer has completed, with its FILE_OPS result in *result
+bool check_image_transfer(int *result)
+{
+    if (!xfer_busy || !multicore_fifo_rvalid())
+        return(false);
+    *result = multicore_fifo_pop_blocking();
+    xfer_busy = false;
+    return(true);
+}
+
+// returns true once a demand load has cylinder 0 in the SDRAM, while the rest is still loading
+bool demand_load_ready()
+{
+    return(xfer_early_ready);
+}
+
+int get_image_transfer_progress()
+{
+    return(xfer_progress_cylinder);
+}
@@ -8,10 +8,36 @@
 int file_open_read_disk_image();
 int file_open_write_disk_image();
 int file_close_disk_image();
+int file_commit_disk_image(Disk_State* dstate);
+int defragment_disk_image();
+int rollback_disk_image();
+int preopen_disk_image(Disk_State* dstate);
+void release_preopened_image();
+bool take_preopened_image();
 int read_image_file_header(Disk_State* dstate);
 int write_image_file_header(Disk_State* dstate);
 int read_disk_image_data(Disk_State* dstate);
 int write_disk_image_data(Disk_State* datate);
+int read_image_sector(Disk_State* dstate, int cylinder, int head, int sector, uint8_t *buf);
+int write_image_sector(Disk_State* dstate, int cylinder, int head, int sector, const uint8_t *buf);
 int file_init_and_mount();
+int fetch_dirty_sector_map(Disk_State* dstate);
+bool overlay_fold_pending();
+int checkpoint_disk_image(Disk_State* dstate);
+void record_cylinder_access(int cylinder);
+int save_cylinder_heat(Disk_State* dstate);
+void finish_checkpoint();
+int emergency_flush_disk_image(Disk_State* dstate);
+void retire_power_fail_journal();
+void start_image_transfer_engine();
+void request_image_transfer(int command, Disk_State* dstate);
+bool check_image_transfer(int *result);
+bool demand_load_ready();
+int get_image_transfer_progress();
+
+// image transfer engine commands
+#define IMAGE_XFER_LOAD   1
+#define IMAGE_XFER_UNLOAD 2
+#define IMAGE_XFER_DEMAND_LOAD 3
 
 #define FILE_OPS_OKAY 0
@@ -7,7 +7,9 @@
 from tkinter import Tk
 from tkinter import filedialog as fd
 from tkinter import simpledialog
+from tkinter import messagebox
 import sys
+import zlib
 from datetime import datetime
 
 def select_file():
@@ -33,6 +35,49 @@ def save_file():
         parent=root)
     return save_file_as
 
+# pack one track, a control byte 0-127 copies the next 1 to 128 bytes and a control byte 128-255
+# repeats 3 to 130 bytes from the distance back in the next two bytes, high first
+def pack_track(track):
+    packed = bytearray()
+    seen = {}
+    pos = 0
+    literal = 0
+    while (pos < len(track)):
+        best = 0
+        bestdistance = 0
+        candidates = [1, 2]
+        key = bytes(track[pos:pos+3])
+        if (len(key) == 3):
+            if key in seen:
+                candidates.append(pos - seen[key])
+            seen[key] = pos
+        for distance in candidates:
+            if (distance > pos):
+                continue
+            n = 0
+            while (pos + n < len(track)) and (n < 130) and (track[pos + n] == track[pos + n - distance]):
+                n += 1
+            if (n > best):
+                best = n
+                bestdistance = distance
+        if (best > 3) or (pos - literal == 128):
+            if (pos > literal):
+                packed.append(pos - literal - 1)
+                packed += track[literal:pos]
+            literal = pos
+        if (best > 3):
+            packed.append(0x80 | (best - 3))
+            packed.append(bestdistance >> 8)
+            packed.append(bestdistance & 0xff)
+            pos += best
+            literal = pos
+        else:
+            pos += 1
+    if (pos > literal):
+        packed.append(pos - literal - 1)
+        packed += track[literal:pos]
+    return packed
+
 def testhex(achar):
     if achar in '0123456789abcdefABCDEF':
         return True
@@ -78,7 +123,14 @@ ef.write(b'\x89')
 ef.write(bytearray('2315\r\n','utf-8'))
 ef.write(b'\x1A\x00\x00')
 #                                             version number 4 bytes null terminated 3b string
-ef.write(bytearray('1.3','utf-8'))
+#                                             version 2.1 has the header and each cylinder padded to 512 byte blocks
+#                                             and a block after the header marking the sectors of zeros
+#                                             version 3.0 packs each track, with a table of track offsets after the header
+compress = messagebox.askyesno("Compress", "Write a compressed cartridge image?", parent=root)
+if compress:
+    ef.write(bytearray('3.0','utf-8'))
+else:
+    ef.write(bytearray('2.1','utf-8'))
 ef.write(b'\x00')
 
 # get the desired cartridge number
@@ -145,15 +197,63 @@ ef.write(b'\x00\x00\x00\x08')
 ef.write(b'\x00\x00\x00\x02')
 #                                             uSec per sector int 4b
 ef.write(b'\x00\x00\x27\x10')
+#                                             image check 8 bytes, 3b null terminated "CRC" and an int 4b
+#                                             filled in once the sectors are read
+ef.write(b'CRC\x00\x00\x00\x00\x00')
+#                                             zeroes to the end of the first 512 byte block
+ef.write(b'\x00'*139)
 
 print ("header written")
 
+#                                             zero sector map block, one byte per cylinder with bit head*4+sector
+#                                             set when the sector is all zeros, the emulator fills those instead of reading them
+cylinders = []
+zeromap = bytearray(512)
 for cyl in range(203):
+    cyldata = bytearray()
     for head in range(2):
         for sector in range (4):
+            secdata = bytearray()
             for word in range(321):
-                ef.write(sf.read(1))
-                ef.write(sf.read(1))
+                secdata += sf.read(1)
+                secdata += sf.read(1)
+            if (secdata.count(0) == 642):
+                zeromap[cyl] |= 1 << ((head*4) + sector)
+            cyldata += secdata
+    cylinders.append(cyldata)
+
+#                                             the image check is the XOR of the CRC-32 of every sector taken over
+#                                             its sector number, 4 bytes high first, and its 642 bytes
+check = 0
+for slot in range(1624):
+    check ^= zlib.crc32(slot.to_bytes(4, "big") + cylinders[slot // 8][(slot % 8)*642:((slot % 8) + 1)*642])
+ef.seek(369, 0)
+ef.write(check.to_bytes(4, "big"))
+ef.seek(0, 2)
+
+if compress:
+#                                             406 track offsets and the end of the file, 4 bytes each high first,
+#                                             padded to 4 blocks, then the packed tracks
+    tracks = []
+    offsets = bytearray()
+    offset = 512 + 2048
+    for cyl in range(203):
+        for head in range(2):
+            tracks.append(pack_track(cylinders[cyl][head*2568:(head+1)*2568]))
+            offsets += offset.to_bytes(4, "big")
+            offset += len(tracks[-1])
+    offsets += offset.to_bytes(4, "big")
+    ef.write(offsets)
+    ef.write(b'\x00'*(2048 - len(offsets)))
+    for track in tracks:
+        ef.write(track)
+    print ('compressed to', (offset - 2560) * 100 // (203*8*642), 'percent')
+else:
+    ef.write(zeromap)
+    for cyl in range(203):
+        ef.write(cylinders[cyl])
+#                                             8 sectors of 642 bytes padded to 11 blocks
+        ef.write(b'\x00'*496)
 
 ef.close()
 sf.close()
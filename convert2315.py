@@ -9,6 +9,25 @@
 from tkinter import Tk
 from tkinter import filedialog as fd
 import sys
+import zlib
+
+# unpack one track of a version 3.0 file, a control byte 0-127 copies the next 1 to 128 bytes and
+# a control byte 128-255 repeats 3 to 130 bytes from the distance back in the next two bytes, high first
+def unpack_track(packed):
+    track = bytearray()
+    pos = 0
+    while (pos < len(packed)):
+        control = packed[pos]
+        pos += 1
+        if (control < 0x80):
+            track += packed[pos:pos + control + 1]
+            pos += control + 1
+        else:
+            distance = (packed[pos] << 8) | packed[pos + 1]
+            pos += 2
+            for n in range((control & 0x7f) + 3):
+                track.append(track[-distance])
+    return track
 
 def select_file():
     filetypes = (
@@ -51,8 +70,13 @@ if (sf == None):
     input("enter to exit")
     sys.exit(1)
 
+# version 1.3 files pack the header and sectors, version 2.0 files pad them to 512 byte blocks
+# and version 2.1 files add a block after the header marking the sectors of zeros
+# version 3.0 files pack each track, their size depends on the contents
+sizes = {b'1.3\x00': 1042973, b'2.0\x00': 1143808, b'2.1\x00': 1144320}
 sf.seek(0, 2)
-if (sf.tell() != 1042973):
+filesize = sf.tell()
+if (filesize < 2560):
     print('File is ',sf.tell(),' not the correct size, quitting')
     sf.close()
     input("enter to exit")
@@ -82,9 +106,15 @@ if (header != b'2315\r\n\x1a\x00\x00'):
     input("enter to exit")
     sys.exit(1)
     
-header = sf.read(4)
-if (header != b'1.3\x00'):
-    print('wrong version', header, ', quitting')
+version = sf.read(4)
+if (version not in sizes) and (version != b'3.0\x00'):
+    print('wrong version', version, ', quitting')
+    sf.close()
+    ef.close()
+    input("enter to exit")
+    sys.exit(1)
+if (version in sizes) and (filesize != sizes[version]):
+    print('File is ',filesize,' not the correct size for version', version, ', quitting')
     sf.close()
     ef.close()
     input("enter to exit")
@@ -117,19 +147,71 @@ print('Number of heads is', int.from_bytes(header, "big"))
 header = sf.read(4)
 print('uSeconds in a sector is', format(int.from_bytes(header, "big"), ","))
 
+# from version 2.0 on the header may hold an image check, a version 1.3 file has its first sector here
+headercrc = None
+if (version != b'1.3\x00'):
+    header = sf.read(4)
+    if (header == b'CRC\x00'):
+        headercrc = int.from_bytes(sf.read(4), "big")
+        print('Image check is', format(headercrc, "08x"))
+
 print('')
 
 print ("Header verified")
 
-for cyl in range(203):
-    for head in range(2):
-        for sector in range (4):
-            for word in range(321):
-                ef.write(sf.read(1))
-                ef.write(sf.read(1))
+# the file contents of a sector marked in the zero sector map are not used, it is written as zeros
+zeromap = bytes(512)
+if (version == b'2.0\x00'):
+    sf.seek(512, 0)
+if (version == b'2.1\x00'):
+    sf.seek(512, 0)
+    zeromap = sf.read(512)
+
+# version 3.0 has the file offset of each of the 406 tracks and of the end of the file after the header
+if (version == b'3.0\x00'):
+    sf.seek(512, 0)
+    offsets = []
+    for track in range(407):
+        offsets.append(int.from_bytes(sf.read(4), "big"))
+    for track in range(406):
+        sf.seek(offsets[track], 0)
+        data = unpack_track(sf.read(offsets[track + 1] - offsets[track]))
+        if (len(data) != 2568):
+            print('track', track, 'is damaged, quitting')
+            sf.close()
+            ef.close()
+            input("enter to exit")
+            sys.exit(1)
+        ef.write(data)
+
+else:
+    for cyl in range(203):
+        for head in range(2):
+            for sector in range (4):
+                if (zeromap[cyl] & (1 << ((head*4) + sector))):
+                    sf.read(642)
+                    ef.write(bytes(642))
+                    continue
+                for word in range(321):
+                    ef.write(sf.read(1))
+                    ef.write(sf.read(1))
+        if (version == b'2.0\x00') or (version == b'2.1\x00'):
+            sf.read(496)
 
 ef.close()
 sf.close()
+
+# the image check is the XOR of the CRC-32 of every sector taken over its sector number and its 642 bytes
+if (headercrc != None):
+    check = 0
+    rf = open(ef.name, 'rb')
+    for slot in range(1624):
+        check ^= zlib.crc32(slot.to_bytes(4, "big") + rf.read(642))
+    rf.close()
+    if (check != headercrc):
+        print('WARNING, the image check of the sectors is', format(check, "08x"), 'not the one in the header')
+    else:
+        print('Image check verified')
 print ('Conversion complete')
 print('')
 print('Put the output file on a microSD card and')
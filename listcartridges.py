@@ -26,11 +26,16 @@ def select_folder():
         parent=root)
     return filehandle
 
+# the size of each version of the file, as in convert2315.py
+# version 3.0 files pack each track, their size depends on the contents
+sizes = {b'1.3\x00': 1042973, b'2.0\x00': 1143808, b'2.1\x00': 1144320}
+
 def checkfile(path, fn):
     combined = path + '/' + fn
     sf = open (combined,'rb')
     sf.seek(0, 2)
-    if (sf.tell() != 1042973):
+    filesize = sf.tell()
+    if (filesize < 2560):
         sf.close()
         return
     sf.seek(0, 0)
@@ -43,7 +48,10 @@ def checkfile(path, fn):
         sf.close()
         return    
     header = sf.read(4)
-    if (header != b'1.3\x00'):
+    if (header not in sizes) and (header != b'3.0\x00'):
+        sf.close()
+        return
+    if (header in sizes) and (filesize != sizes[header]):
         sf.close()
         return
     cartnum = sf.read(11)
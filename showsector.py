@@ -9,6 +9,30 @@ from tkinter import Tk
 from tkinter import filedialog as fd
 from tkinter import simpledialog
 import sys
+import io
+
+# unpack one track of a version 3.0 file, a control byte 0-127 copies the next 1 to 128 bytes and
+# a control byte 128-255 repeats 3 to 130 bytes from the distance back in the next two bytes, high first
+def unpack_track(packed):
+    track = bytearray()
+    pos = 0
+    while (pos < len(packed)):
+        control = packed[pos]
+        pos += 1
+        if (control < 0x80):
+            track += packed[pos:pos + control + 1]
+            pos += control + 1
+        else:
+            distance = (packed[pos] << 8) | packed[pos + 1]
+            pos += 2
+            for n in range((control & 0x7f) + 3):
+                track.append(track[-distance])
+    return track
+
+# version 1.3 files pack the header and sectors, version 2.0 files pad them to 512 byte blocks
+# and version 2.1 files add a block after the header marking the sectors of zeros
+# version 3.0 files pack each track, their size depends on the contents
+sizes = {b'1.3\x00': 1042973, b'2.0\x00': 1143808, b'2.1\x00': 1144320}
 
 def select_file():
     filetypes = (
@@ -42,7 +66,8 @@ try:
         sys.exit(1)
 
     sf.seek(0, 2)
-    if (sf.tell() != (1042973)):
+    filesize = sf.tell()
+    if (filesize < 2560):
         print('File is not the correct size, quitting')
         sf.close()
         input("enter to exit")
@@ -63,9 +88,14 @@ try:
         input("enter to exit")
         sys.exit(1)
         
-    header = sf.read(4)
-    if (header != b'1.3\x00'):
-        print('wrong version', header, ', quitting')
+    version = sf.read(4)
+    if (version not in sizes) and (version != b'3.0\x00'):
+        print('wrong version', version, ', quitting')
+        sf.close()
+        input("enter to exit")
+        sys.exit(1)
+    if (version in sizes) and (filesize != sizes[version]):
+        print('File is ',filesize,' not the correct size for version', version, ', quitting')
         sf.close()
         input("enter to exit")
         sys.exit(1)
@@ -131,9 +161,29 @@ try:
         input("enter to exit")
         sys.exit(1)
 
-    skip = (cyl*8) + (head*4) + sector
-
-    sf.seek((skip*642),1)
+    # version 2.0 starts the sectors at the second block and pads each cylinder to 11 blocks
+    if (version == b'2.0\x00'):
+        sf.seek(512 + (cyl*5632) + (((head*4) + sector)*642), 0)
+    # version 2.1 moves the sectors down a block for the zero sector map, a marked sector is all zeros
+    elif (version == b'2.1\x00'):
+        sf.seek(512 + cyl, 0)
+        zeromap = sf.read(1)[0]
+        sf.seek(1024 + (cyl*5632) + (((head*4) + sector)*642), 0)
+        if (zeromap & (1 << ((head*4) + sector))):
+            sf.close()
+            sf = io.BytesIO(bytes(642))
+    # version 3.0 packs each track, the track is found in the table of offsets after the header and unpacked
+    elif (version == b'3.0\x00'):
+        sf.seek(512 + (((cyl*2) + head)*4), 0)
+        start = int.from_bytes(sf.read(4), "big")
+        end = int.from_bytes(sf.read(4), "big")
+        sf.seek(start, 0)
+        track = unpack_track(sf.read(end - start))
+        sf.close()
+        sf = io.BytesIO(bytes(track[sector*642:(sector+1)*642]))
+    else:
+        skip = (cyl*8) + (head*4) + sector
+        sf.seek((skip*642),1)
 
     print ("Displaying sector at","cylinder",cyl,"- hex",f"{cyl:#0{6}X}".replace("X","x"),"-","head",head,"sector",sector)
 